@@ -1,9 +1,14 @@
+if(CONFIG_BOARD_SMALLKB_NRF52840)
+board_runner_args(jlink "--device=nRF52840_xxAA" "--speed=4000")
+board_runner_args(pyocd "--target=nrf52840" "--frequency=4000000")
+else()
 board_runner_args(jlink "--device=nRF52832_xxAA" "--speed=4000")
 board_runner_args(pyocd "--target=nrf52832" "--frequency=4000000")
+endif()
 board_runner_args(nrfjprog "--softreset")
 
 include(${ZEPHYR_BASE}/boards/common/nrfjprog.board.cmake)
 include(${ZEPHYR_BASE}/boards/common/nrfutil.board.cmake)
 include(${ZEPHYR_BASE}/boards/common/jlink.board.cmake)
 include(${ZEPHYR_BASE}/boards/common/pyocd.board.cmake)
-include(${ZEPHYR_BASE}/boards/common/openocd-nrf5.board.cmake)
\ No newline at end of file
+include(${ZEPHYR_BASE}/boards/common/openocd-nrf5.board.cmake)
@@ -0,0 +1,64 @@
+#!/bin/sh
+# This file is ctlr_matrix.sh, builds the controller comparison images and tabulates their results
+#
+# コントローラの比較表 (bench.conf) を作る。
+#   scripts/ctlr_matrix.sh build [board]       両方のコントローラでビルドする (build_ctlr_ll, build_ctlr_sdc)
+#   scripts/ctlr_matrix.sh table ll.log sdc.log  それぞれを書き込んで取った RTT のログから表を作る
+#
+# ビルドしたイメージはストレステストのキー入力だけを有効にしてある (接続やペアリングの模擬はしない)。
+# ホストと接続してペアリングし、ストレステストが終わるまで (STRESS_DURATION_MS) ログを取る。
+# KEY_INTERVAL_MS を FAST_MODE_TIMEOUT (30 秒) より長くすると、slow のモードでの押下も測れる
+
+set -e
+
+APP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BOARD=${2:-SmallKB/nrf52832}
+KEY_INTERVAL_MS=${KEY_INTERVAL_MS:-2000}
+DURATION_MS=${DURATION_MS:-300000}
+
+build() {
+    for ctlr in ll sdc; do
+        west build -p -b "$BOARD" -d "$APP_DIR/build_ctlr_$ctlr" "$APP_DIR" -- \
+            -DEXTRA_CONF_FILE="ctlr_$ctlr.conf;bench.conf" \
+            -DEXTRA_CFLAGS="-DUSE_STRESS_TEST=1 -DSTRESS_KEY_BURST_INTERVAL_MS=$KEY_INTERVAL_MS \
+-DSTRESS_DURATION_MS=$DURATION_MS -DSTRESS_REPORT_INTERVAL_MS=$DURATION_MS \
+-DSTRESS_PAIRING_BTN_INTERVAL_MS=0 -DSTRESS_CONN_INTERVAL_MS=0 -DSTRESS_PAIRING_CB_INTERVAL_MS=0"
+    done
+}
+
+# ログの最後の統計 ("stress result" 以降) から、起動時のフットプリントとモードごとの行を拾う
+table_rows() {
+    awk -v name="$1" '
+        /BLE controller:/ { rom = $(NF - 4); ram = $(NF - 1) }
+        /---- stress result/ { result = 1 }
+        result && /^ctlr .*idle load/ { idle = $NF }
+        result && /^ctlr tier/ {
+            sub(":", "", $3)
+            printf "| %s | %s | %s | %s | %s | %s | %s | %s | %s | %s |\n",
+                name, rom, ram, idle ? idle : "-", $3, $6, $9, $12, $16, $19
+        }
+    ' "$2"
+}
+
+table() {
+    echo "| controller | ROM | RAM | idle load | mode | conn events | CPU us/event | reports | latency avg us | latency max us |"
+    echo "|---|---|---|---|---|---|---|---|---|---|"
+    table_rows "ll_sw_split" "$1"
+    table_rows "SDC" "$2"
+}
+
+case "$1" in
+build)
+    build
+    ;;
+table)
+    [ $# -eq 3 ] || { echo "usage: $0 table ll.log sdc.log" >&2; exit 2; }
+    table "$2" "$3"
+    ;;
+*)
+    echo "usage: $0 build [board] | table ll.log sdc.log" >&2
+    exit 2
+    ;;
+esac
+
+# End of ctlr_matrix.sh
@@ -0,0 +1,155 @@
+#!/bin/sh
+# This file is hub_bsim.sh, builds and runs the hub / node scenario on BabbleSim
+#
+# ハブモード (hub.conf) の BabbleSim のシナリオ。子機の登録から集約の遅延までを測る。
+#   scripts/hub_bsim.sh build        ハブ (build_hub) と子機 (build_node) を nrf52_bsim でビルドする
+#   scripts/hub_bsim.sh run [N]      子機 N 台 (既定 2) で動かし、ハブの "hub:" の統計の行を表示する
+#   scripts/hub_bsim.sh press [N]    押下の時刻の精度 (press_time.conf)。子機の接続のペリフェラル
+#                                    レイテンシ (PRESS_LATENCIES) ごとにビルドして動かし、誤差の行を表にする
+#
+# 両方ともストレステストのペアリングボタンだけを有効にし、PAIRING_BTN_INTERVAL_MS ごとに押す。
+# ペアリングモードで出会うと数値比較の確認を待ち、次の押下で両方が確認して子機を登録する。
+# 登録した後はフィルタアクセプトリストで再接続し、子機のキー入力をハブが集約する。
+# press では子機のキーをストレステストで模擬せず、BabbleSim の GPIO の刺激 (-gpio_in_file) でピンを
+# 動かす (gpio-keys とデバウンスを通る)。刺激は PRESS_START_MS から PRESS_PERIOD_MS ごとの押下
+# (チャタリング付き) と PRESS_HOLD_MS 後の解放で、子機ごとにずらし、接続イベントとの位相を乱数で変える。
+# 押下の時刻の誤差は、ハブが接続イベントから復元した時刻 ("hub: press est" の行、シミュレーションの時刻)
+# と、最も近い刺激のエッジ (正解) の差。
+# レイテンシを変えても誤差が変わらなければ、リンクのタイミングによらず押された順を決められる。
+# BSIM_OUT_PATH (BabbleSim のビルド結果) が必要
+
+set -e
+
+APP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+SIM_ID=${SIM_ID:-hub}
+PAIRING_BTN_INTERVAL_MS=${PAIRING_BTN_INTERVAL_MS:-2000}
+DURATION_MS=${DURATION_MS:-120000}
+# 子機の分のシミュレーション時間に少し余裕を持たせる (us)
+SIM_LENGTH_US=$(( (DURATION_MS + 10000) * 1000 ))
+
+PRESS_LATENCIES=${PRESS_LATENCIES:-"0 4 29"}
+# 刺激 (ms)。登録が終わってから始める
+PRESS_START_MS=${PRESS_START_MS:-30000}
+PRESS_PERIOD_MS=${PRESS_PERIOD_MS:-1000}
+PRESS_HOLD_MS=${PRESS_HOLD_MS:-100}
+PRESS_STAGGER_MS=${PRESS_STAGGER_MS:-150}  # 子機ごとのずれ (押下どうしを区別できる間隔)
+KEY_PORT=0
+KEY_PIN=18                                  # nrf52_bsim.overlay の key_button (アクティブ Low)
+
+STRESS_COMMON="-DUSE_STRESS_TEST=1 -DSTRESS_DURATION_MS=$DURATION_MS -DSTRESS_REPORT_INTERVAL_MS=$DURATION_MS \
+-DSTRESS_PAIRING_BTN_INTERVAL_MS=$PAIRING_BTN_INTERVAL_MS -DSTRESS_CONN_INTERVAL_MS=0 -DSTRESS_PAIRING_CB_INTERVAL_MS=0"
+
+# build_dir_suffix, 追加の conf (; 区切り), ハブに追加する CFLAGS, 子機に追加する CFLAGS
+build_pair() {
+    node_conf=$2
+    hub_conf="hub.conf${2:+;$2}"
+    west build -p -b nrf52_bsim -d "$APP_DIR/build_node$1" "$APP_DIR" -- \
+        ${node_conf:+-DEXTRA_CONF_FILE="$node_conf"} \
+        -DEXTRA_CFLAGS="$STRESS_COMMON $4"
+    west build -p -b nrf52_bsim -d "$APP_DIR/build_hub$1" "$APP_DIR" -- \
+        -DEXTRA_CONF_FILE="$hub_conf" \
+        -DEXTRA_CFLAGS="$STRESS_COMMON -DSTRESS_KEY_BURST_INTERVAL_MS=0 $3"
+}
+
+build() {
+    build_pair "" "" "" ""
+}
+
+# 子機 $1 のキーの刺激を $2 に、正解のエッジの時刻 (us) を $3 に追記する。
+# 行は "<時刻 us> <ポート> <ピン> <レベル>"
+gen_stimulus() {
+    awk -v node="$1" -v start="$PRESS_START_MS" -v period="$PRESS_PERIOD_MS" -v hold="$PRESS_HOLD_MS" \
+        -v stagger="$PRESS_STAGGER_MS" -v end="$DURATION_MS" -v port="$KEY_PORT" -v pin="$KEY_PIN" \
+        -v truth="$3" '
+        BEGIN {
+            srand(node)
+            printf "0 %d %d 1\n", port, pin
+            for (t = start * 1000 + node * stagger * 1000; t + hold * 1000 < end * 1000; t += period * 1000) {
+                # 接続イベントとの位相を変える (子機どうしの順序は変えない)
+                p = t + int(rand() * stagger * 500)
+                # 押下: 最初のエッジが正解。300us 間隔で 2 回チャタリングする
+                printf "%d %d %d 0\n%d %d %d 1\n%d %d %d 0\n", p, port, pin, p + 300, port, pin, p + 600, port, pin
+                printf "%d %d %d 1\n", p + hold * 1000, port, pin
+                print p >> truth
+                print p + hold * 1000 >> truth
+            }
+        }' > "$2"
+}
+
+# build_dir_suffix, 子機の数, 空でなければ子機のキーを刺激で動かす。ログは build_hub<suffix>/bsim_logs に置く
+run_pair() {
+    n=${2:-2}
+    [ -n "$BSIM_OUT_PATH" ] || { echo "BSIM_OUT_PATH is not set" >&2; exit 2; }
+    log_dir="$APP_DIR/build_hub$1/bsim_logs"
+    mkdir -p "$log_dir"
+    rm -f "$log_dir/truth.txt"
+
+    "$BSIM_OUT_PATH/bin/bs_2G4_phy_v1" -s="$SIM_ID$1" -D=$((n + 1)) -sim_length="$SIM_LENGTH_US" \
+        > "$log_dir/phy.log" 2>&1 &
+    "$APP_DIR/build_hub$1/zephyr/zephyr.exe" -s="$SIM_ID$1" -d=0 > "$log_dir/hub.log" 2>&1 &
+    i=1
+    while [ $i -le "$n" ]; do
+        # 子機ごとにキー入力の乱数を変える
+        stim=""
+        if [ -n "$3" ]; then
+            gen_stimulus $i "$log_dir/stim$i.txt" "$log_dir/truth.txt"
+            stim="-gpio_in_file=$log_dir/stim$i.txt"
+        fi
+        "$APP_DIR/build_node$1/zephyr/zephyr.exe" -s="$SIM_ID$1" -d=$i -rs=$i $stim > "$log_dir/node$i.log" 2>&1 &
+        i=$((i + 1))
+    done
+    wait
+}
+
+run() {
+    run_pair "" "$1"
+    grep "hub:" "$APP_DIR/build_hub/bsim_logs/hub.log"
+}
+
+# レイテンシごとに、ハブが復元した時刻と最も近い正解のエッジの差を集計する
+press() {
+    echo "| node latency | press samples | error avg us | error max us |"
+    echo "|---|---|---|---|"
+    for lat in $PRESS_LATENCIES; do
+        # 子機のキーは刺激で動かすので、ストレステストのキー入力は止める
+        build_pair "_press$lat" "ctlr_sdc.conf;press_time.conf" "-DHUB_NODE_LATENCY=$lat" \
+            "-DSTRESS_KEY_BURST_INTERVAL_MS=0" > /dev/null
+        run_pair "_press$lat" "$1" stim
+        log_dir="$APP_DIR/build_hub_press$lat/bsim_logs"
+        awk -v lat="$lat" '
+            FNR == NR { truth[++nt] = $1; next }
+            /hub: press est / {
+                est = $4
+                best = -1
+                for (i = 1; i <= nt; i++) {
+                    d = est - truth[i]
+                    if (d < 0) d = -d
+                    if (best < 0 || d < best) best = d
+                }
+                if (best < 0) next
+                n++
+                sum += best
+                if (best > max) max = best
+            }
+            END { printf "| %s | %d | %s | %s |\n", lat, n, n ? int(sum / n) : "-", n ? max : "-" }
+        ' "$log_dir/truth.txt" "$log_dir/hub.log"
+    done
+}
+
+case "$1" in
+build)
+    build
+    ;;
+run)
+    run "$2"
+    ;;
+press)
+    press "$2"
+    ;;
+*)
+    echo "usage: $0 build | run [nodes] | press [nodes]" >&2
+    exit 2
+    ;;
+esac
+
+# End of hub_bsim.sh
@@ -0,0 +1,63 @@
+#!/bin/sh
+# This file is stack_report.sh, builds the stack measurement image and tabulates the high-water marks
+#
+# スタックのサイズを決めるための表 (stack.conf) を作る。
+#   scripts/stack_report.sh build [board]   stack.conf とストレステストを重ねてビルドする (build_stack)
+#   scripts/stack_report.sh table log       書き込んで取った RTT のログから表を作る
+#
+# 使用量は未使用部分のパターンから求めるので、実機で測ること (nrf52_bsim / native_sim のスレッドは
+# ホストのスタックで動くので意味のある値が出ない)。
+# ストレステストはキー入力・ペアリングボタン・接続・ペアリングのコールバックを模擬するので、
+# ホストと接続してペアリングし、ストレステストが終わるまで (STRESS_DURATION_MS) ログを取る。
+# 提案値は最大使用量の MARGIN_PCT (%) 増しを 64 バイト単位に切り上げたもの
+
+set -e
+
+APP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BOARD=${2:-SmallKB/nrf52832}
+DURATION_MS=${DURATION_MS:-300000}
+MARGIN_PCT=${MARGIN_PCT:-25}
+
+build() {
+    west build -p -b "$BOARD" -d "$APP_DIR/build_stack" "$APP_DIR" -- \
+        -DEXTRA_CONF_FILE="stack.conf" \
+        -DEXTRA_CFLAGS="-DUSE_STRESS_TEST=1 -DSTRESS_DURATION_MS=$DURATION_MS \
+-DSTRESS_REPORT_INTERVAL_MS=$DURATION_MS"
+}
+
+# ログの最後の統計 ("stress result" 以降) のスレッドごとの行を拾う
+table() {
+    echo "| thread | used | size | suggested |"
+    echo "|---|---|---|---|"
+    awk -v margin="$MARGIN_PCT" '
+        /---- stress result/ { n = 0; result = 1 }
+        result && /^stack / && !/^stack total/ {
+            line = $0
+            sub(/^stack +/, "", line)
+            if (!match(line, / +[0-9]+\/ *[0-9]+ bytes/)) next
+            name = substr(line, 1, RSTART - 1)
+            split(substr(line, RSTART, RLENGTH), v, "/")
+            used = v[1] + 0
+            size = v[2] + 0
+            want = int((used * (100 + margin) / 100 + 63) / 64) * 64
+            rows[++n] = sprintf("| %s | %d | %d | %d |", name, used, size, want)
+        }
+        END { for (i = 1; i <= n; i++) print rows[i] }
+    ' "$1"
+}
+
+case "$1" in
+build)
+    build
+    ;;
+table)
+    [ $# -eq 2 ] || { echo "usage: $0 table log" >&2; exit 2; }
+    table "$2"
+    ;;
+*)
+    echo "usage: $0 build [board] | table log" >&2
+    exit 2
+    ;;
+esac
+
+# End of stack_report.sh
@@ -0,0 +1,103 @@
+#!/bin/sh
+# This file is usb_sim.sh, checks the wired USB HID mode on native_sim over USB/IP
+#
+# USB HID (有線モード) の確認。native_sim のイメージを USB/IP でこのホストに接続し、
+# キーのレポートが hidraw に届くことを確かめる。
+#   scripts/usb_sim.sh build     native_sim でビルドする (build_usb_sim)
+#   scripts/usb_sim.sh check     動かして USB/IP で接続し、レポートを 1 つ読む。届けば 0 で終わる
+#
+# ストレステストのキー入力だけを有効にし、KEY_INTERVAL_MS ごとに押下/解放する。
+# BLE はホストのアダプタ (BT_DEV、既定 hci0) を HCI User Channel で使う。
+# root 権限と usbip (linux-tools)、vhci-hcd モジュールが必要
+
+set -e
+
+APP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR="$APP_DIR/build_usb_sim"
+BT_DEV=${BT_DEV:-hci0}
+KEY_INTERVAL_MS=${KEY_INTERVAL_MS:-1000}
+TIMEOUT_S=${TIMEOUT_S:-30}
+# boards/native_sim.conf の CONFIG_USB_DEVICE_VID / PID (pid.codes のテスト用 ID)
+USB_ID=${USB_ID:-1209:0001}
+
+build() {
+    west build -p -b native_sim --no-sysbuild -d "$BUILD_DIR" "$APP_DIR" -- \
+        -DEXTRA_CFLAGS="-DUSE_STRESS_TEST=1 -DSTRESS_KEY_BURST_INTERVAL_MS=$KEY_INTERVAL_MS \
+-DSTRESS_PAIRING_BTN_INTERVAL_MS=0 -DSTRESS_CONN_INTERVAL_MS=0 -DSTRESS_PAIRING_CB_INTERVAL_MS=0"
+}
+
+# USB_ID の hidraw のデバイスを探す
+find_hidraw() {
+    vid=$(echo "$USB_ID" | cut -d: -f1 | tr a-f A-F)
+    pid=$(echo "$USB_ID" | cut -d: -f2 | tr a-f A-F)
+    for d in /sys/class/hidraw/hidraw*; do
+        [ -e "$d/device/uevent" ] || continue
+        if grep -qi "HID_ID=0003:0000$vid:0000$pid" "$d/device/uevent"; then
+            echo "/dev/$(basename "$d")"
+            return 0
+        fi
+    done
+    return 1
+}
+
+cleanup() {
+    usbip port 2>/dev/null | sed -n 's/^Port \([0-9]*\):.*/\1/p' | while read -r port; do
+        usbip detach -p "$port" > /dev/null 2>&1 || true
+    done
+    [ -n "$exe_pid" ] && kill "$exe_pid" 2>/dev/null || true
+}
+
+check() {
+    [ "$(id -u)" = 0 ] || { echo "must run as root" >&2; exit 2; }
+    [ -x "$BUILD_DIR/zephyr/zephyr.exe" ] || { echo "run '$0 build' first" >&2; exit 2; }
+    modprobe vhci-hcd
+
+    log="$BUILD_DIR/usb_sim.log"
+    "$BUILD_DIR/zephyr/zephyr.exe" --bt-dev="$BT_DEV" > "$log" 2>&1 &
+    exe_pid=$!
+    trap cleanup EXIT
+
+    # USB/IP のサーバが立ち上がるのを待って接続する
+    i=0
+    until usbip list -r localhost 2>/dev/null | grep -q "1-1"; do
+        i=$((i + 1))
+        [ $i -le "$TIMEOUT_S" ] || { echo "FAIL: USB/IP server not up"; exit 1; }
+        sleep 1
+    done
+    usbip attach -r localhost -b 1-1
+
+    i=0
+    until dev=$(find_hidraw); do
+        i=$((i + 1))
+        [ $i -le "$TIMEOUT_S" ] || { echo "FAIL: no hidraw for $USB_ID"; exit 1; }
+        sleep 1
+    done
+
+    # 0 でないバイトのあるレポート (押下) を待つ
+    report=$(timeout "$TIMEOUT_S" sh -c '
+        while :; do
+            r=$(head -c 8 "$1" | od -An -tx1)
+            if echo "$r" | awk "{ for (i = 1; i <= NF; i++) if (\$i != \"00\") found = 1 } END { exit !found }"; then
+                echo $r
+                exit 0
+            fi
+        done' sh "$dev") || { echo "FAIL: no key report on $dev"; exit 1; }
+
+    echo "PASS: $USB_ID on $dev, report $report"
+    grep "USB" "$log" || true
+}
+
+case "$1" in
+build)
+    build
+    ;;
+check)
+    check
+    ;;
+*)
+    echo "usage: $0 build | check" >&2
+    exit 2
+    ;;
+esac
+
+# End of usb_sim.sh
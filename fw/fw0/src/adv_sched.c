@@ -0,0 +1,187 @@
+/* This file is adv_sched.c, adaptive advertising interval scheduler */
+
+#include "includes.h"
+#include "events.h"
+#include "adv_sched.h"
+#include "deadline.h"
+
+// アドバタイズ間隔の単位
+#define ADV_TIME_UNIT_IN_US 625
+#define ADV_MS(ms) ((ms) * 1000 / ADV_TIME_UNIT_IN_US)
+
+// アドバタイズイベントごとに付加されるランダム遅延 (0～10ms) の平均
+#define ADV_DELAY_AVG_US 5000
+
+struct adv_phase {
+    uint16_t interval_min;  // 単位: 0.625ms
+    uint16_t interval_max;
+    uint32_t duration_ms;   // このフェーズを続ける時間。0 なら以後ずっと
+};
+
+// 最初は高速バーストで素早く接続させ、ホストが見つからなければ段階的に間隔を広げる
+static const struct adv_phase adv_phases[ADV_SCHED_PHASE_COUNT] = {
+    { ADV_MS(20),   ADV_MS(30),   30000 },  // 高速バースト
+    { ADV_MS(100),  ADV_MS(150),  30000 },
+    { ADV_MS(300),  ADV_MS(500),  60000 },
+    { ADV_MS(1000), ADV_MS(2000), 0 },      // 低頻度 (ホストがいない場合)
+};
+
+// フェーズの切り替えは多少遅れても構わない
+static void adv_phase_timeout_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(adv_phase_timer, adv_phase_timeout_handler, 2000);
+
+// 以下の状態は BT のコールバックからも参照されるので、スピンロックで保護する
+static struct k_spinlock lock;
+static uint8_t phase;
+static bool advertising;
+static int64_t session_start;   // 高速バーストを開始した時刻 (接続までの時間の起点)
+static int64_t phase_start;     // 現在のフェーズを開始した時刻
+
+static uint32_t phase_time_ms[ADV_SCHED_PHASE_COUNT];
+static uint32_t phase_connects[ADV_SCHED_PHASE_COUNT];
+static uint32_t phase_ttc_max_ms[ADV_SCHED_PHASE_COUNT];
+static uint64_t phase_ttc_sum_ms[ADV_SCHED_PHASE_COUNT];
+
+// フェーズ切り替えタイマーのハンドラ
+static void adv_phase_timeout_handler(struct deadline *dummy)
+{
+    post_event(EVENT_ADV_SCHEDULE);
+}
+
+// 現在のフェーズのタイマーを開始する
+static void start_phase_timer(void)
+{
+    if (adv_phases[phase].duration_ms) {
+        deadline_start(&adv_phase_timer, K_MSEC(adv_phases[phase].duration_ms), K_NO_WAIT);
+    } else {
+        deadline_stop(&adv_phase_timer);
+    }
+}
+
+// 現在のフェーズで経過した時間を集計する (ロック取得済みで呼ぶこと)
+static void account_phase(int64_t now)
+{
+    if (advertising) {
+        phase_time_ms[phase] += (uint32_t)(now - phase_start);
+    }
+    phase_start = now;
+}
+
+void adv_sched_get_param(struct bt_le_adv_param *param)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    param->interval_min = adv_phases[phase].interval_min;
+    param->interval_max = adv_phases[phase].interval_max;
+    k_spin_unlock(&lock, key);
+}
+
+void adv_sched_started(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int64_t now = k_uptime_get();
+    if (!advertising) {
+        session_start = now;
+    }
+    account_phase(now);
+    advertising = true;
+    k_spin_unlock(&lock, key);
+
+    start_phase_timer();
+}
+
+void adv_sched_stopped(void)
+{
+    deadline_stop(&adv_phase_timer);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    account_phase(k_uptime_get());
+    advertising = false;
+    // 次にアドバタイズを開始するときは高速バーストから
+    phase = 0;
+    k_spin_unlock(&lock, key);
+}
+
+bool adv_sched_advance(void)
+{
+    bool changed = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (advertising && phase + 1 < ADV_SCHED_PHASE_COUNT) {
+        account_phase(k_uptime_get());
+        phase++;
+        changed = true;
+    }
+    k_spin_unlock(&lock, key);
+
+    if (changed) {
+        printk("Advertising phase %d (%d-%d ms)\n", phase,
+            adv_phases[phase].interval_min * ADV_TIME_UNIT_IN_US / 1000,
+            adv_phases[phase].interval_max * ADV_TIME_UNIT_IN_US / 1000);
+    }
+    return changed;
+}
+
+bool adv_sched_reset(void)
+{
+    bool changed = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int64_t now = k_uptime_get();
+    account_phase(now);
+    if (phase != 0) {
+        phase = 0;
+        changed = advertising;
+    }
+    session_start = now;
+    k_spin_unlock(&lock, key);
+
+    if (advertising) {
+        start_phase_timer();
+    }
+    return changed;
+}
+
+void adv_sched_connected(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (advertising) {
+        uint32_t ttc = (uint32_t)(k_uptime_get() - session_start);
+        phase_connects[phase]++;
+        phase_ttc_sum_ms[phase] += ttc;
+        if (ttc > phase_ttc_max_ms[phase]) phase_ttc_max_ms[phase] = ttc;
+        printk("Connected after %u ms of advertising (phase %d)\n", ttc, phase);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void adv_sched_get_stats(struct adv_sched_phase_stats stats[ADV_SCHED_PHASE_COUNT])
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    account_phase(k_uptime_get());
+    for (int i = 0; i < ADV_SCHED_PHASE_COUNT; i++) {
+        uint32_t period_us = (adv_phases[i].interval_min + adv_phases[i].interval_max) / 2
+            * ADV_TIME_UNIT_IN_US + ADV_DELAY_AVG_US;
+        stats[i].adv_events = (uint32_t)((uint64_t)phase_time_ms[i] * 1000 / period_us);
+        stats[i].time_ms = phase_time_ms[i];
+        stats[i].connects = phase_connects[i];
+        stats[i].time_to_connect_max_ms = phase_ttc_max_ms[i];
+        stats[i].time_to_connect_avg_ms =
+            phase_connects[i] ? (uint32_t)(phase_ttc_sum_ms[i] / phase_connects[i]) : 0;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void adv_sched_print_stats(void)
+{
+    struct adv_sched_phase_stats stats[ADV_SCHED_PHASE_COUNT];
+
+    adv_sched_get_stats(stats);
+    for (int i = 0; i < ADV_SCHED_PHASE_COUNT; i++) {
+        printk("adv phase %d: %u events, %u ms, %u connects, ttc avg %u ms max %u ms\n", i,
+            stats[i].adv_events, stats[i].time_ms, stats[i].connects,
+            stats[i].time_to_connect_avg_ms, stats[i].time_to_connect_max_ms);
+    }
+}
+
+
+/* End of adv_sched.c */
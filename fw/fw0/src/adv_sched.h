@@ -0,0 +1,46 @@
+/* This file is adv_sched.h, adaptive advertising interval scheduler */
+
+#ifndef ADV_SCHED_H_
+#define ADV_SCHED_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+// アドバタイズのフェーズ数 (高速バースト → 段階的に間隔を広げる)
+#define ADV_SCHED_PHASE_COUNT 4
+
+// フェーズごとの統計情報
+struct adv_sched_phase_stats {
+    uint32_t adv_events;        // 送信したアドバタイズイベント数 (平均間隔からの推定値)
+    uint32_t time_ms;           // このフェーズでアドバタイズしていた合計時間
+    uint32_t connects;          // このフェーズ中に接続された回数
+    uint32_t time_to_connect_max_ms;  // 開始から接続までの最大時間
+    uint32_t time_to_connect_avg_ms;  // 同平均
+};
+
+// 現在のフェーズの間隔を param に設定する (interval_min / interval_max のみ)
+void adv_sched_get_param(struct bt_le_adv_param *param);
+
+// アドバタイズを開始/停止したときに呼ぶ。メインループから呼ぶこと
+void adv_sched_started(void);
+void adv_sched_stopped(void);
+
+// フェーズ切り替えのイベント (EVENT_ADV_SCHEDULE) を受けたときに呼ぶ。
+// アドバタイズ間隔が変わった場合は真を返すので、呼び出し側はアドバタイズを再開すること
+bool adv_sched_advance(void);
+
+// スケジュールを高速バーストに戻す (ボタン押下やペアリング開始時)。
+// アドバタイズ間隔が変わった場合は真を返す
+bool adv_sched_reset(void);
+
+// 接続されたときに呼ぶ。BT のコールバックから呼び出し可能
+void adv_sched_connected(void);
+
+void adv_sched_get_stats(struct adv_sched_phase_stats stats[ADV_SCHED_PHASE_COUNT]);
+void adv_sched_print_stats(void);
+
+#endif /* ADV_SCHED_H_ */
+
+
+/* End of adv_sched.h */
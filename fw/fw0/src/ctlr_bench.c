@@ -0,0 +1,186 @@
+/* This file is ctlr_bench.c, BLE controller footprint / CPU / report latency benchmark */
+
+#include "includes.h"
+#include <zephyr/linker/linker-defs.h>
+#if defined(CONFIG_NRF_CPU_LOAD)
+#include <debug/cpu_load.h>
+#endif
+#include "ctlr_bench.h"
+
+// コントローラはビルド時に選ぶ (ctlr_ll.conf / ctlr_sdc.conf)
+#if defined(CONFIG_BT_LL_SW_SPLIT)
+#define CTLR_NAME "Zephyr LL (ll_sw_split)"
+#elif defined(CONFIG_BT_LL_SOFTDEVICE)
+#define CTLR_NAME "SoftDevice Controller"
+#else
+#define CTLR_NAME "external (HCI)"
+#endif
+
+struct bench_tier {
+    uint32_t time_ms;
+    uint32_t conn_events;
+    uint64_t busy_us;
+    uint32_t reports;
+    uint32_t latency_max_us;
+    uint64_t latency_sum_us;
+};
+
+// 送信完了コールバックは BT のスレッドから、CPU 負荷の集計はシステムワークキューから
+// 呼ばれるのでミューテックスで保護する
+static K_MUTEX_DEFINE(bench_mutex);
+static struct bench_tier tiers[METRICS_MODE_COUNT];
+static uint32_t idle_time_ms;
+static uint64_t idle_busy_us;
+
+#if defined(CONFIG_NRF_CPU_LOAD)
+
+static uint32_t window_start;
+
+static void ctlr_bench_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(ctlr_bench_work, ctlr_bench_work_handler);
+
+struct event_count {
+    uint32_t window_ms;
+    uint32_t events;
+    bool connected;
+};
+
+// 集計間隔中の接続イベントの数を接続間隔とペリフェラルレイテンシから見積もる
+static void count_events(struct bt_conn *conn, void *data)
+{
+    struct event_count *ec = data;
+    struct bt_conn_info info;
+
+    if (bt_conn_get_info(conn, &info) || info.state != BT_CONN_STATE_CONNECTED) return;
+
+    uint32_t period_us = info.le.interval * 1250U * (info.le.latency + 1U);
+    if (period_us) {
+        ec->events += (uint32_t)((uint64_t)ec->window_ms * 1000 / period_us);
+        ec->connected = true;
+    }
+}
+
+static void ctlr_bench_work_handler(struct k_work *work)
+{
+    uint32_t now = k_uptime_get_32();
+    struct event_count ec = { .window_ms = now - window_start };
+
+    // 負荷は 0.001% 単位 (100000 で 100%)
+    uint32_t load = (uint32_t)cpu_load_get();
+    cpu_load_reset();
+    window_start = now;
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, count_events, &ec);
+    uint64_t busy_us = (uint64_t)load * ec.window_ms / 100;
+
+    k_mutex_lock(&bench_mutex, K_FOREVER);
+    if (ec.connected) {
+        // 集計間隔の途中でモードが変わっても、間隔の終わりのモードにまとめて数える
+        struct bench_tier *t = &tiers[metrics_get_mode()];
+        t->time_ms += ec.window_ms;
+        t->conn_events += ec.events;
+        t->busy_us += busy_us;
+    } else {
+        idle_time_ms += ec.window_ms;
+        idle_busy_us += busy_us;
+    }
+    k_mutex_unlock(&bench_mutex);
+
+    k_work_reschedule(&ctlr_bench_work, K_MSEC(CTLR_BENCH_INTERVAL_MS));
+}
+
+#endif /* CONFIG_NRF_CPU_LOAD */
+
+static void get_footprint(uint32_t *rom, uint32_t *ram)
+{
+#if defined(CONFIG_ARCH_POSIX)
+    // native_sim はホストのプロセスなので意味のある値がない
+    *rom = 0;
+    *ram = 0;
+#else
+    // ROM は初期値付きデータのコピーを含める
+    *rom = (uint32_t)(__rom_region_end - __rom_region_start) +
+           (uint32_t)(__data_region_end - __data_region_start);
+    *ram = (uint32_t)(_image_ram_end - _image_ram_start);
+#endif
+}
+
+void ctlr_bench_init(void)
+{
+    uint32_t rom, ram;
+
+    get_footprint(&rom, &ram);
+    printk("BLE controller: %s, ROM %u bytes, RAM %u bytes\n", CTLR_NAME, rom, ram);
+
+#if defined(CONFIG_NRF_CPU_LOAD)
+    cpu_load_reset();
+    window_start = k_uptime_get_32();
+    k_work_reschedule(&ctlr_bench_work, K_MSEC(CTLR_BENCH_INTERVAL_MS));
+#endif
+}
+
+void ctlr_bench_report_done(struct bt_conn *conn, const struct notify_track *n)
+{
+    // キー入力によらない送信は数えない
+    if (!n->edge_cycles) return;
+
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - n->edge_cycles);
+
+    k_mutex_lock(&bench_mutex, K_FOREVER);
+    struct bench_tier *t = &tiers[metrics_get_mode()];
+    t->reports++;
+    t->latency_sum_us += us;
+    if (us > t->latency_max_us) t->latency_max_us = us;
+    k_mutex_unlock(&bench_mutex);
+}
+
+void ctlr_bench_get_stats(struct ctlr_bench_stats *stats)
+{
+    stats->controller = CTLR_NAME;
+    get_footprint(&stats->rom_bytes, &stats->ram_bytes);
+    stats->cpu_load = IS_ENABLED(CONFIG_NRF_CPU_LOAD);
+
+    k_mutex_lock(&bench_mutex, K_FOREVER);
+    stats->idle_load = idle_time_ms ? (uint32_t)(idle_busy_us * 100 / idle_time_ms) : 0;
+    for (int i = 0; i < METRICS_MODE_COUNT; i++) {
+        const struct bench_tier *t = &tiers[i];
+        struct ctlr_bench_tier *s = &stats->tiers[i];
+
+        s->time_ms = t->time_ms;
+        s->conn_events = t->conn_events;
+        s->cpu_us_per_event = t->conn_events ? (uint32_t)(t->busy_us / t->conn_events) : 0;
+        s->reports = t->reports;
+        s->latency_max_us = t->latency_max_us;
+        s->latency_avg_us = t->reports ? (uint32_t)(t->latency_sum_us / t->reports) : 0;
+    }
+    k_mutex_unlock(&bench_mutex);
+}
+
+void ctlr_bench_print_stats(void)
+{
+    static const char *const tier_names[METRICS_MODE_COUNT] = {
+        [METRICS_MODE_SLOW] = "slow",
+        [METRICS_MODE_FAST] = "fast",
+        [METRICS_MODE_DFU] = "dfu",
+    };
+    struct ctlr_bench_stats st;
+
+    ctlr_bench_get_stats(&st);
+    printk("ctlr %s: ROM %u RAM %u", st.controller, st.rom_bytes, st.ram_bytes);
+    if (st.cpu_load) {
+        printk(", idle load %u.%03u%%", st.idle_load / 1000, st.idle_load % 1000);
+    }
+    printk("\n");
+    for (int i = 0; i < METRICS_MODE_COUNT; i++) {
+        const struct ctlr_bench_tier *t = &st.tiers[i];
+
+        if (t->time_ms == 0 && t->reports == 0) continue;
+        printk("ctlr tier %s: %u ms, %u conn events, %u us CPU/event, "
+               "%u reports, latency avg %u us max %u us\n",
+            tier_names[i], t->time_ms, t->conn_events, t->cpu_us_per_event,
+            t->reports, t->latency_avg_us, t->latency_max_us);
+    }
+}
+
+
+/* End of ctlr_bench.c */
@@ -0,0 +1,46 @@
+/* This file is ctlr_bench.h, BLE controller footprint / CPU / report latency benchmark */
+
+#ifndef CTLR_BENCH_H_
+#define CTLR_BENCH_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+#include "metrics.h"
+#include "notify_track.h"
+
+#define CTLR_BENCH_INTERVAL_MS 1000     // CPU 負荷を集計する間隔
+
+// 接続パラメータのモード (metrics_mode) ごとの集計
+struct ctlr_bench_tier {
+    uint32_t time_ms;               // このモードで接続していた時間 (CPU 負荷を計測できた分)
+    uint32_t conn_events;           // 接続イベントの数 (接続間隔とペリフェラルレイテンシからの推定値)
+    uint32_t cpu_us_per_event;      // 接続イベントあたりの CPU 時間 (アプリケーションの処理を含む)
+    uint32_t reports;               // 送信が完了したレポートの数
+    uint32_t latency_avg_us;        // キーのエッジからレポートの送信完了まで
+    uint32_t latency_max_us;
+};
+
+struct ctlr_bench_stats {
+    const char *controller;         // ビルドしたコントローラの名前
+    uint32_t rom_bytes;             // イメージの ROM 使用量 (リンカのシンボルから)
+    uint32_t ram_bytes;             // 静的 RAM 使用量 (スタック・ヒープ・コントローラのメモリプールを含む)
+    bool cpu_load;                  // CPU 負荷を計測している (CONFIG_NRF_CPU_LOAD)
+    uint32_t idle_load;             // 接続していないときの CPU 負荷 (0.001% 単位)
+    struct ctlr_bench_tier tiers[METRICS_MODE_COUNT];
+};
+
+// bt_enable() の後に呼ぶ。コントローラとフットプリントを表示し、CPU 負荷の集計を始める
+void ctlr_bench_init(void);
+
+// レポートの送信完了コールバックで、完了したレポートの記録 (notify_track_peek() で見たもの) と共に呼ぶ。
+// キーのエッジから送信完了までの遅延は記録の edge_cycles から求める
+void ctlr_bench_report_done(struct bt_conn *conn, const struct notify_track *n);
+
+void ctlr_bench_get_stats(struct ctlr_bench_stats *stats);
+void ctlr_bench_print_stats(void);
+
+#endif /* CTLR_BENCH_H_ */
+
+
+/* End of ctlr_bench.h */
@@ -0,0 +1,165 @@
+/* This file is deadline.c, single-timer deadline scheduler for application timeouts */
+
+#include "includes.h"
+#include "deadline.h"
+
+static void deadline_timer_handler(struct k_timer *dummy);
+K_TIMER_DEFINE(deadline_timer, deadline_timer_handler, NULL);
+
+// 期限の早い順に並べたデッドラインのリスト
+static sys_slist_t deadlines = SYS_SLIST_STATIC_INIT(&deadlines);
+static struct k_spinlock lock;
+static int64_t armed_at = -1;   // deadline_timer が起床する時刻 (-1 なら停止中)
+
+static uint32_t stat_expiries;
+static uint32_t stat_wakeups;
+static int64_t stat_since;
+
+// 期限の順にリストへ挿入する (ロック取得済みで呼ぶこと)
+static void insert_sorted(struct deadline *dl)
+{
+    struct deadline *cur;
+    struct deadline *prev = NULL;
+
+    SYS_SLIST_FOR_EACH_CONTAINER(&deadlines, cur, node) {
+        if (cur->expiry > dl->expiry) break;
+        prev = cur;
+    }
+    if (prev) {
+        sys_slist_insert(&deadlines, &prev->node, &dl->node);
+    } else {
+        sys_slist_prepend(&deadlines, &dl->node);
+    }
+    dl->active = true;
+}
+
+// 次の起床時刻を決めてタイマーを設定する (ロック取得済みで呼ぶこと)。
+// 最も早い期限で起床するのが基本で、slack は他のデッドラインとまとめるためだけに使う。
+// 期限の早い順に、それまでのすべての「期限 + slack」に間に合う期限があれば、そこまで起床を遅らせて
+// 一度の起床でまとめて処理する。まとめる相手がなければ、自分の期限で起床する
+static void rearm(void)
+{
+    struct deadline *cur;
+    int64_t wake = -1;
+    int64_t latest = -1;    // ここまでのデッドラインが遅れてよい限度
+
+    SYS_SLIST_FOR_EACH_CONTAINER(&deadlines, cur, node) {
+        if (wake >= 0 && cur->expiry > latest) break;
+        wake = cur->expiry;
+
+        int64_t limit = cur->expiry + k_ms_to_ticks_floor32(cur->slack_ms);
+        if (latest < 0 || limit < latest) latest = limit;
+    }
+
+    if (wake == armed_at) return;   // 変わらないならタイマーを触らない
+
+    armed_at = wake;
+    if (wake < 0) {
+        k_timer_stop(&deadline_timer);
+    } else {
+        k_timer_start(&deadline_timer, K_TIMEOUT_ABS_TICKS(wake), K_NO_WAIT);
+    }
+}
+
+static void deadline_timer_handler(struct k_timer *dummy)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int64_t now = k_uptime_ticks();
+
+    armed_at = -1;
+    stat_wakeups++;
+
+    while (true) {
+        sys_snode_t *head = sys_slist_peek_head(&deadlines);
+        if (!head) break;
+
+        struct deadline *dl = CONTAINER_OF(head, struct deadline, node);
+        if (dl->expiry > now) break;
+
+        sys_slist_get_not_empty(&deadlines);
+        dl->active = false;
+        if (dl->period) {
+            dl->expiry += dl->period;
+            if (dl->expiry <= now) dl->expiry = now + dl->period; // 遅れた分は捨てる
+            insert_sorted(dl);
+        }
+        stat_expiries++;
+
+        // ハンドラの中でデッドラインを開始/停止できるように、ロックを外して呼ぶ
+        k_spin_unlock(&lock, key);
+        dl->handler(dl);
+        key = k_spin_lock(&lock);
+    }
+
+    rearm();
+    k_spin_unlock(&lock, key);
+}
+
+void deadline_start(struct deadline *dl, k_timeout_t duration, k_timeout_t period)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (dl->active) {
+        sys_slist_find_and_remove(&deadlines, &dl->node);
+    }
+    dl->expiry = k_uptime_ticks() + duration.ticks;
+    dl->period = K_TIMEOUT_EQ(period, K_NO_WAIT) || K_TIMEOUT_EQ(period, K_FOREVER) ? 0 : period.ticks;
+    insert_sorted(dl);
+    rearm();
+
+    k_spin_unlock(&lock, key);
+}
+
+void deadline_stop(struct deadline *dl)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (dl->active) {
+        sys_slist_find_and_remove(&deadlines, &dl->node);
+        dl->active = false;
+        rearm();
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+bool deadline_is_active(const struct deadline *dl)
+{
+    return dl->active;
+}
+
+void deadline_get_stats(struct deadline_stats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats->elapsed_ms = (uint32_t)(k_uptime_get() - stat_since);
+    stats->expiries = stat_expiries;
+    stats->wakeups = stat_wakeups;
+    k_spin_unlock(&lock, key);
+}
+
+void deadline_print_stats(void)
+{
+    struct deadline_stats st;
+
+    deadline_get_stats(&st);
+    if (st.elapsed_ms == 0) return;
+
+    // 1 秒あたりの回数を 1/100 単位で表示する
+    uint32_t before = (uint32_t)((uint64_t)st.expiries * 100000 / st.elapsed_ms);
+    uint32_t after = (uint32_t)((uint64_t)st.wakeups * 100000 / st.elapsed_ms);
+    printk("timer wakeups/s: %u.%02u without coalescing, %u.%02u coalesced (%u/%u in %u ms)\n",
+        before / 100, before % 100, after / 100, after % 100,
+        st.wakeups, st.expiries, st.elapsed_ms);
+}
+
+void deadline_reset_stats(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stat_expiries = 0;
+    stat_wakeups = 0;
+    stat_since = k_uptime_get();
+    k_spin_unlock(&lock, key);
+}
+
+
+/* End of deadline.c */
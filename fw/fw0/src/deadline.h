@@ -0,0 +1,50 @@
+/* This file is deadline.h, single-timer deadline scheduler for application timeouts */
+
+#ifndef DEADLINE_H_
+#define DEADLINE_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/slist.h>
+
+// アプリケーションのタイムアウトをすべて一つの k_timer で扱うためのスケジューラ。
+// 各デッドラインには許容遅延 (slack) を指定でき、期限から slack までの間に他のデッドラインの
+// 期限があれば、そこまで遅らせてまとめて一度のウェイクアップで処理される。
+// まとめる相手がなければ期限どおりに処理する (slack の分だけ遅れることはない)。
+// ハンドラは k_timer と同じくタイマー ISR から呼ばれる。
+
+struct deadline;
+typedef void (*deadline_handler_t)(struct deadline *dl);
+
+struct deadline {
+    sys_snode_t node;
+    deadline_handler_t handler;
+    uint32_t slack_ms;      // 期限からこの時間までなら遅れてよい
+    int64_t expiry;         // 期限 (k_uptime_ticks() の値)
+    uint32_t period;        // 周期 (ticks)。0 なら一度きり
+    bool active;
+};
+
+// K_TIMER_DEFINE と同じように静的に定義する
+#define DEADLINE_DEFINE(name, expiry_fn, slack) \
+    struct deadline name = { .handler = (expiry_fn), .slack_ms = (slack) }
+
+// k_timer_start() / k_timer_stop() と同じ使い方
+void deadline_start(struct deadline *dl, k_timeout_t duration, k_timeout_t period);
+void deadline_stop(struct deadline *dl);
+bool deadline_is_active(const struct deadline *dl);
+
+// 統計情報
+struct deadline_stats {
+    uint32_t elapsed_ms;    // 統計を取り始めてからの時間
+    uint32_t expiries;      // ハンドラを呼んだ回数 (個別の k_timer なら、ほぼこの回数だけ起床する)
+    uint32_t wakeups;       // 実際にタイマーで起床した回数
+};
+
+void deadline_get_stats(struct deadline_stats *stats);
+void deadline_print_stats(void);
+void deadline_reset_stats(void);
+
+#endif /* DEADLINE_H_ */
+
+
+/* End of deadline.h */
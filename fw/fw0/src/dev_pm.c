@@ -0,0 +1,244 @@
+/* This file is dev_pm.c, reference-counted device runtime PM and per-device on/off time */
+
+#include "includes.h"
+#include <zephyr/pm/device.h>
+#include <zephyr/pm/device_runtime.h>
+#include "dev_pm.h"
+
+#define NO_PARENT DEV_PM_COUNT
+
+static const char *const names[DEV_PM_COUNT] = {
+    [DEV_PM_GPIO] = "gpio0",
+#if DEV_PM_HAS_GPIO1
+    [DEV_PM_GPIO1] = "gpio1",
+#endif
+    [DEV_PM_KEY] = "key",
+    [DEV_PM_PAIRING_BUTTON] = "pairing button",
+    [DEV_PM_LED] = "led",
+    [DEV_PM_DIPSW] = "dipsw",
+#if DEV_PM_HAS_GPIO1
+    [DEV_PM_DIPSW1] = "dipsw gpio1",
+#endif
+};
+
+// GPIO ポート以外は、ピンのある GPIO ポートの上で動く
+static const uint8_t parents[DEV_PM_COUNT] = {
+    [DEV_PM_GPIO] = NO_PARENT,
+#if DEV_PM_HAS_GPIO1
+    [DEV_PM_GPIO1] = NO_PARENT,
+#endif
+    [DEV_PM_KEY] = DEV_PM_GPIO,
+    [DEV_PM_PAIRING_BUTTON] = DEV_PM_GPIO,
+    [DEV_PM_LED] = DEV_PM_GPIO,
+    [DEV_PM_DIPSW] = DEV_PM_GPIO,
+#if DEV_PM_HAS_GPIO1
+    [DEV_PM_DIPSW1] = DEV_PM_GPIO1,
+#endif
+};
+
+static struct pm_entry {
+    const struct device *dev;   // NULL ならピンのグループ (デバイスの PM はない)
+    uint8_t refs;
+    bool runtime;
+    uint32_t resumes;
+    uint32_t errors;
+    int64_t since;              // 最後に参照数が 0 と 1 の間で変わった時刻
+    uint64_t on_ms;
+    uint64_t off_ms;
+} entries[DEV_PM_COUNT];
+
+// LED は点滅のタイマー ISR から、それ以外はワークキューから呼ばれるのでスピンロックで保護する
+static struct k_spinlock lock;
+
+// 再開/停止が変わる前に、そこまでの時間を足す (ロック取得済みで呼ぶこと)
+static void account(struct pm_entry *e, int64_t now)
+{
+    uint64_t ms = now - e->since;
+
+    if (e->refs) {
+        e->on_ms += ms;
+    } else {
+        e->off_ms += ms;
+    }
+    e->since = now;
+}
+
+static void enable_runtime(enum dev_pm_id id, const struct device *dev)
+{
+    struct pm_entry *e = &entries[id];
+
+    e->dev = dev;
+    if (!dev) return;
+
+    // 参照がなければここで停止する。PM に対応していないドライバでは -ENOTSUP になり、
+    // その場合は参照数と時間だけを数える
+    int err = pm_device_runtime_enable(dev);
+    e->runtime = (err == 0);
+    if (err && err != -ENOTSUP) {
+        printk("pm_device_runtime_enable(%s) failed (err %d)\n", names[id], err);
+    }
+}
+
+void dev_pm_init(const struct device *gpio0, const struct device *gpio1,
+                 const struct device *key, const struct device *pairing_button)
+{
+    int64_t now = k_uptime_get();
+
+    for (int i = 0; i < DEV_PM_COUNT; i++) {
+        entries[i].since = now;
+    }
+    enable_runtime(DEV_PM_GPIO, gpio0);
+#if DEV_PM_HAS_GPIO1
+    enable_runtime(DEV_PM_GPIO1, gpio1);
+#else
+    ARG_UNUSED(gpio1);
+#endif
+    enable_runtime(DEV_PM_KEY, key);
+    enable_runtime(DEV_PM_PAIRING_BUTTON, pairing_button);
+}
+
+int dev_pm_get(enum dev_pm_id id)
+{
+    struct pm_entry *e = &entries[id];
+    int err = 0;
+
+    if (parents[id] != NO_PARENT) {
+        err = dev_pm_get(parents[id]);
+        if (err) return err;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool first = (e->refs == 0);
+    if (first) {
+        account(e, k_uptime_get());
+        e->resumes++;
+    }
+    e->refs++;
+    k_spin_unlock(&lock, key);
+
+    if (first && e->runtime) {
+        err = pm_device_runtime_get(e->dev);
+        if (err) {
+            printk("pm_device_runtime_get(%s) failed (err %d)\n", names[id], err);
+
+            // 再開できなかったので、取った参照を戻す (停止したままなので、再開の回数にも数えない)
+            key = k_spin_lock(&lock);
+            e->errors++;
+            e->resumes--;
+            e->refs--;
+            if (e->refs == 0) account(e, k_uptime_get());
+            k_spin_unlock(&lock, key);
+
+            if (parents[id] != NO_PARENT) dev_pm_put(parents[id]);
+        }
+    }
+    return err;
+}
+
+int dev_pm_put(enum dev_pm_id id)
+{
+    struct pm_entry *e = &entries[id];
+    int err = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (e->refs == 0) {
+        k_spin_unlock(&lock, key);
+        return -EALREADY;
+    }
+    bool last = (e->refs == 1);
+    if (last) {
+        account(e, k_uptime_get());
+    }
+    e->refs--;
+    k_spin_unlock(&lock, key);
+
+    if (last && e->runtime) {
+        // ISR からは待てないので、停止はワークキューに任せる
+        err = k_is_in_isr() ? pm_device_runtime_put_async(e->dev, K_NO_WAIT)
+                            : pm_device_runtime_put(e->dev);
+        if (err) {
+            key = k_spin_lock(&lock);
+            e->errors++;
+            k_spin_unlock(&lock, key);
+            printk("pm_device_runtime_put(%s) failed (err %d)\n", names[id], err);
+        }
+    }
+
+    if (parents[id] != NO_PARENT) {
+        dev_pm_put(parents[id]);
+    }
+    return err;
+}
+
+bool dev_pm_check(void)
+{
+    uint8_t children[DEV_PM_COUNT] = { 0 };
+    bool ok = true;
+
+    for (int i = 0; i < DEV_PM_COUNT; i++) {
+        struct pm_entry *e = &entries[i];
+        enum pm_device_state state;
+
+        if (parents[i] != NO_PARENT) children[parents[i]] += e->refs;
+        if (!e->runtime || pm_device_state_get(e->dev, &state)) continue;
+
+        // 停止は非同期のことがあるので、停止中の途中も停止とみなす
+        bool active = (state == PM_DEVICE_STATE_ACTIVE);
+        if (active != (e->refs > 0)) {
+            printk("dev pm %s: %u refs but %s\n", names[i], e->refs, pm_device_state_str(state));
+            ok = false;
+        }
+    }
+    // 子が取った参照の数だけ GPIO ポートの参照がある
+    for (int i = 0; i < DEV_PM_COUNT; i++) {
+        if (parents[i] != NO_PARENT) continue;
+        if (entries[i].refs != children[i]) {
+            printk("dev pm %s: %u refs, children hold %u\n", names[i], entries[i].refs, children[i]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void dev_pm_get_stats(struct dev_pm_stats *stats)
+{
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (int i = 0; i < DEV_PM_COUNT; i++) {
+        struct pm_entry *e = &entries[i];
+        struct dev_pm_entry_stats *s = &stats->entries[i];
+        uint64_t ms = now - e->since;
+
+        s->name = names[i];
+        s->refs = e->refs;
+        s->runtime = e->runtime;
+        s->resumes = e->resumes;
+        s->errors = e->errors;
+        s->on_ms = (uint32_t)(e->on_ms + (e->refs ? ms : 0));
+        s->off_ms = (uint32_t)(e->off_ms + (e->refs ? 0 : ms));
+    }
+    k_spin_unlock(&lock, key);
+
+    stats->consistent = dev_pm_check();
+}
+
+void dev_pm_print_stats(void)
+{
+    struct dev_pm_stats st;
+
+    dev_pm_get_stats(&st);
+    for (int i = 0; i < DEV_PM_COUNT; i++) {
+        const struct dev_pm_entry_stats *s = &st.entries[i];
+        uint32_t total = s->on_ms + s->off_ms;
+
+        printk("dev pm %s%s: on %u ms, off %u ms (%u%% off), %u resumes, %u refs, %u errors\n",
+            s->name, s->runtime ? "" : " (no runtime PM)", s->on_ms, s->off_ms,
+            total ? (uint32_t)((uint64_t)s->off_ms * 100 / total) : 0,
+            s->resumes, s->refs, s->errors);
+    }
+    printk("dev pm: %s\n", st.consistent ? "consistent" : "INCONSISTENT");
+}
+
+
+/* End of dev_pm.c */
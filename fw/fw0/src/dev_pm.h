@@ -0,0 +1,70 @@
+/* This file is dev_pm.h, reference-counted device runtime PM and per-device on/off time */
+
+#ifndef DEV_PM_H_
+#define DEV_PM_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+
+// nRF52840 は DIPSW の一部が gpio1 にある (SmallKB_nrf52840.dts)
+#define DEV_PM_HAS_GPIO1 DT_NODE_HAS_STATUS(DT_NODELABEL(gpio1), okay)
+
+// アプリケーションが使う周辺機器。ピンのグループ (LED・DIPSW) は、使っている間だけ接続し
+// 親の GPIO ポートの参照を持つ。グループは一つのポートのピンだけにする (ポートごとに分ける)。
+// デバイスを持つもの (GPIO ポート・gpio-keys) は pm_device_runtime_get()/put() で再開・停止する
+enum dev_pm_id {
+    DEV_PM_GPIO,            // GPIO ポート (gpio0)
+#if DEV_PM_HAS_GPIO1
+    DEV_PM_GPIO1,           // GPIO ポート (gpio1)
+#endif
+    DEV_PM_KEY,             // キーの gpio-keys (押下の検出と割り込み)
+    DEV_PM_PAIRING_BUTTON,  // ペアリングボタンの gpio-keys
+    DEV_PM_LED,             // LED のピン
+    DEV_PM_DIPSW,           // gpio0 の DIPSW のピン (起動時に読むときだけ)
+#if DEV_PM_HAS_GPIO1
+    DEV_PM_DIPSW1,          // gpio1 の DIPSW のピン
+#endif
+    DEV_PM_COUNT,
+};
+
+struct dev_pm_entry_stats {
+    const char *name;
+    uint8_t refs;           // いまの参照数 (0 なら停止中)
+    bool runtime;           // デバイスの実行時 PM が有効 (pm_device_runtime_enable() できた)
+    uint32_t resumes;       // 停止から再開した回数
+    uint32_t on_ms;         // 再開していた時間
+    uint32_t off_ms;        // 停止していた時間
+    uint32_t errors;        // pm_device_runtime_get()/put() の失敗
+};
+
+struct dev_pm_stats {
+    struct dev_pm_entry_stats entries[DEV_PM_COUNT];
+    bool consistent;        // 参照数とデバイスの PM の状態が合っている (dev_pm_check())
+};
+
+// 起動時に、周辺機器を使い始める前に呼ぶ。デバイスの実行時 PM を有効にし (使うまで停止)、
+// 時間の計測を始める。gpio1 はないボードでは NULL
+void dev_pm_init(const struct device *gpio0, const struct device *gpio1,
+                 const struct device *key, const struct device *pairing_button);
+
+// 使い始めるときに get、使い終わったら put を呼ぶ (参照数。最初の get で再開、最後の put で停止)。
+// 親の GPIO ポートの参照も合わせて取る。再開に失敗したら参照 (親の分も) を戻してエラーを返す。
+// ISR からも呼べるが、そのときに GPIO ポートを再開・停止することにならないよう、
+// キーが gpio0 の参照を持ち続ける (ISR から使う LED は gpio0 にある)
+int dev_pm_get(enum dev_pm_id id);
+int dev_pm_put(enum dev_pm_id id);
+
+// 参照数とデバイスの PM の状態 (pm_device_state_get()) が合っているか、GPIO ポートの参照数が
+// 子の参照の合計と合っているかを確かめる。native_sim でも GPIO エミュレータと gpio-keys の
+// PM の状態で確かめられる (ストレステストは最後に確かめ、合わなければ失敗する)
+bool dev_pm_check(void);
+
+void dev_pm_get_stats(struct dev_pm_stats *stats);
+void dev_pm_print_stats(void);
+
+#endif /* DEV_PM_H_ */
+
+
+/* End of dev_pm.h */
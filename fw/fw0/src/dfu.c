@@ -0,0 +1,171 @@
+/* This file is dfu.c, firmware update over BLE (MCUmgr SMP) through the MCUboot slots */
+
+#include "includes.h"
+#include <zephyr/mgmt/mcumgr/mgmt/mgmt.h>
+#include <zephyr/mgmt/mcumgr/mgmt/callbacks.h>
+#include <zephyr/mgmt/mcumgr/grp/img_mgmt/img_mgmt.h>
+#include <zephyr/mgmt/mcumgr/grp/os_mgmt/os_mgmt.h>
+#include <zephyr/dfu/mcuboot.h>
+#include "events.h"
+#include "dfu.h"
+#if defined(CONFIG_SETTINGS_NVS)
+#include "storage_wb.h"
+#endif
+
+// 転送の途中経過を表示する間隔 (バイト)
+#define DFU_PROGRESS_STEP (32 * 1024)
+
+static volatile bool in_progress;
+static volatile bool key_pressed;
+static bool test_image;         // テスト中 (スワップ直後) のイメージで起動した
+static atomic_t confirm_posted; // 確定をメインループに依頼した
+
+// 以下は MCUmgr のワークキューからのみ更新される
+static int64_t start_time;
+static uint32_t received;
+static uint32_t image_size;
+static uint32_t next_progress;
+
+static uint32_t throughput_bps(uint32_t bytes, uint32_t ms)
+{
+    return ms ? (uint32_t)((uint64_t)bytes * 1000 / ms) : 0;
+}
+
+static void print_throughput(const char *title)
+{
+    uint32_t ms = (uint32_t)(k_uptime_get() - start_time);
+    uint32_t bps = throughput_bps(received, ms);
+
+    printk("DFU %s: %u/%u bytes in %u ms, %u.%02u KB/s\n", title, received, image_size, ms,
+        bps / 1024, (bps % 1024) * 100 / 1024);
+}
+
+static enum mgmt_cb_return img_mgmt_cb(uint32_t event, enum mgmt_cb_return prev_status,
+                                       int32_t *rc, uint16_t *group, bool *abort_more,
+                                       void *data, size_t data_size)
+{
+    switch (event) {
+    case MGMT_EVT_OP_IMG_MGMT_DFU_STARTED:
+        start_time = k_uptime_get();
+        received = 0;
+        image_size = 0;
+        next_progress = DFU_PROGRESS_STEP;
+        in_progress = true;
+        printk("DFU started\n");
+        // 転送中は最速の接続パラメータにし、PHY とデータ長は PHY の方針に任せるようメインループに依頼する
+        post_event(EVENT_DFU_STARTED);
+        break;
+
+    case MGMT_EVT_OP_IMG_MGMT_DFU_CHUNK: {
+        const struct img_mgmt_upload_check *check = data;
+
+        received = check->req->off + check->req->img_data.len;
+        image_size = check->action->size;
+        if (received >= next_progress) {
+            print_throughput("progress");
+            next_progress += DFU_PROGRESS_STEP;
+        }
+        break;
+    }
+
+    case MGMT_EVT_OP_IMG_MGMT_DFU_PENDING:
+        print_throughput("completed");
+        in_progress = false;
+        post_event(EVENT_DFU_STOPPED);
+        break;
+
+    case MGMT_EVT_OP_IMG_MGMT_DFU_STOPPED:
+        print_throughput("stopped");
+        in_progress = false;
+        post_event(EVENT_DFU_STOPPED);
+        break;
+
+    default:
+        break;
+    }
+
+    return MGMT_CB_OK;
+}
+
+static enum mgmt_cb_return os_mgmt_cb(uint32_t event, enum mgmt_cb_return prev_status,
+                                      int32_t *rc, uint16_t *group, bool *abort_more,
+                                      void *data, size_t data_size)
+{
+    if (event == MGMT_EVT_OP_OS_MGMT_RESET && key_pressed) {
+        // キーを押している最中に再起動すると、ホスト側でキーが押しっぱなしになる。
+        // 離されるまでリセットを断り、ツールに再試行させる
+        printk("DFU reset deferred: key is pressed\n");
+        *rc = MGMT_ERR_EBUSY;
+        return MGMT_CB_ERROR_RC;
+    }
+#if defined(CONFIG_SETTINGS_NVS)
+    // リセットの前に、溜めてある設定の書き込みを済ませる
+    if (event == MGMT_EVT_OP_OS_MGMT_RESET) storage_wb_flush("reset");
+#endif
+    return MGMT_CB_OK;
+}
+
+static struct mgmt_callback img_mgmt_callback = {
+    .callback = img_mgmt_cb,
+    .event_id = MGMT_EVT_OP_IMG_MGMT_ALL,
+};
+
+static struct mgmt_callback os_mgmt_callback = {
+    .callback = os_mgmt_cb,
+    .event_id = MGMT_EVT_OP_OS_MGMT_RESET,
+};
+
+void dfu_init(void)
+{
+    mgmt_callback_register(&img_mgmt_callback);
+    mgmt_callback_register(&os_mgmt_callback);
+
+    test_image = !boot_is_img_confirmed();
+    if (test_image) {
+        printk("Running a test image, confirming after the first host link works\n");
+    }
+}
+
+void dfu_link_ok(void)
+{
+    // BT のコールバックから呼ばれるのでフラッシュには書かず、メインループに任せる
+    if (test_image && !atomic_set(&confirm_posted, 1)) {
+        post_event(EVENT_DFU_CONFIRM);
+    }
+}
+
+void dfu_confirm_image(void)
+{
+    if (!test_image) return;
+
+    int err = boot_write_img_confirmed();
+    if (err) {
+        // 確定できなければ次のリセットで元のイメージに戻るので、次の成功でやり直す
+        printk("boot_write_img_confirmed() failed (err %d)\n", err);
+        atomic_set(&confirm_posted, 0);
+    } else {
+        test_image = false;
+        printk("Image confirmed\n");
+    }
+}
+
+bool dfu_in_progress(void)
+{
+    return in_progress;
+}
+
+void dfu_set_key_pressed(bool pressed)
+{
+    key_pressed = pressed;
+}
+
+void dfu_get_stats(struct dfu_stats *stats)
+{
+    stats->bytes = received;
+    stats->image_size = image_size;
+    stats->elapsed_ms = start_time ? (uint32_t)(k_uptime_get() - start_time) : 0;
+    stats->throughput_bps = throughput_bps(received, stats->elapsed_ms);
+}
+
+
+/* End of dfu.c */
@@ -0,0 +1,39 @@
+/* This file is dfu.h, firmware update over BLE (MCUmgr SMP) through the MCUboot slots */
+
+#ifndef DFU_H_
+#define DFU_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+// 転送の統計情報
+struct dfu_stats {
+    uint32_t bytes;         // 受信したイメージのバイト数
+    uint32_t image_size;    // イメージ全体のサイズ
+    uint32_t elapsed_ms;    // 転送開始からの経過時間
+    uint32_t throughput_bps; // バイト/秒
+};
+
+// MCUmgr のコールバックを登録する。bt_enable() の後に呼ぶこと
+void dfu_init(void);
+
+// ホストとの接続が動いたことを知らせる (暗号化の完了・レポートの送信完了から呼ぶ)。
+// テスト中 (スワップ直後) のイメージで起動していれば、確定をメインループに依頼する
+void dfu_link_ok(void);
+
+// イメージを確定する。EVENT_DFU_CONFIRM を受けてメインループから呼ぶこと。
+// 一度もホストと動かないまま再起動すれば、MCUboot が元のイメージに戻す
+void dfu_confirm_image(void);
+
+// 転送中かどうか
+bool dfu_in_progress(void);
+
+// ホストに送っているキーの押下状態を知らせる。押下中はリセット要求を保留する
+void dfu_set_key_pressed(bool pressed);
+
+void dfu_get_stats(struct dfu_stats *stats);
+
+#endif /* DFU_H_ */
+
+
+/* End of dfu.h */
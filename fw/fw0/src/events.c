@@ -0,0 +1,209 @@
+/* This file is events.c, event queue between ISRs / BT callbacks and the main loop */
+
+#include "includes.h"
+#include <zephyr/sys/atomic.h>
+#include "events.h"
+
+#define EVENT_QUEUE_LEN 10
+
+// イベントキューの定義
+K_MSGQ_DEFINE(event_queue, sizeof(struct app_event), EVENT_QUEUE_LEN, 4);
+
+// 投入側は ISR や BT スレッドから同時に呼ばれるので atomic で数える
+static atomic_t posted;
+static atomic_t dropped;
+static atomic_t dropped_by_type[EVENT_TYPE_COUNT];
+static atomic_t high_water;
+
+// キーイベントの追跡 (0: なし, それ以外: EVENT_KEY_PRESS/RELEASE + 1)
+static atomic_t last_key_posted;
+static uint8_t last_key_taken;
+
+// 以下はイベントを処理するワークからのみ更新される。
+// 統計の読み出し・リセットは他のスレッドからも来るので stats_lock で保護する
+static struct k_spinlock stats_lock;
+static uint32_t key_lost_transitions;
+static uint32_t serviced;
+static uint32_t latency_max_us;
+static uint64_t latency_sum_us;
+
+// メインループは専用のスレッドを持たず、システムワークキューのワークとして動く
+static event_handler_t event_handler;
+static void event_work_handler(struct k_work *work);
+static K_WORK_DEFINE(event_work, event_work_handler);
+
+static const char *const event_names[EVENT_TYPE_COUNT] = {
+    [EVENT_PAIRING_BUTTON_PRESS] = "PAIRING_BUTTON_PRESS",
+    [EVENT_KEY_PRESS] = "KEY_PRESS",
+    [EVENT_KEY_RELEASE] = "KEY_RELEASE",
+    [EVENT_HOST_SYNC] = "HOST_SYNC",
+    [EVENT_PAIRING_TIMEOUT] = "PAIRING_TIMEOUT",
+    [EVENT_CONNECTED] = "CONNECTED",
+    [EVENT_DISCONNECTED] = "DISCONNECTED",
+    [EVENT_PAIRING_END] = "PAIRING_END",
+    [EVENT_CONFIRM_REQUEST] = "CONFIRM_REQUEST",
+    [EVENT_FAST_MODE_TIMEOUT] = "FAST_MODE_TIMEOUT",
+    [EVENT_ADV_SCHEDULE] = "ADV_SCHEDULE",
+    [EVENT_GESTURE_TIMEOUT] = "GESTURE_TIMEOUT",
+    [EVENT_DFU_STARTED] = "DFU_STARTED",
+    [EVENT_DFU_STOPPED] = "DFU_STOPPED",
+    [EVENT_USB_ATTACHED] = "USB_ATTACHED",
+    [EVENT_USB_DETACHED] = "USB_DETACHED",
+    [EVENT_HUB_REPORT] = "HUB_REPORT",
+    [EVENT_ADV_RETRY] = "ADV_RETRY",
+    [EVENT_DFU_CONFIRM] = "DFU_CONFIRM",
+};
+
+const char *event_name(uint8_t type)
+{
+    return type < EVENT_TYPE_COUNT ? event_names[type] : "UNKNOWN";
+}
+
+static bool is_key_event(uint8_t type)
+{
+    return type == EVENT_KEY_PRESS || type == EVENT_KEY_RELEASE;
+}
+
+int post_event(uint8_t type)
+{
+    struct app_event ev = {
+        .type = type,
+        .cycles = k_cycle_get_32(),
+    };
+
+    if (is_key_event(type)) {
+        atomic_set(&last_key_posted, type + 1);
+    }
+
+    if (k_msgq_put(&event_queue, &ev, K_NO_WAIT) != 0) {
+        atomic_inc(&dropped);
+        if (type < EVENT_TYPE_COUNT) {
+            atomic_inc(&dropped_by_type[type]);
+        }
+        printk("Failed to queue %s event\n", event_name(type));
+        return -ENOMSG;
+    }
+
+    atomic_inc(&posted);
+    k_work_submit(&event_work);
+
+    // 最大使用数を更新
+    atomic_val_t used = k_msgq_num_used_get(&event_queue);
+    atomic_val_t hw;
+    do {
+        hw = atomic_get(&high_water);
+        if (used <= hw) break;
+    } while (!atomic_cas(&high_water, hw, used));
+
+    return 0;
+}
+
+static int get_event(struct app_event *ev)
+{
+    int err = k_msgq_get(&event_queue, ev, K_NO_WAIT);
+    if (err) return err;
+
+    if (is_key_event(ev->type)) {
+        // 同じ種類のキーイベントが続いた場合は、その間のイベントが失われている
+        if (last_key_taken == ev->type + 1) {
+            k_spinlock_key_t key = k_spin_lock(&stats_lock);
+            key_lost_transitions++;
+            k_spin_unlock(&stats_lock, key);
+        }
+        last_key_taken = ev->type + 1;
+    }
+    return 0;
+}
+
+static void event_serviced(const struct app_event *ev)
+{
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - ev->cycles);
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    serviced++;
+    latency_sum_us += us;
+    if (us > latency_max_us) latency_max_us = us;
+    k_spin_unlock(&stats_lock, key);
+}
+
+static void event_work_handler(struct k_work *work)
+{
+    struct app_event ev;
+
+    if (!event_handler || get_event(&ev) != 0) return;
+
+    event_handler(&ev);
+    event_serviced(&ev);
+
+    // 同じワークキューの他のワーク (BT の送信など) を待たせないよう、
+    // 一度に一つだけ処理して後ろに並び直す
+    if (k_msgq_num_used_get(&event_queue)) {
+        k_work_submit(&event_work);
+    }
+}
+
+void events_start(event_handler_t handler)
+{
+    event_handler = handler;
+    k_work_submit(&event_work);
+}
+
+uint32_t event_queue_used(void)
+{
+    return k_msgq_num_used_get(&event_queue);
+}
+
+bool event_key_state_diverged(void)
+{
+    atomic_val_t posted_key = atomic_get(&last_key_posted);
+    return posted_key != 0 && posted_key != last_key_taken;
+}
+
+// 統計を読む。reset が真なら、読んだ値を同じロックの中でゼロに戻す
+// (atomic のカウンタは読みと同時に取り出すので、その間の投入も失われない)
+static void read_stats(struct event_queue_stats *stats, bool reset)
+{
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+    stats->posted = reset ? atomic_clear(&posted) : atomic_get(&posted);
+    stats->dropped = reset ? atomic_clear(&dropped) : atomic_get(&dropped);
+    for (int i = 0; i < EVENT_TYPE_COUNT; i++) {
+        stats->dropped_by_type[i] = reset ? atomic_clear(&dropped_by_type[i])
+                                          : atomic_get(&dropped_by_type[i]);
+    }
+    stats->high_water = reset ? atomic_set(&high_water, k_msgq_num_used_get(&event_queue))
+                              : atomic_get(&high_water);
+    stats->capacity = EVENT_QUEUE_LEN;
+    stats->key_lost_transitions = key_lost_transitions;
+    stats->serviced = serviced;
+    stats->latency_max_us = latency_max_us;
+    stats->latency_avg_us = serviced ? (uint32_t)(latency_sum_us / serviced) : 0;
+    if (reset) {
+        key_lost_transitions = 0;
+        serviced = 0;
+        latency_max_us = 0;
+        latency_sum_us = 0;
+    }
+
+    k_spin_unlock(&stats_lock, key);
+}
+
+void get_event_queue_stats(struct event_queue_stats *stats)
+{
+    read_stats(stats, false);
+}
+
+void take_event_queue_stats(struct event_queue_stats *stats)
+{
+    read_stats(stats, true);
+}
+
+void reset_event_queue_stats(void)
+{
+    struct event_queue_stats stats;
+
+    read_stats(&stats, true);
+}
+
+
+/* End of events.c */
@@ -0,0 +1,81 @@
+/* This file is events.h, event queue between ISRs / BT callbacks and the main loop */
+
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+#include <zephyr/types.h>
+#include <zephyr/kernel.h>
+#include <stdbool.h>
+
+// コールバック関数で使用するイベントタイプ
+enum event_type {
+    EVENT_PAIRING_BUTTON_PRESS,
+    EVENT_KEY_PRESS,
+    EVENT_KEY_RELEASE,
+    EVENT_HOST_SYNC,         // ホストにキー状態を送り直す
+    EVENT_PAIRING_TIMEOUT,
+    EVENT_CONNECTED,         // 接続された
+    EVENT_DISCONNECTED,      // 切断された
+    EVENT_PAIRING_END,       // ペアリングの完了・失敗・キャンセル
+    EVENT_CONFIRM_REQUEST,   // パスキーの確認要求
+    EVENT_FAST_MODE_TIMEOUT,
+    EVENT_ADV_SCHEDULE,      // アドバタイズのフェーズ切り替え
+    EVENT_GESTURE_TIMEOUT,   // ジェスチャー判定タイマーの満了
+    EVENT_DFU_STARTED,       // ファームウェア更新の転送開始
+    EVENT_DFU_STOPPED,       // ファームウェア更新の転送終了 (完了・中断)
+    EVENT_USB_ATTACHED,      // USB のホストに認識された (有線に切り替える)
+    EVENT_USB_DETACHED,      // VBUS がなくなった (BLE に戻る)
+    EVENT_HUB_REPORT,        // 子機のキーの状態が変わった (ハブモード)
+    EVENT_ADV_RETRY,         // アドバタイズの開始に失敗したのでやり直す
+    EVENT_DFU_CONFIRM,       // ホストとの接続が動いたので、テスト中のイメージを確定する
+
+    EVENT_TYPE_COUNT
+};
+
+// キューに積まれるイベント
+struct app_event {
+    uint8_t type;      // enum event_type
+    uint32_t cycles;   // キューに投入したときのサイクルカウンタ値
+};
+
+// イベントキューの統計情報
+struct event_queue_stats {
+    uint32_t posted;                              // 投入に成功した数
+    uint32_t dropped;                             // キューあふれで失われた数
+    uint32_t dropped_by_type[EVENT_TYPE_COUNT];   // 上記のイベントタイプ別内訳
+    uint32_t high_water;                          // キューの最大使用数
+    uint32_t capacity;                            // キューの容量
+    uint32_t key_lost_transitions;                // 押下/解放の片方が失われたことを検出した回数
+    uint32_t serviced;                            // メインループで処理された数
+    uint32_t latency_max_us;                      // 投入から処理完了までの最大時間
+    uint32_t latency_avg_us;                      // 同平均
+};
+
+// イベントをキューに投入する。ISR からも呼び出し可能。失敗時は負の値を返す
+int post_event(uint8_t type);
+
+// イベントを処理する関数 (メインループ)
+typedef void (*event_handler_t)(const struct app_event *ev);
+
+// イベントの処理を開始する。以後、投入されたイベントはシステムワークキューで一つずつ handler に渡す。
+// それまでに投入されたイベントはキューに溜めておく
+void events_start(event_handler_t handler);
+
+// 現在キューに積まれているイベントの数
+uint32_t event_queue_used(void);
+
+// 最後に投入しようとしたキーイベントと、最後に処理したキーイベントが食い違っているかどうか
+// (キューが空のときに真であれば、キーが押しっぱなし/離しっぱなしになっている)
+bool event_key_state_diverged(void);
+
+const char *event_name(uint8_t type);
+
+void get_event_queue_stats(struct event_queue_stats *stats);
+// 統計を読み、同時にゼロに戻す (読んでからリセットするまでの間の分も失わない)
+void take_event_queue_stats(struct event_queue_stats *stats);
+void reset_event_queue_stats(void);
+
+#endif /* EVENTS_H_ */
+
+
+/* End of events.h */
@@ -0,0 +1,230 @@
+/* This file is gatt_cache.c, GATT database hash check and reconnect-to-first-notification benchmark */
+
+#include "includes.h"
+#include <string.h>
+#include "gatt_cache.h"
+
+#define DB_HASH_LEN 16
+#define REPORT_ATTR_MAX 2       // 入力レポート (レポートプロトコル・ブートプロトコル)
+
+// 接続ごとの計測 (bt_conn_index() で引く)
+static struct gatt_conn {
+    struct bt_conn *conn;
+    bool paired;                // この接続でペアリングした (再接続ではない)
+    bool measuring;             // 最初の通知の完了を待っている
+    bool failed;                // 暗号化の時点で CCC が復元されていなかったか、通知の送信に失敗した
+    uint32_t connect_ms;
+    uint32_t encrypt_ms;        // 接続から暗号化までの時間 (0 なら未暗号化)
+} gc[CONFIG_BT_MAX_CONN];
+
+// 購読を確かめる入力レポートの属性
+static const struct bt_gatt_attr *report_attrs[REPORT_ATTR_MAX];
+static size_t report_attr_count;
+
+// BT のコールバックとメインループから呼ばれるのでスピンロックで保護する
+static struct k_spinlock lock;
+
+static struct gatt_cache_stats stats;
+static uint64_t encrypt_sum_ms[GATT_READY_PATH_COUNT];
+static uint64_t notify_sum_ms[GATT_READY_PATH_COUNT];
+
+static const char *const path_names[GATT_READY_PATH_COUNT] = {
+    [GATT_READY_RESTORED] = "CCC restored",
+    [GATT_READY_RESUBSCRIBED] = "resubscribed",
+};
+
+static uint8_t count_attr(const struct bt_gatt_attr *attr, uint16_t handle, void *user_data)
+{
+    stats.attr_count++;
+    stats.last_handle = handle;
+    return BT_GATT_ITER_CONTINUE;
+}
+
+static int stored_hash_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    if (len == DB_HASH_LEN) {
+        read_cb(cb_arg, param, DB_HASH_LEN);
+    }
+    return 0;
+}
+
+struct bond_match {
+    const bt_addr_le_t *addr;
+    bool found;
+};
+
+static void bond_match_cb(const struct bt_bond_info *info, void *user_data)
+{
+    struct bond_match *m = user_data;
+    if (bt_addr_le_eq(&info->addr, m->addr)) {
+        m->found = true;
+    }
+}
+
+void gatt_cache_check(const struct bt_gatt_attr *const *reports, size_t count)
+{
+    uint8_t stored[DB_HASH_LEN] = { 0 };
+    const struct bt_gatt_attr *attr;
+
+    report_attr_count = MIN(count, ARRAY_SIZE(report_attrs));
+    memcpy(report_attrs, reports, report_attr_count * sizeof(reports[0]));
+
+    stats.attr_count = 0;
+    bt_gatt_foreach_attr(0x0001, 0xffff, count_attr, NULL);
+
+    // ホストは起動時に計算したハッシュを "bt/hash" に保存し、前回と違えばボンディング済みの
+    // ホストに Service Changed を送る。読み込みで上書きされる前に前回の値を読んでおく
+    settings_load_subtree_direct("bt/hash", stored_hash_cb, stored);
+
+    // Database Hash 特性を直接読んで、現在のハッシュを得る (未計算ならその場で計算される)
+    attr = bt_gatt_find_by_uuid(NULL, 0, BT_UUID_GATT_DB_HASH);
+    if (!attr || attr->read(NULL, attr, stats.hash, DB_HASH_LEN, 0) != DB_HASH_LEN) {
+        printk("GATT database hash not available (CONFIG_BT_GATT_CACHING=n?)\n");
+        memset(stats.hash, 0, sizeof(stats.hash));
+    } else {
+        static const uint8_t zero[DB_HASH_LEN];
+        stats.hash_changed = memcmp(stored, zero, DB_HASH_LEN) && memcmp(stored, stats.hash, DB_HASH_LEN);
+    }
+
+    printk("GATT database: %u attributes, last handle 0x%04x, hash %02x%02x%02x%02x...%s\n",
+        stats.attr_count, stats.last_handle,
+        stats.hash[15], stats.hash[14], stats.hash[13], stats.hash[12],
+        stats.hash_changed ? " (changed, Service Changed will be indicated)" : "");
+}
+
+void gatt_cache_connected(struct bt_conn *conn)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+
+    // ボンディング済みのホストかどうかは暗号化の後で決める
+    // (接続の時点ではアドレスが RPA のままで、まだ解決されていないことがある)
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    g->conn = conn;
+    g->paired = false;
+    g->measuring = false;
+    g->failed = false;
+    g->connect_ms = k_uptime_get_32();
+    g->encrypt_ms = 0;
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_pairing(struct bt_conn *conn)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (g->conn == conn) {
+        g->paired = true;
+        g->measuring = false;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_disconnected(struct bt_conn *conn)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (g->conn == conn) {
+        g->conn = NULL;
+        g->measuring = false;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_encrypted(struct bt_conn *conn)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+    // 暗号化の後なら、ボンディング済みのホストのアドレスは ID アドレスに解決されている
+    struct bond_match m = { .addr = bt_conn_get_dst(conn) };
+    struct bt_conn_info info;
+    bool subscribed = false;
+
+    if (bt_conn_get_info(conn, &info)) return;
+    bt_foreach_bond(info.id, bond_match_cb, &m);
+    // CCC が復元されていれば、ホストが書き込む前から購読している
+    for (size_t i = 0; i < report_attr_count; i++) {
+        subscribed |= bt_gatt_is_subscribed(conn, report_attrs[i], BT_GATT_CCC_NOTIFY);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    // この接続でペアリングしていない、ボンディング済みのホストだけを再接続として測る
+    if (g->conn == conn && !g->encrypt_ms && !g->paired && m.found) {
+        g->encrypt_ms = k_uptime_get_32() - g->connect_ms;
+        g->measuring = true;
+        g->failed = !subscribed;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_report_sent(struct bt_conn *conn, int err)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (g->conn == conn && g->measuring && g->encrypt_ms && err) {
+        // 暗号化の直後に送る解放 (host_sync) が通知できなかった
+        g->failed = true;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_report_done(struct bt_conn *conn)
+{
+    struct gatt_conn *g = &gc[bt_conn_index(conn)];
+    uint32_t ms = 0;
+    enum gatt_ready_path path = GATT_READY_RESTORED;
+    bool done = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (g->conn == conn && g->measuring) {
+        ms = k_uptime_get_32() - g->connect_ms;
+        path = g->failed ? GATT_READY_RESUBSCRIBED : GATT_READY_RESTORED;
+        g->measuring = false;
+        done = true;
+
+        struct gatt_ready_stats *p = &stats.paths[path];
+        p->count++;
+        encrypt_sum_ms[path] += g->encrypt_ms;
+        notify_sum_ms[path] += ms;
+        if (ms > p->notify_max_ms) p->notify_max_ms = ms;
+    }
+    k_spin_unlock(&lock, key);
+
+    if (done) {
+        printk("First notification %u ms after reconnect (%s)\n", ms, path_names[path]);
+    }
+}
+
+void gatt_cache_get_stats(struct gatt_cache_stats *st)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *st = stats;
+    for (int i = 0; i < GATT_READY_PATH_COUNT; i++) {
+        if (st->paths[i].count) {
+            st->paths[i].encrypt_avg_ms = (uint32_t)(encrypt_sum_ms[i] / st->paths[i].count);
+            st->paths[i].notify_avg_ms = (uint32_t)(notify_sum_ms[i] / st->paths[i].count);
+        }
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void gatt_cache_print_stats(void)
+{
+    struct gatt_cache_stats st;
+
+    gatt_cache_get_stats(&st);
+    printk("gatt: caching %s, %u attributes, hash %s\n",
+        IS_ENABLED(CONFIG_BT_GATT_CACHING) ? "on" : "off", st.attr_count,
+        st.hash_changed ? "changed at boot" : "unchanged");
+    for (int i = 0; i < GATT_READY_PATH_COUNT; i++) {
+        if (st.paths[i].count) {
+            printk("gatt reconnect %s: %u, encrypted avg %u ms, first notification avg %u ms max %u ms\n",
+                path_names[i], st.paths[i].count, st.paths[i].encrypt_avg_ms,
+                st.paths[i].notify_avg_ms, st.paths[i].notify_max_ms);
+        }
+    }
+}
+
+
+/* End of gatt_cache.c */
@@ -0,0 +1,57 @@
+/* This file is gatt_cache.h, GATT database hash check and reconnect-to-first-notification benchmark */
+
+#ifndef GATT_CACHE_H_
+#define GATT_CACHE_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// 再接続から最初の通知までの経路
+enum gatt_ready_path {
+    GATT_READY_RESTORED,    // 暗号化した時点で CCC が復元されていて、すぐ通知できた
+    GATT_READY_RESUBSCRIBED,// ホストが探索・CCC の書き込みをやり直すまで通知できなかった
+
+    GATT_READY_PATH_COUNT
+};
+
+struct gatt_ready_stats {
+    uint32_t count;
+    uint32_t encrypt_avg_ms;    // 接続から暗号化まで
+    uint32_t notify_avg_ms;     // 接続から最初の通知の完了まで
+    uint32_t notify_max_ms;
+};
+
+struct gatt_cache_stats {
+    uint16_t attr_count;        // 属性の数
+    uint16_t last_handle;       // 最後の属性のハンドル
+    bool hash_changed;          // 前回の起動時からデータベースが変わった (Service Changed が送られる)
+    uint8_t hash[16];           // データベースハッシュ
+    struct gatt_ready_stats paths[GATT_READY_PATH_COUNT];
+};
+
+// bt_enable() の後、設定を読み込む前に呼ぶ。
+// データベースを調べ、保存されているハッシュと比べる。
+// reports は暗号化の時点で購読されているかを確かめる入力レポートの値の属性 (どれかが購読されていれば復元)
+void gatt_cache_check(const struct bt_gatt_attr *const *reports, size_t count);
+
+// 接続/切断/暗号化の完了時に BT のコールバックから呼ぶ。
+// 再接続かどうかは暗号化の後に、解決された ID アドレスとボンディングの一覧で決める
+void gatt_cache_connected(struct bt_conn *conn);
+void gatt_cache_disconnected(struct bt_conn *conn);
+void gatt_cache_encrypted(struct bt_conn *conn);
+
+// ペアリングを受け付けたときに呼ぶ (この接続は再接続として測らない)
+void gatt_cache_pairing(struct bt_conn *conn);
+
+// レポートを送信したとき / 送信が完了したときに呼ぶ
+void gatt_cache_report_sent(struct bt_conn *conn, int err);
+void gatt_cache_report_done(struct bt_conn *conn);
+
+void gatt_cache_get_stats(struct gatt_cache_stats *stats);
+void gatt_cache_print_stats(void);
+
+#endif /* GATT_CACHE_H_ */
+
+
+/* End of gatt_cache.h */
@@ -0,0 +1,225 @@
+/* This file is gesture.c, tap / hold / double-tap gesture engine for the key */
+
+#include "includes.h"
+#include "events.h"
+#include "deadline.h"
+#include "gesture.h"
+
+enum gesture_state {
+    G_IDLE,     // キーは離されている
+    G_DOWN1,    // 1 回目の押下中 (タップかホールドか未確定)
+    G_UP1,      // 1 回目を離した後、2 回目の押下を待っている
+    G_DOWN2,    // 2 回目の押下中 (ダブルタップかタップ＆ホールドか未確定)
+    G_HOLDING,  // 判定済みのキーコードを押下中。離されたら解放を送る
+};
+
+static const char *const gesture_names[GESTURE_COUNT] = {
+    [GESTURE_TAP] = "tap",
+    [GESTURE_HOLD] = "hold",
+    [GESTURE_DOUBLE_TAP] = "double-tap",
+    [GESTURE_TAP_HOLD] = "tap-hold",
+};
+
+static uint8_t usages[GESTURE_COUNT] = {
+    [GESTURE_HOLD] = GESTURE_USAGE_HOLD,
+    [GESTURE_DOUBLE_TAP] = GESTURE_USAGE_DOUBLE_TAP,
+    [GESTURE_TAP_HOLD] = GESTURE_USAGE_TAP_HOLD,
+};
+
+static gesture_emit_cb_t emit_cb;
+static enum gesture_state state = G_IDLE;
+static uint8_t held_usage;          // G_HOLDING で押下中のキーコード
+static bool held_emitted;           // G_HOLDING で押下を送った (離されたら解放を送る)
+static uint32_t seq_start_cycles;   // 最初の押下の時刻
+static int64_t timer_expiry;        // 判定タイマーの満了予定時刻
+
+static uint32_t stat_count[GESTURE_COUNT];
+static uint32_t stat_latency_max_us[GESTURE_COUNT];
+static uint64_t stat_latency_sum_us[GESTURE_COUNT];
+
+// 判定タイマー。判定の遅れはそのまま入力の遅れになるので遅延は許さない
+static void gesture_timer_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(gesture_timer, gesture_timer_handler, 0);
+
+static void gesture_timer_handler(struct deadline *dummy)
+{
+    post_event(EVENT_GESTURE_TIMEOUT);
+}
+
+static void start_timer(uint32_t ms)
+{
+    timer_expiry = k_uptime_get() + ms;
+    deadline_start(&gesture_timer, K_MSEC(ms), K_NO_WAIT);
+}
+
+static void stop_timer(void)
+{
+    timer_expiry = 0;
+    deadline_stop(&gesture_timer);
+}
+
+static bool enabled(enum gesture g)
+{
+    return usages[g] != 0;
+}
+
+// ジェスチャーを確定する
+static void decide(enum gesture g)
+{
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - seq_start_cycles);
+
+    stat_count[g]++;
+    stat_latency_sum_us[g] += us;
+    if (us > stat_latency_max_us[g]) stat_latency_max_us[g] = us;
+
+    if (g != GESTURE_TAP || enabled(GESTURE_HOLD) || enabled(GESTURE_DOUBLE_TAP) || enabled(GESTURE_TAP_HOLD)) {
+        printk("Gesture %s decided in %u us\n", gesture_names[g], us);
+    }
+}
+
+// 送るかどうか。タップはキーコードが 0 (DIPSW がすべて OFF) でも従来どおり空のレポートを送る
+static bool emits(enum gesture g)
+{
+    return g == GESTURE_TAP || usages[g] != 0;
+}
+
+// キーコードを押下して、キーが離されるまで保持する
+static void emit_held(enum gesture g)
+{
+    decide(g);
+    held_usage = usages[g];
+    held_emitted = emits(g);
+    if (held_emitted) emit_cb(held_usage, true);
+    state = G_HOLDING;
+}
+
+// キーコードの押下と解放を続けて送る
+static void emit_tap(enum gesture g)
+{
+    decide(g);
+    if (emits(g)) {
+        emit_cb(usages[g], true);
+        emit_cb(usages[g], false);
+    }
+    state = G_IDLE;
+}
+
+void gesture_init(uint8_t tap_usage, gesture_emit_cb_t emit)
+{
+    usages[GESTURE_TAP] = tap_usage;
+    emit_cb = emit;
+    state = G_IDLE;
+}
+
+void gesture_input(bool pressed, uint32_t cycles)
+{
+    switch (state) {
+    case G_IDLE:
+        if (!pressed) break;
+        seq_start_cycles = cycles;
+        if (!enabled(GESTURE_HOLD) && !enabled(GESTURE_DOUBLE_TAP) && !enabled(GESTURE_TAP_HOLD)) {
+            // 結果はタップしかないので、待たずにそのまま押下を送る
+            emit_held(GESTURE_TAP);
+        } else {
+            state = G_DOWN1;
+            start_timer(GESTURE_HOLD_MS);
+        }
+        break;
+
+    case G_DOWN1:
+        if (pressed) break;
+        stop_timer();
+        if (!enabled(GESTURE_DOUBLE_TAP) && !enabled(GESTURE_TAP_HOLD)) {
+            // 2 回目の押下を待つ必要がないので、離した時点でタップと確定する
+            emit_tap(GESTURE_TAP);
+        } else {
+            state = G_UP1;
+            start_timer(GESTURE_TAP_GAP_MS);
+        }
+        break;
+
+    case G_UP1:
+        if (!pressed) break;
+        stop_timer();
+        if (!enabled(GESTURE_TAP_HOLD)) {
+            // 残る結果はダブルタップだけなので、2 回目の押下で確定する
+            emit_held(GESTURE_DOUBLE_TAP);
+        } else {
+            state = G_DOWN2;
+            start_timer(GESTURE_HOLD_MS);
+        }
+        break;
+
+    case G_DOWN2:
+        if (pressed) break;
+        stop_timer();
+        if (enabled(GESTURE_DOUBLE_TAP)) {
+            emit_tap(GESTURE_DOUBLE_TAP);
+        } else {
+            // ダブルタップが無効なら、タップが 2 回あったことにする
+            emit_tap(GESTURE_TAP);
+            seq_start_cycles = cycles;
+            emit_tap(GESTURE_TAP);
+        }
+        break;
+
+    case G_HOLDING:
+        if (pressed) break;
+        if (held_emitted) emit_cb(held_usage, false);
+        held_usage = 0;
+        held_emitted = false;
+        state = G_IDLE;
+        break;
+    }
+}
+
+void gesture_timeout(void)
+{
+    // タイマーが止められる前に投入されたイベントは無視する
+    if (timer_expiry == 0 || k_uptime_get() < timer_expiry) return;
+    timer_expiry = 0;
+
+    switch (state) {
+    case G_DOWN1:
+        // 長押し。ホールドが無効なら普通のキーとして押下を続ける
+        emit_held(enabled(GESTURE_HOLD) ? GESTURE_HOLD : GESTURE_TAP);
+        break;
+
+    case G_UP1:
+        // 2 回目の押下が来なかった
+        emit_tap(GESTURE_TAP);
+        break;
+
+    case G_DOWN2:
+        emit_held(GESTURE_TAP_HOLD);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void gesture_get_stats(struct gesture_stats stats[GESTURE_COUNT])
+{
+    for (int i = 0; i < GESTURE_COUNT; i++) {
+        stats[i].count = stat_count[i];
+        stats[i].latency_max_us = stat_latency_max_us[i];
+        stats[i].latency_avg_us = stat_count[i] ? (uint32_t)(stat_latency_sum_us[i] / stat_count[i]) : 0;
+    }
+}
+
+void gesture_print_stats(void)
+{
+    struct gesture_stats stats[GESTURE_COUNT];
+
+    gesture_get_stats(stats);
+    for (int i = 0; i < GESTURE_COUNT; i++) {
+        if (stats[i].count) {
+            printk("gesture %s: %u, decision latency avg %u us max %u us\n",
+                gesture_names[i], stats[i].count, stats[i].latency_avg_us, stats[i].latency_max_us);
+        }
+    }
+}
+
+
+/* End of gesture.c */
@@ -0,0 +1,55 @@
+/* This file is gesture.h, tap / hold / double-tap gesture engine for the key */
+
+#ifndef GESTURE_H_
+#define GESTURE_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+// ジェスチャーの判定時間 (ms)
+#define GESTURE_HOLD_MS 300     // これ以上押し続けたらホールド
+#define GESTURE_TAP_GAP_MS 200  // タップ後、2 回目の押下をこの時間だけ待つ
+
+// ジェスチャーごとに送信するキーコード。0 ならそのジェスチャーは無効。
+// タップのキーコードは DIPSW の値を使う。DIPSW が 0 でもタップは無効にならず、
+// 押下/解放のたびにキーのない (空の) レポートを送る (従来の動作)。
+// タップ以外がすべて無効のときは、押下/解放をそのまま遅延なく送る (従来の動作)
+#define GESTURE_USAGE_HOLD 0
+#define GESTURE_USAGE_DOUBLE_TAP 0
+#define GESTURE_USAGE_TAP_HOLD 0
+
+enum gesture {
+    GESTURE_TAP,
+    GESTURE_HOLD,
+    GESTURE_DOUBLE_TAP,
+    GESTURE_TAP_HOLD,
+
+    GESTURE_COUNT
+};
+
+// 判定したジェスチャーのキーコードを押下/解放するコールバック
+typedef void (*gesture_emit_cb_t)(uint8_t usage, bool pressed);
+
+void gesture_init(uint8_t tap_usage, gesture_emit_cb_t emit);
+
+// デバウンス済みのキーの押下/解放を入力する。cycles はイベントが発生したときのサイクルカウンタ値。
+// メインループから呼ぶこと
+void gesture_input(bool pressed, uint32_t cycles);
+
+// 判定タイマーが満了したとき (EVENT_GESTURE_TIMEOUT) に呼ぶ
+void gesture_timeout(void);
+
+// ジェスチャーごとの判定遅延 (最初の押下から判定まで)
+struct gesture_stats {
+    uint32_t count;
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+};
+
+void gesture_get_stats(struct gesture_stats stats[GESTURE_COUNT]);
+void gesture_print_stats(void);
+
+#endif /* GESTURE_H_ */
+
+
+/* End of gesture.h */
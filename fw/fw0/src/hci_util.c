@@ -0,0 +1,154 @@
+/* This file is hci_util.c, helpers for HCI commands the host API does not wrap */
+
+#include "includes.h"
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/hci_vs.h>
+#if defined(CONFIG_BT_LL_SOFTDEVICE)
+#include <sdc_hci_vs.h>
+#endif
+#include "hci_util.h"
+
+int read_conn_rssi(struct bt_conn *conn, int8_t *rssi)
+{
+    struct bt_hci_cp_read_rssi *cp;
+    struct bt_hci_rp_read_rssi *rp;
+    struct net_buf *buf;
+    struct net_buf *rsp = NULL;
+    uint16_t handle;
+    int err;
+
+    err = bt_hci_get_conn_handle(conn, &handle);
+    if (err) {
+        return err;
+    }
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    rp = (void *)rsp->data;
+    *rssi = rp->rssi;
+    net_buf_unref(rsp);
+
+    return 0;
+}
+
+// Zephyr のベンダー固有コマンドの対応表 (Read Supported Commands) で Write Tx Power Level を表すビット
+#define VS_CMD_WRITE_TX_POWER(cmd) ((cmd)[1] & BIT(5))
+
+// Write Tx Power Level に対応しているか (0: まだ調べていない、1: 対応、2: 非対応)
+static atomic_t tx_power_support;
+
+// コントローラが送信電力の設定に対応しているかを調べる。
+// 一時的な失敗 (バッファ不足など) では結果を覚えず、次の呼び出しで調べ直す
+static int check_tx_power_support(void)
+{
+    struct bt_hci_rp_vs_read_supported_commands *rp;
+    struct net_buf *rsp = NULL;
+    atomic_val_t support = atomic_get(&tx_power_support);
+
+    if (support) return support == 1 ? 0 : -ENOTSUP;
+
+    int err = bt_hci_cmd_send_sync(BT_HCI_OP_VS_READ_SUPPORTED_COMMANDS, NULL, &rsp);
+    if (err == -EIO) {
+        // パラメータのない読み出しコマンドの失敗は、ベンダー固有コマンドがない (Unknown HCI Command)
+        atomic_set(&tx_power_support, 2);
+        return -ENOTSUP;
+    }
+    if (err) {
+        return err;
+    }
+
+    rp = (void *)rsp->data;
+    support = (rp->status == 0 && VS_CMD_WRITE_TX_POWER(rp->commands)) ? 1 : 2;
+    net_buf_unref(rsp);
+    atomic_set(&tx_power_support, support);
+    return support == 1 ? 0 : -ENOTSUP;
+}
+
+static int write_tx_power(uint8_t handle_type, uint16_t handle, int8_t dbm, int8_t *selected)
+{
+    struct bt_hci_cp_vs_write_tx_power_level *cp;
+    struct bt_hci_rp_vs_write_tx_power_level *rp;
+    struct net_buf *buf;
+    struct net_buf *rsp = NULL;
+    int err;
+
+    err = check_tx_power_support();
+    if (err) {
+        return err;
+    }
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle_type = handle_type;
+    cp->handle = sys_cpu_to_le16(handle);
+    cp->tx_power_level = dbm;
+
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    rp = (void *)rsp->data;
+    if (selected) {
+        *selected = rp->selected_tx_power;
+    }
+    net_buf_unref(rsp);
+
+    return 0;
+}
+
+int write_conn_tx_power(struct bt_conn *conn, int8_t dbm, int8_t *selected)
+{
+    uint16_t handle;
+    int err;
+
+    err = bt_hci_get_conn_handle(conn, &handle);
+    if (err) {
+        return err;
+    }
+    return write_tx_power(BT_HCI_VS_LL_HANDLE_TYPE_CONN, handle, dbm, selected);
+}
+
+int write_adv_tx_power(int8_t dbm, int8_t *selected)
+{
+    // bt_le_adv_start() で始めるレガシーアドバタイズのハンドルは 0
+    return write_tx_power(BT_HCI_VS_LL_HANDLE_TYPE_ADV, 0, dbm, selected);
+}
+
+#if defined(CONFIG_BT_LL_SOFTDEVICE)
+int enable_conn_anchor_report(bool enable)
+{
+    sdc_hci_cmd_vs_conn_anchor_point_update_event_report_enable_t *cp;
+    struct net_buf *buf;
+
+    buf = bt_hci_cmd_create(SDC_HCI_OPCODE_CMD_VS_CONN_ANCHOR_POINT_UPDATE_EVENT_REPORT_ENABLE,
+                            sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->enable = enable;
+
+    return bt_hci_cmd_send_sync(SDC_HCI_OPCODE_CMD_VS_CONN_ANCHOR_POINT_UPDATE_EVENT_REPORT_ENABLE,
+                                buf, NULL);
+}
+#endif
+
+
+/* End of hci_util.c */
@@ -0,0 +1,29 @@
+/* This file is hci_util.h, helpers for HCI commands the host API does not wrap */
+
+#ifndef HCI_UTIL_H_
+#define HCI_UTIL_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// 接続の RSSI (dBm) をコントローラから読み出す。
+// HCI コマンドを同期送信するので、BT の RX スレッドからは呼ばないこと
+int read_conn_rssi(struct bt_conn *conn, int8_t *rssi);
+
+// 送信電力 (dBm) を設定する (Zephyr のベンダー固有 HCI コマンド)。
+// コントローラが実際に選んだ値を selected に返す。対応していないコントローラでは -ENOTSUP を返す
+// (最初の呼び出しでベンダー固有コマンドの対応表を読んで調べる)。それ以外のエラーは一時的なもの
+int write_conn_tx_power(struct bt_conn *conn, int8_t dbm, int8_t *selected);
+int write_adv_tx_power(int8_t dbm, int8_t *selected);
+
+#if defined(CONFIG_BT_LL_SOFTDEVICE)
+// 接続イベントごとにアンカーの時刻を報告させる (SoftDevice Controller のベンダー固有 HCI コマンド)。
+// 報告はベンダー固有のイベントで届く (bt_hci_register_vnd_evt_cb())
+int enable_conn_anchor_report(bool enable);
+#endif
+
+#endif /* HCI_UTIL_H_ */
+
+
+/* End of hci_util.h */
@@ -0,0 +1,137 @@
+/* This file is host_sync.c, tracks the key state each host has acknowledged */
+
+#include "includes.h"
+#include "events.h"
+#include "notify_track.h"
+#include "host_sync.h"
+
+// 接続ごとの状態 (bt_conn_index() で引く)
+static struct host_conn {
+    struct bt_conn *conn;
+    bool acked_pressed;     // 送信完了を確認した最後の状態
+    bool acked_known;       // acked_pressed が有効かどうか
+    uint8_t req;            // 要求されている同期 (enum host_sync_req)
+} hc[CONFIG_BT_MAX_CONN];
+
+// 切断したホストが最後に受け取った状態 (再接続時の判定に使う)
+static struct host_last {
+    bt_addr_le_t addr;
+    bool valid;
+    bool may_see_pressed;
+} hl[CONFIG_BT_MAX_PAIRED];
+static uint8_t hl_next; // 次に上書きする hl のインデックス
+
+// 送信完了コールバックは BT のスレッドから、それ以外はメインループや BT の RX スレッドから
+// 呼ばれるので、ブロックしないスピンロックで保護する
+static struct k_spinlock lock;
+
+static struct host_last *find_host_last(const bt_addr_le_t *addr)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(hl); i++) {
+        if (hl[i].valid && bt_addr_le_eq(&hl[i].addr, addr)) {
+            return &hl[i];
+        }
+    }
+    return NULL;
+}
+
+static bool may_see_pressed(const struct host_conn *h)
+{
+    // 送信完了待ちの状態は notify_track.c が持つ
+    return !h->acked_known || h->acked_pressed || notify_track_any_pressed(h->conn);
+}
+
+void host_sync_connected(struct bt_conn *conn)
+{
+    struct host_conn *h = &hc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct host_last *last = find_host_last(bt_conn_get_dst(conn));
+    h->conn = conn;
+    h->req = HOST_SYNC_NONE;
+    // 前回の切断時に解放まで受け取っていたことが分かっているホストだけ「解放済み」とする
+    h->acked_known = last && !last->may_see_pressed;
+    h->acked_pressed = false;
+    k_spin_unlock(&lock, key);
+}
+
+void host_sync_disconnected(struct bt_conn *conn)
+{
+    struct host_conn *h = &hc[bt_conn_index(conn)];
+    const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (h->conn == conn) {
+        struct host_last *last = find_host_last(addr);
+        if (!last) {
+            last = &hl[hl_next];
+            hl_next = (hl_next + 1) % ARRAY_SIZE(hl);
+            bt_addr_le_copy(&last->addr, addr);
+            last->valid = true;
+        }
+        last->may_see_pressed = may_see_pressed(h);
+        h->conn = NULL;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void host_sync_report_done(struct bt_conn *conn, const struct notify_track *n)
+{
+    struct host_conn *h = &hc[bt_conn_index(conn)];
+
+    // 送信完了待ちから降ろす前に呼ばれるので、その間も押下を見逃さない
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (h->conn == conn) {
+        h->acked_pressed = n->pressed;
+        h->acked_known = true;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+bool host_sync_host_may_see_pressed(struct bt_conn *conn)
+{
+    struct host_conn *h = &hc[bt_conn_index(conn)];
+    bool ret = true;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (h->conn == conn) {
+        ret = may_see_pressed(h);
+    }
+    k_spin_unlock(&lock, key);
+    return ret;
+}
+
+void host_sync_request(struct bt_conn *conn, uint8_t req)
+{
+    bool any = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(hc); i++) {
+        if (hc[i].conn && (!conn || hc[i].conn == conn)) {
+            hc[i].req |= req;
+            any = true;
+        }
+    }
+    k_spin_unlock(&lock, key);
+
+    if (any) {
+        post_event(EVENT_HOST_SYNC);
+    }
+}
+
+uint8_t host_sync_take(struct bt_conn *conn)
+{
+    struct host_conn *h = &hc[bt_conn_index(conn)];
+    uint8_t req = HOST_SYNC_NONE;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (h->conn == conn) {
+        req = h->req;
+        h->req = HOST_SYNC_NONE;
+    }
+    k_spin_unlock(&lock, key);
+    return req;
+}
+
+
+/* End of host_sync.c */
@@ -0,0 +1,41 @@
+/* This file is host_sync.h, tracks the key state each host has acknowledged */
+
+#ifndef HOST_SYNC_H_
+#define HOST_SYNC_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+#include "notify_track.h"
+
+// ホストにキー状態を送り直す理由
+enum host_sync_req {
+    HOST_SYNC_NONE = 0,
+    HOST_SYNC_RECONNECT = BIT(0),   // (再)接続して暗号化が完了した: 押しっぱなしにならないよう解放を送る
+    HOST_SYNC_CURRENT = BIT(1),     // 通知の再購読やプロトコルモードの切り替え: 現在の状態を送る
+    HOST_SYNC_REPLAY = BIT(2),      // 再送の前の分の通知が完了した: 届かなかったキー入力の続きを送る
+};
+
+// 接続/切断時に呼ぶ。切断時にはホストが最後に受け取った状態をアドレスごとに覚えておく
+void host_sync_connected(struct bt_conn *conn);
+void host_sync_disconnected(struct bt_conn *conn);
+
+// レポートの送信完了コールバックで、完了したレポートの記録 (notify_track_peek() で見たもの) と共に呼ぶ。
+// 送信中の状態は notify_track.c が持つ
+void host_sync_report_done(struct bt_conn *conn, const struct notify_track *n);
+
+// ホストが押下状態を受け取っている可能性があるかどうか
+// (確認済みの状態が押下、押下を送信中、または前回の状態が分からない)
+bool host_sync_host_may_see_pressed(struct bt_conn *conn);
+
+// 同期を要求して EVENT_HOST_SYNC を投入する。conn が NULL ならすべての接続が対象。
+// BT のコールバックから呼び出し可能
+void host_sync_request(struct bt_conn *conn, uint8_t req);
+
+// 要求されている同期を取り出してクリアする (enum host_sync_req のビットの組み合わせ)
+uint8_t host_sync_take(struct bt_conn *conn);
+
+#endif /* HOST_SYNC_H_ */
+
+
+/* End of host_sync.h */
@@ -0,0 +1,811 @@
+/* This file is hub.c, hub role: collect key events from sibling units and merge them into one report */
+
+#include "includes.h"
+#include <string.h>
+#include "events.h"
+#include "hub_link.h"
+#include "press_time.h"
+#include "hub.h"
+#if defined(CONFIG_BOARD_NRF52_BSIM)
+#include <nsi_hw_scheduler.h>
+#endif
+
+BUILD_ASSERT(HUB_NODE_MAX > 0, "hub mode needs CONFIG_BT_MAX_CONN > CONFIG_BT_HIDS_MAX_CLIENT_COUNT");
+BUILD_ASSERT(CONFIG_BT_MAX_PAIRED >= CONFIG_BT_HIDS_MAX_CLIENT_COUNT + HUB_NODE_MAX,
+             "hub mode needs a bond for each host and each enrolled node");
+BUILD_ASSERT(HUB_NODE_TIMEOUT * 10000U > HUB_NODE_INTERVAL * 1250U * (1 + HUB_NODE_LATENCY) * 2,
+             "supervision timeout too short for the node interval and latency");
+
+#define DEVICE_NAME CONFIG_BT_DEVICE_NAME
+#define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
+
+// 子機を探すスキャン (単位: 0.625ms)。名前はスキャン応答に入っているのでアクティブスキャンにする
+#define HUB_SCAN_INTERVAL 0x0060    // 60ms
+#define HUB_SCAN_WINDOW 0x0030      // 30ms
+
+// キーの通知がなかった (子機ではなかった) 相手を覚えておく数
+#define HUB_REJECT_MAX 4
+
+// 登録した子機のアドレスを保存する設定の名前
+#define HUB_SETTINGS_NODES "hub/nodes"
+
+enum node_state {
+    NODE_FREE,
+    NODE_CONNECTING,        // 接続を要求した
+    NODE_SECURING,          // 暗号化を待っている
+    NODE_PAIRING,           // 登録のペアリングの完了 (ボンディング) を待っている
+    NODE_DISCOVERING,       // キーの通知の特性と CCC を探している
+    NODE_SUBSCRIBED,        // 通知を購読した
+};
+
+static struct hub_node {
+    struct bt_conn *conn;
+    uint8_t state;          // enum node_state
+    bool enrol;             // 登録の受付中に見つけた (ペアリングしてボンディングしてよい)
+    bool waiting_confirm;   // ペアリングボタンでの確認を待っている
+    bool trusted;           // 暗号化され、ボンディング済みで、登録した子機 (これ以外の通知は捨てる)
+    uint8_t usage;          // 子機が押しているキーコード (0 なら離している)
+    uint8_t seq;            // 最後に受け取った通知のシーケンス番号
+    bool seq_valid;
+    int64_t found_at;       // 見つけた時刻 (購読までの時間の計測)
+    struct bt_gatt_discover_params disc;
+    struct bt_gatt_subscribe_params sub;
+} nodes[HUB_NODE_MAX];
+
+// 登録した子機 (ボンディングした ID アドレス)。登録の受付中以外はこれだけをスキャンで拾う
+static bt_addr_le_t enrolled[HUB_NODE_MAX];
+static uint8_t enrolled_count;
+static bool enrolling;              // 登録の受付中 (ペアリングモード)
+static bool accept_list_dirty = true; // コントローラのフィルタアクセプトリストを作り直す
+
+// 子機との接続・通知は BT のスレッドから、レポートの作成はメインループから触るのでスピンロックで保護する
+static struct k_spinlock lock;
+static bool connecting;             // 接続を要求中 (同時に一つだけ)
+static bt_addr_le_t rejected[HUB_REJECT_MAX];
+static uint8_t rejected_next;
+
+// まだホストに送っていない子機のキー入力のうち、最も古いもの
+static bool pending;
+static uint32_t pending_cycles;     // 通知を受け取った時刻
+static uint32_t pending_edge_us;    // 子機でのエッジの時刻
+
+static struct hub_stats stats;
+static uint64_t setup_sum_ms;
+static uint32_t setup_count;
+static uint64_t latency_sum_us;
+static uint64_t e2e_sum_us;
+static uint32_t e2e_count;
+
+static void start_scan(void);
+static void start_discovery(struct bt_conn *conn, struct hub_node *node);
+
+// 接続に対応する子機を探す (ロック取得済みで呼ぶこと)
+static struct hub_node *find_node(struct bt_conn *conn)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].state != NODE_FREE && nodes[i].conn == conn) return &nodes[i];
+    }
+    return NULL;
+}
+
+// 登録した子機か (ロック取得済みで呼ぶこと)
+static bool is_enrolled(const bt_addr_le_t *addr)
+{
+    for (size_t i = 0; i < enrolled_count; i++) {
+        if (bt_addr_le_eq(&enrolled[i], addr)) return true;
+    }
+    return false;
+}
+
+struct bond_match {
+    const bt_addr_le_t *addr;
+    bool found;
+};
+
+static void bond_match_cb(const struct bt_bond_info *info, void *user_data)
+{
+    struct bond_match *m = user_data;
+    if (bt_addr_le_eq(&info->addr, m->addr)) m->found = true;
+}
+
+static bool has_bond(const bt_addr_le_t *addr)
+{
+    struct bond_match m = { .addr = addr };
+
+    bt_foreach_bond(BT_ID_DEFAULT, bond_match_cb, &m);
+    return m.found;
+}
+
+// 暗号化した接続の相手が、ボンディング済みで登録した子機か
+static bool is_trusted(struct bt_conn *conn)
+{
+    const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+
+    if (bt_conn_get_security(conn) < BT_SECURITY_L2 || !has_bond(addr)) return false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool ok = is_enrolled(addr);
+    k_spin_unlock(&lock, key);
+    return ok;
+}
+
+static int enrolled_load_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    if (len <= sizeof(enrolled) && len % sizeof(enrolled[0]) == 0) {
+        ssize_t n = read_cb(cb_arg, enrolled, len);
+        enrolled_count = n > 0 ? n / sizeof(enrolled[0]) : 0;
+    }
+    return 0;
+}
+
+// 子機を登録して保存する。いっぱいなら最も古い登録を消す (ボンディングも消す)
+static void enrol(const bt_addr_le_t *addr)
+{
+    bt_addr_le_t evicted;
+    bool evict = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (!is_enrolled(addr)) {
+        if (enrolled_count == ARRAY_SIZE(enrolled)) {
+            bt_addr_le_copy(&evicted, &enrolled[0]);
+            evict = true;
+            memmove(&enrolled[0], &enrolled[1], sizeof(enrolled) - sizeof(enrolled[0]));
+            enrolled_count--;
+        }
+        bt_addr_le_copy(&enrolled[enrolled_count++], addr);
+        accept_list_dirty = true;
+        stats.enrolments++;
+    }
+    stats.enrolled = enrolled_count;
+    k_spin_unlock(&lock, key);
+
+    if (evict) bt_unpair(BT_ID_DEFAULT, &evicted);
+    int err = settings_save_one(HUB_SETTINGS_NODES, enrolled, enrolled_count * sizeof(enrolled[0]));
+    if (err) {
+        printk("hub: saving enrolled nodes failed (err %d)\n", err);
+    }
+}
+
+// 登録した子機だけをコントローラのフィルタアクセプトリストに入れる (スキャンを止めてから呼ぶこと)
+static void rebuild_accept_list(void)
+{
+    bt_addr_le_t list[HUB_NODE_MAX];
+    uint8_t n;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    n = enrolled_count;
+    memcpy(list, enrolled, n * sizeof(list[0]));
+    accept_list_dirty = false;
+    k_spin_unlock(&lock, key);
+
+    bt_le_filter_accept_list_clear();
+    for (uint8_t i = 0; i < n; i++) {
+        int err = bt_le_filter_accept_list_add(&list[i]);
+        if (err) {
+            printk("hub: bt_le_filter_accept_list_add() failed (err %d)\n", err);
+            accept_list_dirty = true;
+        }
+    }
+}
+
+// 既に接続している相手か、子機ではなかった相手か (ロック取得済みで呼ぶこと)
+static bool is_known(const bt_addr_le_t *addr)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].conn && bt_addr_le_eq(bt_conn_get_dst(nodes[i].conn), addr)) return true;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(rejected); i++) {
+        if (bt_addr_le_eq(&rejected[i], addr)) return true;
+    }
+    return false;
+}
+
+// 子機との接続をやめる。接続の途中で失敗した場合は失敗として数える
+static void drop_node(struct bt_conn *conn, bool reject)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.connect_fails++;
+    if (reject) {
+        bt_addr_le_copy(&rejected[rejected_next], bt_conn_get_dst(conn));
+        rejected_next = (rejected_next + 1) % HUB_REJECT_MAX;
+    }
+    k_spin_unlock(&lock, key);
+
+    bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+}
+
+static bool parse_name(struct bt_data *data, void *user_data)
+{
+    bool *match = user_data;
+
+    if (data->type == BT_DATA_NAME_COMPLETE) {
+        *match = data->data_len == DEVICE_NAME_LEN && memcmp(data->data, DEVICE_NAME, DEVICE_NAME_LEN) == 0;
+        return false;
+    }
+    return true;
+}
+
+// スキャンの結果。自分と同じ名前のスキャン応答を返した相手に接続する
+static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+{
+    struct hub_node *node = NULL;
+    bool match = false;
+
+    if (type != BT_GAP_ADV_TYPE_SCAN_RSP) return;
+    bt_data_parse(ad, parse_name, &match);
+    if (!match) return;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (!connecting && !is_known(addr)) {
+        for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+            if (nodes[i].state == NODE_FREE) {
+                node = &nodes[i];
+                memset(node, 0, sizeof(*node));
+                node->state = NODE_CONNECTING;
+                // 受付中でなければ登録した子機しか見つからない (フィルタアクセプトリスト)
+                node->enrol = enrolling && !is_enrolled(addr);
+                node->found_at = k_uptime_get();
+                connecting = true;
+                break;
+            }
+        }
+    }
+    k_spin_unlock(&lock, key);
+
+    if (!node) return;
+
+    bt_le_scan_stop();
+
+    struct bt_conn *conn;
+    int err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN,
+        BT_LE_CONN_PARAM(HUB_NODE_INTERVAL, HUB_NODE_INTERVAL, HUB_NODE_LATENCY, HUB_NODE_TIMEOUT),
+        &conn);
+
+    key = k_spin_lock(&lock);
+    if (err) {
+        node->state = NODE_FREE;
+        connecting = false;
+        stats.connect_fails++;
+    } else {
+        node->conn = conn;
+    }
+    k_spin_unlock(&lock, key);
+
+    if (err) {
+        printk("hub: bt_conn_le_create() failed (err %d)\n", err);
+        start_scan();
+    }
+}
+
+// 空きがあれば子機を探す。登録の受付中は名前の合うものすべて、それ以外は登録した子機だけを探す
+static void start_scan(void)
+{
+    struct bt_le_scan_param param = {
+        .type = BT_LE_SCAN_TYPE_ACTIVE,
+        .options = BT_LE_SCAN_OPT_FILTER_DUPLICATE,
+        .interval = HUB_SCAN_INTERVAL,
+        .window = HUB_SCAN_WINDOW,
+    };
+    bool room = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].state == NODE_FREE) room = true;
+    }
+    room = room && !connecting && (enrolling || enrolled_count);
+    bool filter = !enrolling;
+    bool rebuild = filter && accept_list_dirty;
+    k_spin_unlock(&lock, key);
+
+    if (!room) return;
+
+    if (filter) {
+        param.options |= BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST;
+        if (rebuild) {
+            // 使用中のリストは変えられないので、スキャンを止めてから作り直す
+            bt_le_scan_stop();
+            rebuild_accept_list();
+        }
+    }
+
+    int err = bt_le_scan_start(&param, device_found);
+    if (err && err != -EALREADY) {
+        printk("hub: bt_le_scan_start() failed (err %d)\n", err);
+    }
+}
+
+// 子機からのキーの通知
+static uint8_t notify_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
+                           const void *data, uint16_t length)
+{
+    struct hub_node *node = CONTAINER_OF(params, struct hub_node, sub);
+    struct hub_key_event ev;
+
+    if (!data) {
+        // 購読が解除された (切断)
+        params->value_handle = 0;
+        return BT_GATT_ITER_STOP;
+    }
+    // 暗号化され、ボンディング済みで、登録した子機の通知だけを受け付ける
+    if (!node->trusted || bt_conn_get_security(conn) < BT_SECURITY_L2) {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        stats.untrusted++;
+        k_spin_unlock(&lock, key);
+        return BT_GATT_ITER_CONTINUE;
+    }
+    if (length < sizeof(ev)) return BT_GATT_ITER_CONTINUE;
+    memcpy(&ev, data, sizeof(ev));
+
+#if defined(CONFIG_BOARD_NRF52_BSIM)
+    // 子機が送ったアンカーからの時間と、この接続の同じ接続イベントのアンカーの時刻から
+    // エッジの時刻を復元し、シミュレーションの時刻に直す。正解 (子機のピンに刺激を与えた時刻) との
+    // 比較は scripts/hub_bsim.sh press が行う (子機の時計で測ったエッジの時刻とは比べない)
+    uint32_t anchor_us;
+    bool press_est = false;
+    uint64_t press_sim_us = 0;
+    if ((ev.flags & PRESS_TIME_FLAG_ANCHOR) && press_time_event_us(conn, ev.event_counter, &anchor_us)) {
+        uint32_t ago_us = k_cyc_to_us_floor32(k_cycle_get_32()) - (anchor_us + ev.offset_us);
+        press_sim_us = nsi_hws_get_time() - ago_us;
+        press_est = true;
+    }
+#endif
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (node->seq_valid && (uint8_t)(ev.seq - node->seq) != 1) {
+        stats.seq_gaps += (uint8_t)(ev.seq - node->seq - 1);
+    }
+    node->seq = ev.seq;
+    node->seq_valid = true;
+    node->usage = ev.usage;
+    stats.key_events++;
+#if defined(CONFIG_BOARD_NRF52_BSIM)
+    if (press_est) stats.press_samples++;
+#endif
+    if (!pending) {
+        pending = true;
+        pending_cycles = k_cycle_get_32();
+        pending_edge_us = ev.edge_us;
+    }
+    k_spin_unlock(&lock, key);
+
+#if defined(CONFIG_BOARD_NRF52_BSIM)
+    if (press_est) {
+        printk("hub: press est %u us\n", (uint32_t)press_sim_us);
+    }
+#endif
+    post_event(EVENT_HUB_REPORT);
+    return BT_GATT_ITER_CONTINUE;
+}
+
+static void subscribe_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params)
+{
+    struct hub_node *node = CONTAINER_OF(params, struct hub_node, sub);
+
+    if (err) {
+        printk("hub: subscribe failed (err %u)\n", err);
+        drop_node(conn, false);
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t ms = (uint32_t)(k_uptime_get() - node->found_at);
+    node->state = NODE_SUBSCRIBED;
+    stats.nodes++;
+    if (stats.nodes > stats.nodes_max) stats.nodes_max = stats.nodes;
+    setup_count++;
+    setup_sum_ms += ms;
+    if (ms > stats.setup_max_ms) stats.setup_max_ms = ms;
+    uint8_t count = stats.nodes;
+    k_spin_unlock(&lock, key);
+
+    printk("hub: node %d subscribed in %u ms (%u nodes)\n", (int)(node - nodes), ms, count);
+}
+
+// キーの通知の特性を探した結果と、その CCC を探した結果
+static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                             struct bt_gatt_discover_params *params)
+{
+    static const struct bt_uuid_16 ccc_uuid = BT_UUID_INIT_16(BT_UUID_GATT_CCC_VAL);
+    struct hub_node *node = CONTAINER_OF(params, struct hub_node, disc);
+
+    if (params->type == BT_GATT_DISCOVER_CHARACTERISTIC) {
+        if (!attr) {
+            // 同じ名前だが、キーの通知を持っていない
+            printk("hub: no key link service\n");
+            drop_node(conn, true);
+            return BT_GATT_ITER_STOP;
+        }
+
+        const struct bt_gatt_chrc *chrc = attr->user_data;
+
+        node->sub.notify = notify_func;
+        node->sub.subscribe = subscribe_func;
+        node->sub.value = BT_GATT_CCC_NOTIFY;
+        node->sub.value_handle = chrc->value_handle;
+
+        // 値の後ろにある CCC を探す
+        params->uuid = &ccc_uuid.uuid;
+        params->start_handle = chrc->value_handle + 1;
+        params->end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+        params->type = BT_GATT_DISCOVER_DESCRIPTOR;
+
+        int err = bt_gatt_discover(conn, params);
+        if (err) {
+            printk("hub: bt_gatt_discover() failed (err %d)\n", err);
+            drop_node(conn, false);
+        }
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (!attr) {
+        printk("hub: no CCC for key notifications\n");
+        drop_node(conn, true);
+        return BT_GATT_ITER_STOP;
+    }
+
+    node->sub.ccc_handle = attr->handle;
+
+    int err = bt_gatt_subscribe(conn, &node->sub);
+    if (err && err != -EALREADY) {
+        printk("hub: bt_gatt_subscribe() failed (err %d)\n", err);
+        drop_node(conn, false);
+    }
+    return BT_GATT_ITER_STOP;
+}
+
+// 信頼できる子機と分かったので、キーの通知の特性を探す
+static void start_discovery(struct bt_conn *conn, struct hub_node *node)
+{
+    static const struct bt_uuid_128 key_uuid = BT_UUID_INIT_128(HUB_UUID_KEY_VAL);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    node->state = NODE_DISCOVERING;
+    node->trusted = true;
+    k_spin_unlock(&lock, key);
+
+    node->disc.uuid = &key_uuid.uuid;
+    node->disc.func = discover_func;
+    node->disc.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+    node->disc.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+    node->disc.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+    int e = bt_gatt_discover(conn, &node->disc);
+    if (e) {
+        printk("hub: bt_gatt_discover() failed (err %d)\n", e);
+        drop_node(conn, false);
+    }
+}
+
+static void node_passkey_display(struct bt_conn *conn, unsigned int passkey)
+{
+    printk("hub: passkey for node: %06u\n", passkey);
+}
+
+// 数値比較の確認。子機とハブの両方でペアリングボタンを押すと登録する
+static void node_passkey_confirm(struct bt_conn *conn, unsigned int passkey)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    if (node) node->waiting_confirm = true;
+    k_spin_unlock(&lock, key);
+
+    printk("hub: confirm node passkey %06u with the pairing button\n", passkey);
+    post_event(EVENT_CONFIRM_REQUEST);
+}
+
+static void node_auth_cancel(struct bt_conn *conn)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    if (node) node->waiting_confirm = false;
+    k_spin_unlock(&lock, key);
+}
+
+// 子機との接続は、登録するときだけ数値比較でペアリングしてボンディングする
+// (ホストの鍵とは別に、登録できる子機の数だけ CONFIG_BT_MAX_PAIRED を増やしてある: hub.conf)
+static const struct bt_conn_auth_cb node_auth_cb = {
+    .passkey_display = node_passkey_display,
+    .passkey_confirm = node_passkey_confirm,
+    .cancel = node_auth_cancel,
+};
+
+void hub_start(void)
+{
+    settings_load_subtree_direct(HUB_SETTINGS_NODES, enrolled_load_cb, NULL);
+    stats.enrolled = enrolled_count;
+    printk("hub: up to %d nodes, %u enrolled\n", HUB_NODE_MAX, enrolled_count);
+    start_scan();
+}
+
+void hub_set_enrolling(bool on)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool changed = enrolling != on;
+    enrolling = on;
+    k_spin_unlock(&lock, key);
+
+    if (!changed) return;
+
+    printk("hub: enrolment %s\n", on ? "open" : "closed");
+    // フィルタの有無を変えるので、スキャンをやり直す
+    bt_le_scan_stop();
+    start_scan();
+}
+
+void hub_confirm_all(void)
+{
+    struct bt_conn *confirm[HUB_NODE_MAX];
+    size_t n = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].state != NODE_FREE && nodes[i].waiting_confirm) {
+            nodes[i].waiting_confirm = false;
+            confirm[n++] = bt_conn_ref(nodes[i].conn);
+        }
+    }
+    k_spin_unlock(&lock, key);
+
+    for (size_t i = 0; i < n; i++) {
+        int err = bt_conn_auth_passkey_confirm(confirm[i]);
+        if (err) {
+            printk("hub: bt_conn_auth_passkey_confirm() failed (err %d)\n", err);
+        }
+        bt_conn_unref(confirm[i]);
+    }
+}
+
+void hub_pairing_complete(struct bt_conn *conn, bool bonded)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    bool was_enrol = node && node->enrol;
+    k_spin_unlock(&lock, key);
+
+    if (!node) return;
+    if (was_enrol) {
+        // ペアリングモードは一回の登録で終わる (ホストのペアリングと同じ)
+        post_event(EVENT_PAIRING_END);
+    }
+    if (!was_enrol || !bonded) {
+        drop_node(conn, false);
+        return;
+    }
+
+    enrol(bt_conn_get_dst(conn));
+    printk("hub: node %d enrolled\n", (int)(node - nodes));
+
+    key = k_spin_lock(&lock);
+    bool discover = node->state == NODE_PAIRING;
+    k_spin_unlock(&lock, key);
+    if (discover) start_discovery(conn, node);
+}
+
+void hub_pairing_failed(struct bt_conn *conn)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    bool was_enrol = node && node->enrol;
+    if (node) node->waiting_confirm = false;
+    k_spin_unlock(&lock, key);
+
+    if (!node) return;
+    if (was_enrol) post_event(EVENT_PAIRING_END);
+    drop_node(conn, false);
+}
+
+bool hub_is_node(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+
+    return bt_conn_get_info(conn, &info) == 0 && info.role == BT_CONN_ROLE_CENTRAL;
+}
+
+void hub_connected(struct bt_conn *conn, uint8_t err)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    connecting = false;
+    if (node && err) {
+        node->state = NODE_FREE;
+        node->conn = NULL;
+        stats.connect_fails++;
+    } else if (node) {
+        node->state = NODE_SECURING;
+        stats.connects++;
+    }
+    k_spin_unlock(&lock, key);
+
+    if (err) {
+        if (node) bt_conn_unref(conn);
+    } else if (node && !node->enrol && !has_bond(bt_conn_get_dst(conn))) {
+        // 登録したがボンディングの鍵がない (消された)。受付中以外は新しくペアリングしない
+        printk("hub: node %d has no bond\n", (int)(node - nodes));
+        drop_node(conn, false);
+    } else if (node) {
+        // 暗号化されないとキーの通知を購読できない。
+        // 登録した子機はボンディングの鍵で暗号化し、新しいペアリング (登録) は受付中に見つけた子機だけ、
+        // 数値比較 (MITM 保護) で両方のペアリングボタンを押したときに限る
+        bt_conn_auth_cb_overlay(conn, &node_auth_cb);
+        bt_conn_set_bondable(conn, node->enrol);
+        int e = bt_conn_set_security(conn, node->enrol ? BT_SECURITY_L4 : BT_SECURITY_L2);
+        if (e) {
+            printk("hub: bt_conn_set_security() failed (err %d)\n", e);
+            drop_node(conn, false);
+        }
+    }
+
+    // 次の子機を探す
+    start_scan();
+}
+
+void hub_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    bool release = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    if (node) {
+        if (node->state == NODE_SUBSCRIBED) stats.nodes--;
+        // 押したまま切れたら、ホストには解放を送る
+        release = node->usage != 0;
+        node->state = NODE_FREE;
+        node->conn = NULL;
+        node->usage = 0;
+        stats.disconnects++;
+    }
+    k_spin_unlock(&lock, key);
+
+    if (!node) return;
+
+    printk("hub: node %d disconnected, reason 0x%02x\n", (int)(node - nodes), reason);
+    bt_conn_unref(conn);
+    if (release) post_event(EVENT_HUB_REPORT);
+    start_scan();
+}
+
+void hub_security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct hub_node *node = find_node(conn);
+    bool securing = node && node->state == NODE_SECURING;
+    bool enrol = node && node->enrol;
+    k_spin_unlock(&lock, key);
+
+    if (!node) return;
+    if (err) {
+        printk("hub: security failed (err %d)\n", err);
+        drop_node(conn, false);
+        return;
+    }
+    if (!securing) return;
+
+    if (is_trusted(conn)) {
+        start_discovery(conn, node);
+    } else if (enrol) {
+        // 新しいペアリングの暗号化。鍵の配布が終わって登録してから探す (hub_pairing_complete)
+        key = k_spin_lock(&lock);
+        node->state = NODE_PAIRING;
+        k_spin_unlock(&lock, key);
+    } else {
+        // ボンディングも登録もない相手の通知は受け付けない
+        printk("hub: node not enrolled\n");
+        key = k_spin_lock(&lock);
+        stats.untrusted++;
+        k_spin_unlock(&lock, key);
+        drop_node(conn, false);
+    }
+}
+
+bool hub_le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+    // 子機は自分の fast/slow の値を要求してくるが、間隔はハブが決める
+    param->interval_min = HUB_NODE_INTERVAL;
+    param->interval_max = HUB_NODE_INTERVAL;
+    param->latency = HUB_NODE_LATENCY;
+    param->timeout = HUB_NODE_TIMEOUT;
+    return true;
+}
+
+static void set_usage(uint8_t report[HUB_REPORT_LEN], uint8_t usage)
+{
+    if (usage >= 0xe0 && usage <= 0xe7) {
+        report[0] |= BIT(usage - 0xe0);
+    } else if (usage && usage <= HUB_NKRO_USAGE_MAX) {
+        report[1 + usage / 8] |= BIT(usage % 8);
+    }
+}
+
+void hub_build_report(uint8_t report[HUB_REPORT_LEN], uint8_t own_usage)
+{
+    memset(report, 0, HUB_REPORT_LEN);
+    set_usage(report, own_usage);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        set_usage(report, nodes[i].usage);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void hub_build_boot_report(uint8_t report[HUB_BOOT_REPORT_LEN], uint8_t own_usage)
+{
+    uint8_t nkro[HUB_REPORT_LEN];
+    size_t n = 2;
+
+    hub_build_report(nkro, own_usage);
+    memset(report, 0, HUB_BOOT_REPORT_LEN);
+    report[0] = nkro[0];
+    for (uint8_t usage = 1; usage <= HUB_NKRO_USAGE_MAX; usage++) {
+        if (!(nkro[1 + usage / 8] & BIT(usage % 8))) continue;
+        if (n == HUB_BOOT_REPORT_LEN) {
+            // 6 キーを超えたら ErrorRollOver を返す
+            memset(&report[2], 0x01, HUB_BOOT_REPORT_LEN - 2);
+            break;
+        }
+        report[n++] = usage;
+    }
+}
+
+bool hub_any_pressed(void)
+{
+    bool any = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (nodes[i].usage) any = true;
+    }
+    k_spin_unlock(&lock, key);
+    return any;
+}
+
+void hub_report_sent(int err)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (pending && !err) {
+        uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - pending_cycles);
+        stats.reports++;
+        latency_sum_us += us;
+        if (us > stats.latency_max_us) stats.latency_max_us = us;
+#if defined(CONFIG_BOARD_NRF52_BSIM)
+        // シミュレーションでは全デバイスの時計が同じ時間軸なので、子機のエッジから測れる
+        uint32_t e2e = k_ticks_to_us_floor32((uint32_t)k_uptime_ticks()) - pending_edge_us;
+        e2e_count++;
+        e2e_sum_us += e2e;
+        if (e2e > stats.e2e_max_us) stats.e2e_max_us = e2e;
+#endif
+    }
+    pending = false;
+    k_spin_unlock(&lock, key);
+}
+
+void hub_get_stats(struct hub_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *out = stats;
+    out->setup_avg_ms = setup_count ? (uint32_t)(setup_sum_ms / setup_count) : 0;
+    out->latency_avg_us = stats.reports ? (uint32_t)(latency_sum_us / stats.reports) : 0;
+    out->e2e_avg_us = e2e_count ? (uint32_t)(e2e_sum_us / e2e_count) : 0;
+    k_spin_unlock(&lock, key);
+}
+
+void hub_print_stats(void)
+{
+    struct hub_stats st;
+
+    hub_get_stats(&st);
+    printk("hub: %u/%d nodes (max %u), connects %u fails %u disconnects %u, setup avg %u ms max %u ms\n",
+        st.nodes, HUB_NODE_MAX, st.nodes_max, st.connects, st.connect_fails, st.disconnects,
+        st.setup_avg_ms, st.setup_max_ms);
+    printk("hub: %u enrolled, %u enrolments, %u untrusted\n", st.enrolled, st.enrolments, st.untrusted);
+    printk("hub: %u key events, %u seq gaps, %u reports, latency avg %u us max %u us, "
+           "edge to report avg %u us max %u us\n",
+        st.key_events, st.seq_gaps, st.reports, st.latency_avg_us, st.latency_max_us,
+        st.e2e_avg_us, st.e2e_max_us);
+    if (st.press_samples) {
+        printk("hub: %u press times from conn events\n", st.press_samples);
+    }
+}
+
+
+/* End of hub.c */
@@ -0,0 +1,86 @@
+/* This file is hub.h, hub role: collect key events from sibling units and merge them into one report */
+
+#ifndef HUB_H_
+#define HUB_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// 子機として接続できる数 (残りはホストとの接続に使う)
+#define HUB_NODE_MAX (CONFIG_BT_MAX_CONN - CONFIG_BT_HIDS_MAX_CLIENT_COUNT)
+
+// 子機との接続パラメータ。押したときはすぐ届くように間隔を短くし、
+// 何もないときはペリフェラルレイテンシで子機の受信を間引いて消費電力を抑える
+// (間隔とレイテンシは押下の時刻の精度の確認のため EXTRA_CFLAGS で変えられる: scripts/hub_bsim.sh press)
+#ifndef HUB_NODE_INTERVAL
+#define HUB_NODE_INTERVAL 12        // 15ms (単位: 1.25ms)
+#endif
+#ifndef HUB_NODE_LATENCY
+#define HUB_NODE_LATENCY 29         // 何もなければ 450ms ごとに受信する
+#endif
+#define HUB_NODE_TIMEOUT 200        // 2秒 (15ms * (1 + 29) * 2 = 900ms 以上)
+
+// ホストに送る NKRO レポート: 修飾キー 1 バイト + キーコード 0x00-0x67 のビットマップ
+#define HUB_NKRO_USAGE_MAX 0x67
+#define HUB_REPORT_LEN (1 + (HUB_NKRO_USAGE_MAX + 1) / 8)
+// ブートプロトコルのレポート (修飾キー, 予約, キーコード 6 つ)
+#define HUB_BOOT_REPORT_LEN 8
+
+struct hub_stats {
+    uint8_t nodes;                  // 現在購読している子機の数
+    uint8_t nodes_max;              // 同時に購読していた子機の最大数
+    uint32_t connects;              // 子機との接続を確立した回数
+    uint32_t connect_fails;         // 接続・暗号化・探索・購読のどこかで失敗した回数
+    uint32_t disconnects;
+    uint32_t setup_avg_ms;          // 子機を見つけてから購読が終わるまで
+    uint32_t setup_max_ms;
+    uint32_t key_events;            // 子機から受け取ったキーの通知
+    uint32_t seq_gaps;              // 取りこぼした通知 (シーケンス番号の飛び)
+    uint32_t reports;               // 子機のキーでホストに送ったレポート
+    uint32_t latency_avg_us;        // 通知を受け取ってからホストにレポートを送るまで
+    uint32_t latency_max_us;
+    uint32_t e2e_avg_us;            // 子機のキーのエッジからホストにレポートを送るまで
+    uint32_t e2e_max_us;            // (BabbleSim のみ。実機では時計が揃っていないので 0)
+    uint32_t press_samples;         // 子機のエッジの時刻を接続イベントから復元した数 (BabbleSim のみ。
+                                    // 復元した時刻は "hub: press est" の行に出し、誤差は scripts/hub_bsim.sh で求める)
+    uint8_t enrolled;               // 登録した子機の数 (保存してある)
+    uint32_t enrolments;            // ペアリングボタンで確認して登録した回数
+    uint32_t untrusted;             // 登録していない・暗号化していない接続を切った、または通知を捨てた回数
+};
+
+// アドバタイズを開始した後に呼ぶ。子機を探して接続を始める
+void hub_start(void);
+
+// 子機との接続なら真 (セントラルとして接続したもの)。main.c の接続コールバックは
+// 子機との接続を以下の関数に渡し、ホストとの接続としては扱わない
+bool hub_is_node(struct bt_conn *conn);
+void hub_connected(struct bt_conn *conn, uint8_t err);
+void hub_disconnected(struct bt_conn *conn, uint8_t reason);
+void hub_security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err);
+// 登録の受付 (ペアリングモードの間だけ)。受付中は名前の合う子機を見つけて、数値比較でペアリングする。
+// 受付中以外は登録した子機だけをフィルタアクセプトリストでスキャンし、ボンディングの鍵で暗号化する
+void hub_set_enrolling(bool on);
+// ペアリングボタンが押されたときに呼ぶ。確認を待っている子機のパスキーを確認する
+void hub_confirm_all(void);
+// 子機との接続のペアリングの結果 (main.c の bt_conn_auth_info_cb から)
+void hub_pairing_complete(struct bt_conn *conn, bool bonded);
+void hub_pairing_failed(struct bt_conn *conn);
+// 子機からの接続パラメータの更新要求を、ハブの値に置き換えて受け入れる
+bool hub_le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param);
+
+// 自分のキー (own_usage, 0 なら離している) と子機のキーをまとめたレポートを作る
+void hub_build_report(uint8_t report[HUB_REPORT_LEN], uint8_t own_usage);
+void hub_build_boot_report(uint8_t report[HUB_BOOT_REPORT_LEN], uint8_t own_usage);
+bool hub_any_pressed(void);
+
+// EVENT_HUB_REPORT でホストにレポートを送ったあとに呼ぶ (集約の遅延の計測)
+void hub_report_sent(int err);
+
+void hub_get_stats(struct hub_stats *stats);
+void hub_print_stats(void);
+
+#endif /* HUB_H_ */
+
+
+/* End of hub.h */
@@ -0,0 +1,68 @@
+/* This file is hub_link.c, key event link from a one-key unit to a hub (vendor GATT) */
+
+#include "includes.h"
+#include "hub_link.h"
+#include "press_time.h"
+
+static struct bt_uuid_128 hub_svc_uuid = BT_UUID_INIT_128(HUB_UUID_SVC_VAL);
+static struct bt_uuid_128 hub_key_uuid = BT_UUID_INIT_128(HUB_UUID_KEY_VAL);
+
+static struct hub_key_event current;   // メインループからのみ更新される
+static volatile bool subscribed;        // どれかの接続が購読している (CCC の書き込みで更新される)
+
+static ssize_t read_key(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                        void *buf, uint16_t len, uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &current, sizeof(current));
+}
+
+static void key_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscribed = (value == BT_GATT_CCC_NOTIFY);
+}
+
+// HID と同じく、暗号化された接続からのみ購読できる
+BT_GATT_SERVICE_DEFINE(hub_link_svc,
+    BT_GATT_PRIMARY_SERVICE(&hub_svc_uuid.uuid),
+    BT_GATT_CHARACTERISTIC(&hub_key_uuid.uuid, BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ_ENCRYPT, read_key, NULL, NULL),
+    BT_GATT_CCC(key_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+);
+
+// 購読している接続 (ハブ) ごとに、その接続のアンカーに対応づけて通知する
+static void notify_hub(struct bt_conn *conn, void *data)
+{
+    const uint32_t *edge_cycles = data;
+    struct hub_key_event ev = current;
+
+    if (!bt_gatt_is_subscribed(conn, &hub_link_svc.attrs[1], BT_GATT_CCC_NOTIFY)) return;
+
+    if (press_time_map(conn, *edge_cycles, &ev.event_counter, &ev.offset_us)) {
+        ev.flags = PRESS_TIME_FLAG_ANCHOR;
+    }
+    int err = bt_gatt_notify(conn, &hub_link_svc.attrs[1], &ev, sizeof(ev));
+    if (err && err != -ENOTCONN) {
+        printk("hub link notify failed: %d\n", err);
+    }
+}
+
+void hub_link_send(uint8_t usage, uint32_t edge_cycles)
+{
+    uint32_t now_us = k_ticks_to_us_floor32((uint32_t)k_uptime_ticks());
+
+    current.seq++;
+    current.usage = usage;
+    current.edge_us = now_us - k_cyc_to_us_floor32(k_cycle_get_32() - edge_cycles);
+
+    if (!subscribed) return;
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, notify_hub, &edge_cycles);
+}
+
+bool hub_link_is_hub(struct bt_conn *conn)
+{
+    return subscribed && bt_gatt_is_subscribed(conn, &hub_link_svc.attrs[1], BT_GATT_CCC_NOTIFY);
+}
+
+
+/* End of hub_link.c */
@@ -0,0 +1,37 @@
+/* This file is hub_link.h, key event link from a one-key unit to a hub (vendor GATT) */
+
+#ifndef HUB_LINK_H_
+#define HUB_LINK_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// ハブとの間のベンダー UUID のベース (最後のフィールドで区別する)
+#define HUB_UUID_ENCODE(n) BT_UUID_128_ENCODE(0x0ce20000 + (n), 0x1145, 0x4419, 0x8a5e, 0x536d616c6c4b)
+#define HUB_UUID_SVC_VAL HUB_UUID_ENCODE(0)
+#define HUB_UUID_KEY_VAL HUB_UUID_ENCODE(1)
+
+// 子機からハブに通知するキーの状態
+struct hub_key_event {
+    uint8_t seq;                // 通知ごとに 1 ずつ増える (ハブで取りこぼしを数える)
+    uint8_t usage;              // 押しているキーコード。0 なら離している
+    uint32_t edge_us;           // このキー入力のエッジの時刻 (起動からの us)。
+                                // BabbleSim では全デバイスで同じ時間軸になり、集約の遅延を測れる
+    uint8_t flags;              // PRESS_TIME_FLAG_ANCHOR なら以下が有効 (press_time.h)
+    uint16_t event_counter;     // エッジの時刻を、この接続の接続イベントのアンカーからの時間で表したもの
+    int32_t offset_us;
+} __packed;
+
+// キーコードを押下/解放したときにメインループから呼ぶ。購読しているハブがあれば、それぞれの接続の
+// アンカーに対応づけて通知する。
+// edge_cycles は元になったキー入力のエッジのサイクルカウンタ値
+void hub_link_send(uint8_t usage, uint32_t edge_cycles);
+
+// この接続の相手がハブか (キーの通知を購読しているか)。ハブには HID のレポートを送らない
+bool hub_link_is_hub(struct bt_conn *conn);
+
+#endif /* HUB_LINK_H_ */
+
+
+/* End of hub_link.h */
@@ -3,22 +3,27 @@
 #include "includes.h"
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
+#include <zephyr/input/input.h>
+#include <zephyr/pm/device.h>
 #include "led_buttons.h"
+#include "stress_test.h"
+#include "dev_pm.h"
 
 /* デバイスツリーからノードを取得 */
-#define PAIRING_BUTTON_PIN DT_GPIO_PIN(DT_NODELABEL(pairing_button), gpios)
 #define LED_PIN DT_GPIO_PIN(DT_NODELABEL(led0), gpios)
 
 /* GPIOデバイス */
 const struct device *gpio_dev;
 
-/* ペアリングボタンのコールバック */
-static struct gpio_callback pairing_cb;
-/* キーのコールバック */
-static struct gpio_callback key_press_cb;
+/* キーとペアリングボタンは gpio-keys ドライバ (入力サブシステム) が扱う。
+   割り込み・デバウンスはドライバが行い、確定した押下/解放が入力イベントとして届く */
+#define KEY_BUTTON_NODE DT_NODELABEL(key_button)
+#define PAIRING_BUTTON_NODE DT_NODELABEL(pairing_button)
+#define KEY_BUTTON_CODE DT_PROP(KEY_BUTTON_NODE, zephyr_code)
+#define PAIRING_BUTTON_CODE DT_PROP(PAIRING_BUTTON_NODE, zephyr_code)
+#define KEY_DEBOUNCE_MS DT_PROP(DT_PARENT(KEY_BUTTON_NODE), debounce_interval_ms)
 
-/* Key Button のピン番号 */
-#define KEY_BUTTON_PIN DT_GPIO_PIN(DT_NODELABEL(key_button), gpios)
+static const struct gpio_dt_spec key_button = GPIO_DT_SPEC_GET(KEY_BUTTON_NODE, gpios);
 
 /* DIPSWのノード */
 #define DIPSW_NODE DT_PATH(zephyr_user)
@@ -26,6 +31,9 @@ static struct gpio_callback key_press_cb;
 /* 配列長 */
 #define DIPSW_LEN DT_PROP_LEN(DIPSW_NODE, dipsw_gpios)
 
+/* プルダウンを有効にしてから読むまで待つ時間 (us) */
+#define DIPSW_SETTLE_US 10
+
 /* マクロで静的配列の各要素を展開 */
 #define GPIO_PIN_INIT(node_id, prop, idx)                                              \
     { .port = DEVICE_DT_GET(DT_GPIO_CTLR_BY_IDX(node_id, prop, idx)),                  \
@@ -36,96 +44,141 @@ struct gpio_dt_spec dipsw_gpios[DIPSW_LEN] = {
     DT_FOREACH_PROP_ELEM(DT_PATH(zephyr_user), dipsw_gpios, GPIO_PIN_INIT)
 };
 
-/* 必要な変数や定数 */
-// ポーリング用のタイマーを宣言
-static void key_polling_timer_callback(struct k_timer *key_timer_id);
-K_TIMER_DEFINE(key_timer, key_polling_timer_callback, NULL);
-
-static void pairing_btn_polling_timer_callback(struct k_timer *pairing_btn_timer_id);
-K_TIMER_DEFINE(pairing_btn_timer, pairing_btn_polling_timer_callback, NULL);
-
-static bool is_pairing_button_checking = false; // ペアリングボタンのチャタリングチェック中かどうか
-static bool is_key_timer_running = false; // ポーリング用タイマーが動作しているかどうか
-static volatile bool key_pressed = false;
-static uint8_t key_history = 0x00;
-
 /* コールバック関数ポインタ */
-void (*key_event_cb)(int) = NULL;
-void (*pairing_button_cb)(void) = NULL;
+static void (*key_event_cb)(int) = NULL;
+static void (*pairing_button_cb)(void) = NULL;
+
+static volatile uint32_t key_edge_cycles; // キー入力が確定した元のエッジの時刻
+
+/* キーのピンのエッジは gpio-keys とは別の GPIO コールバックでも受け取り、割り込みの時点で時刻を記録する。
+   チャタリングで続くエッジのうち、直前のエッジから KEY_DEBOUNCE_MS 以上空いた最初のものを押下/解放の時刻とする */
+static struct gpio_callback key_edge_cb;
+static struct k_spinlock edge_lock;
+static uint32_t key_last_edge;          // 最後のエッジの時刻
+static uint32_t key_first_edge;         // 今のチャタリングの最初のエッジの時刻
+static bool key_first_valid;            // key_first_edge をまだ入力イベントで使っていない
+
+// 入力イベントの統計
+static uint32_t stat_input_events;
+static uint32_t stat_key_events;
+static uint32_t stat_edge_irqs;
+static uint32_t stat_edge_estimated;    // エッジを捕まえられず、報告の時刻から推定した回数
+static uint32_t stat_pairing_presses;
+static uint32_t stat_callback_max_us;
+// エッジから入力イベントが届くまで (ドライバのデバウンスと入力スレッドの待ちを含む)。
+// 推定したエッジは含めない
+static uint32_t stat_edge_latency_count;
+static uint32_t stat_edge_latency_max_us;
+static uint64_t stat_edge_latency_sum_us;
+static uint8_t stat_wakeup_sources;     // 起床の要因にできた gpio-keys の数
+
+static void key_edge_isr(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
+{
+    uint32_t now = k_cycle_get_32();
 
-#define KEY_POLLING_INTERVAL_MS 10
-#define PAIRING_BTN_POLLING_INTERVAL_MS 30
+    k_spinlock_key_t key = k_spin_lock(&edge_lock);
+    if (!key_first_valid || now - key_last_edge >= k_ms_to_cyc_ceil32(KEY_DEBOUNCE_MS)) {
+        key_first_edge = now;
+        key_first_valid = true;
+    }
+    key_last_edge = now;
+    stat_edge_irqs++;
+    k_spin_unlock(&edge_lock, key);
+}
 
-/* キータイマーコールバック関数 */
-static void key_polling_timer_callback(struct k_timer *timer_id)
+// 確定したキー入力の元のエッジの時刻を取り出す (report_cycles はドライバが報告した時刻)
+static uint32_t take_key_edge(uint32_t report_cycles)
 {
-    // Key history をシフト
-    key_history <<= 1;
+    bool valid;
+    uint32_t edge;
+
+    k_spinlock_key_t key = k_spin_lock(&edge_lock);
+    valid = key_first_valid;
+    edge = key_first_edge;
+    key_first_valid = false;
+    k_spin_unlock(&edge_lock, key);
+
+    if (valid) {
+        uint32_t us = k_cyc_to_us_floor32(report_cycles - edge);
+        stat_edge_latency_count++;
+        stat_edge_latency_sum_us += us;
+        if (us > stat_edge_latency_max_us) stat_edge_latency_max_us = us;
+        return edge;
+    }
 
-    // GPIO ピンの状態を読み取る
-    if (gpio_pin_get(gpio_dev, KEY_BUTTON_PIN)) {
-        key_history |= 0x01;
+    // エッジの割り込みがない (コールバックを登録できなかった) ときは、ドライバはエッジの後
+    // KEY_DEBOUNCE_MS だけ安定したところで報告するので、その分さかのぼった時刻とする
+    stat_edge_estimated++;
+    return report_cycles - k_ms_to_cyc_ceil32(KEY_DEBOUNCE_MS);
+}
+
+/* 入力イベントのコールバック (入力サブシステムのスレッドで呼ばれる)。
+   同期フラグ (sync) が立つまでのイベントを一つの入力としてまとめて処理する */
+static void input_cb(struct input_event *evt, void *user_data)
+{
+    static int key_value = -1;      // この同期単位でのキーの値 (-1: 変化なし)
+    static bool pairing_pressed;    // この同期単位でペアリングボタンが押されたか
+    uint32_t start = k_cycle_get_32();
+
+    stat_input_events++;
+    if (evt->type == INPUT_EV_KEY) {
+        if (evt->code == KEY_BUTTON_CODE) {
+            key_value = evt->value;
+        } else if (evt->code == PAIRING_BUTTON_CODE && evt->value) {
+            pairing_pressed = true;
+        }
     }
 
-    // キー押下判定
-    if (!key_pressed && (key_history & 0x07) == 0x07) {
-        key_pressed = true;
+    if (!evt->sync) return;
+
+    if (key_value >= 0) {
+        key_edge_cycles = take_key_edge(start);
+        stat_key_events++;
         if (key_event_cb) {
-            key_event_cb(1); // キーが押されたことを示す
+            key_event_cb(key_value);
         }
-        k_timer_stop(&key_timer);
-        is_key_timer_running = false;
+        key_value = -1;
     }
-    // キー解放判定
-    else if (key_pressed && (key_history & 0x07) == 0x00) {
-        key_pressed = false;
-        if (key_event_cb) {
-            key_event_cb(0); // キーが離されたことを示す
+    if (pairing_pressed) {
+        stat_pairing_presses++;
+        if (pairing_button_cb) {
+            pairing_button_cb();
         }
-        k_timer_stop(&key_timer);
-        is_key_timer_running = false;
+        pairing_pressed = false;
     }
 
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    if (us > stat_callback_max_us) stat_callback_max_us = us;
 }
+INPUT_CALLBACK_DEFINE(NULL, input_cb, NULL);
 
-/* 割り込みハンドラー */
-void key_interrupt_handler(const struct device *port, struct gpio_callback *cb,
-                           uint32_t pins)
+// 最後に確定したキー入力の、元のエッジの時刻 (サイクルカウンタ値)
+uint32_t get_key_edge_cycles(void)
 {
-    // タイマーが動作していない場合は開始
-    if (!is_key_timer_running) {
-        is_key_timer_running = true;
-         k_timer_start(&key_timer, K_MSEC(KEY_POLLING_INTERVAL_MS), K_MSEC(KEY_POLLING_INTERVAL_MS));
-   }
+    return key_edge_cycles;
 }
 
 /* コールバック登録関数 */
 void register_key_press_cb(void (*cb)(int))
 {
-    int ret;
-
     key_event_cb = cb;
+}
 
-    if (!device_is_ready(gpio_dev)) {
-        printk("GPIO device not ready\n");
-        return;
-    }
+void register_pairing_button_cb(void (*cb)(void))
+{
+    pairing_button_cb = cb;
+}
 
-    gpio_pin_configure(gpio_dev, KEY_BUTTON_PIN, GPIO_ACTIVE_LOW | GPIO_INPUT | GPIO_PULL_UP);
-    
-    // 両方のエッジで割り込みを設定
-    ret = gpio_pin_interrupt_configure(gpio_dev, KEY_BUTTON_PIN, GPIO_INT_EDGE_BOTH);
-    if (ret != 0) {
-        printk("Error configuring interrupt on pin %d: %d\n", KEY_BUTTON_PIN, ret);
-        return;
-    }
-    gpio_init_callback(&key_press_cb, key_interrupt_handler, BIT(KEY_BUTTON_PIN));
-    ret = gpio_add_callback(gpio_dev, &key_press_cb);
-    if (ret != 0) {
-        printk("Failed to add callback for key button: %d\n", ret);
-    } else {
-        printk("Callback added successfully for key button\n");
-    }
+void input_print_stats(void)
+{
+    printk("input: %u events, %u key, %u pairing button, callback max %u us, "
+           "%u edge irqs, %u edges estimated, %u wakeup sources\n",
+        stat_input_events, stat_key_events, stat_pairing_presses, stat_callback_max_us,
+        stat_edge_irqs, stat_edge_estimated, stat_wakeup_sources);
+    printk("input: edge to event %u samples, avg %u us max %u us (debounce %u ms)\n",
+        stat_edge_latency_count,
+        stat_edge_latency_count ? (uint32_t)(stat_edge_latency_sum_us / stat_edge_latency_count) : 0,
+        stat_edge_latency_max_us, KEY_DEBOUNCE_MS);
 }
 
 
@@ -139,14 +192,46 @@ static int dipsw_init(void)
         // (1) プルダウン有効の入力ピンに設定
         gpio_pin_configure_dt(&dipsw_gpios[i], GPIO_INPUT | GPIO_PULL_DOWN);
     }
+    k_busy_wait(DIPSW_SETTLE_US);
     return 0;
 }
 
+// DIPSW のピンのあるポートのグループを、読んでいる間だけ使う
+static void dipsw_pm(bool get)
+{
+    static const struct {
+        enum dev_pm_id id;
+        const struct device *port;
+    } groups[] = {
+        { DEV_PM_DIPSW, DEVICE_DT_GET(DT_NODELABEL(gpio0)) },
+#if DEV_PM_HAS_GPIO1
+        { DEV_PM_DIPSW1, DEVICE_DT_GET(DT_NODELABEL(gpio1)) },
+#endif
+    };
+
+    for (size_t g = 0; g < ARRAY_SIZE(groups); g++) {
+        for (int i = 0; i < DIPSW_LEN; ++i) {
+            if (dipsw_gpios[i].port != groups[g].port) continue;
+            if (get) {
+                dev_pm_get(groups[g].id);
+            } else {
+                dev_pm_put(groups[g].id);
+            }
+            break;
+        }
+    }
+}
+
 uint8_t get_dipsw(void)
 {
     uint8_t value = 0;
 
-    if(dipsw_init() != 0) return 0;
+    // 読んでいる間だけピンを接続する
+    dipsw_pm(true);
+    if(dipsw_init() != 0) {
+        dipsw_pm(false);
+        return 0;
+    }
 
     for (int i = 0; i < DIPSW_LEN; ++i) {
         // 各GPIOピンからビットを読み取る
@@ -159,76 +244,77 @@ uint8_t get_dipsw(void)
 
         // 読み取った値を結果にマージ
         value |= (pin_val << i);
+    }
 
-        // (3) プルアップ有効の入力ピンに再設定
-        gpio_pin_configure_dt(&dipsw_gpios[i], GPIO_INPUT | GPIO_PULL_UP);
+    // (3) 読み終わったらピンを切り離す。プルアップ/プルダウンをつないだままにすると、
+    // スイッチの向きによってはプル抵抗に電流が流れ続ける
+    for (int i = 0; i < DIPSW_LEN; ++i) {
+        gpio_pin_configure_dt(&dipsw_gpios[i], GPIO_DISCONNECTED);
     }
+    dipsw_pm(false);
 
     return value;
 }
 
+/* LED は点灯している間だけピンを出力にし、消灯したら切り離す (点滅のタイマー ISR からも呼ばれる)。
+   スレッドと ISR の呼び出しが入れ替わらないよう、参照とピンの設定もロックの中で行う
+   (LED のグループは参照を持ち続ける gpio0 の上にあり、ピンの設定も待たないので ISR でもよい) */
+static struct k_spinlock led_lock;
+static bool led_active;
+
 void set_led(int on_or_off)
 {
     if (!device_is_ready(gpio_dev)) {
         printk("GPIO device not ready\n");
         return;
     }
-    gpio_pin_set(gpio_dev, LED_PIN, on_or_off);
-}
 
-// ペアリングボタンのタイマーハンドラー
-static void pairing_btn_polling_timer_callback(struct k_timer *pairing_btn_timer_id)
-{
-    if(is_pairing_button_checking && gpio_pin_get(gpio_dev, PAIRING_BUTTON_PIN))
-    {
-        // 押下でタイマーが開始され、一定時間後の再チェックでもボタンが押されていた
-        // →ボタンが確実に押されていたと判断する
-        pairing_button_cb();
+    k_spinlock_key_t key = k_spin_lock(&led_lock);
+    if (on_or_off && !led_active) {
+        if (dev_pm_get(DEV_PM_LED) == 0) {
+            gpio_pin_configure(gpio_dev, LED_PIN, GPIO_ACTIVE_HIGH | GPIO_OUTPUT_ACTIVE);
+            led_active = true;
+        }
+    } else if (!on_or_off && led_active) {
+        gpio_pin_configure(gpio_dev, LED_PIN, GPIO_DISCONNECTED);
+        dev_pm_put(DEV_PM_LED);
+        led_active = false;
     }
-    is_pairing_button_checking = false;
+    k_spin_unlock(&led_lock, key);
 }
 
-static void pairing_button_intr_cb()
+// キー押下状態取得関数
+int get_key_pressed(void)
 {
-    // タイマーを起動
-    if(!is_pairing_button_checking)
-    {
-        k_timer_start(&pairing_btn_timer, K_MSEC(PAIRING_BTN_POLLING_INTERVAL_MS), K_NO_WAIT);
-        is_pairing_button_checking = true;
-    }
+    return gpio_pin_get_dt(&key_button) > 0;
 }
 
-
-void register_pairing_button_cb(void (*cb)(void))
+#if USE_STRESS_TEST
+// キーのピンが level に変化したことを模擬する。
+// gpio-keys ドライバと同じく入力イベントとして投入する (ISR から呼ばれるので待たない)
+void stress_key_edge(int level)
 {
-    int ret;
-
-    if (!device_is_ready(gpio_dev)) {
-        printk("GPIO device not ready\n");
-        return;
-    }
-
-    gpio_pin_configure(gpio_dev, PAIRING_BUTTON_PIN, GPIO_ACTIVE_LOW | GPIO_INPUT | GPIO_PULL_UP);
-    ret = gpio_pin_interrupt_configure(gpio_dev, PAIRING_BUTTON_PIN, GPIO_INT_EDGE_TO_ACTIVE);
-    if (ret != 0) {
-        printk("Error configuring interrupt on pin %d: %d\n", PAIRING_BUTTON_PIN, ret);
-        return;
-    }
-    gpio_init_callback(&pairing_cb, (gpio_callback_handler_t)pairing_button_intr_cb, BIT(PAIRING_BUTTON_PIN));
-    ret = gpio_add_callback(gpio_dev, &pairing_cb);
-    if (ret != 0) {
-        printk("Failed to add callback for pairing button: %d\n", ret);
-    } else {
-        printk("Callback added successfully for pairing button\n");
-    }
+    key_edge_isr(NULL, NULL, BIT(key_button.pin));
+    input_report_key(DEVICE_DT_GET(DT_PARENT(KEY_BUTTON_NODE)), KEY_BUTTON_CODE, level, true, K_NO_WAIT);
+}
 
-    pairing_button_cb = cb;
+// ペアリングボタンのピンが level に変化したことを模擬する
+void stress_pairing_button_edge(int level)
+{
+    input_report_key(DEVICE_DT_GET(DT_PARENT(PAIRING_BUTTON_NODE)), PAIRING_BUTTON_CODE, level, true, K_NO_WAIT);
 }
+#endif
 
-// キー押下状態取得関数
-int get_key_pressed(void)
+// gpio-keys を起床の要因にする (デバイスツリーの wakeup-source)。
+// 停止したときのピンの設定 (SENSE による検出) は gpio-keys ドライバの PM に任せる
+static void enable_wakeup(const struct device *keys)
 {
-    return !gpio_pin_get(gpio_dev, KEY_BUTTON_PIN);
+    if (!pm_device_wakeup_is_capable(keys)) return;
+    if (pm_device_wakeup_enable(keys, true)) {
+        stat_wakeup_sources++;
+    } else {
+        printk("pm_device_wakeup_enable(%s) failed\n", keys->name);
+    }
 }
 
 // GPIOデバイスの初期化関数
@@ -239,7 +325,29 @@ void init_gpio_dev()
         printk("GPIO device not ready\n");
         return;
     }
-    gpio_pin_configure(gpio_dev, LED_PIN, GPIO_ACTIVE_HIGH | GPIO_OUTPUT);
+    // 使っていない周辺機器は停止しておく。キーとペアリングボタンはいつでも押されるので、
+    // gpio-keys (と GPIO ポート) は参照を持ち続ける (実行時 PM では、参照がないと gpio-keys が停止する)
+#if DEV_PM_HAS_GPIO1
+    const struct device *gpio1_dev = DEVICE_DT_GET(DT_NODELABEL(gpio1));
+#else
+    const struct device *gpio1_dev = NULL;
+#endif
+    dev_pm_init(gpio_dev, gpio1_dev, DEVICE_DT_GET(DT_PARENT(KEY_BUTTON_NODE)),
+                DEVICE_DT_GET(DT_PARENT(PAIRING_BUTTON_NODE)));
+    dev_pm_get(DEV_PM_KEY);
+    dev_pm_get(DEV_PM_PAIRING_BUTTON);
+    enable_wakeup(DEVICE_DT_GET(DT_PARENT(KEY_BUTTON_NODE)));
+    enable_wakeup(DEVICE_DT_GET(DT_PARENT(PAIRING_BUTTON_NODE)));
+
+    // LED は点灯するまで切り離しておく (set_led())
+    gpio_pin_configure(gpio_dev, LED_PIN, GPIO_DISCONNECTED);
+
+    // キーのピンの割り込みは gpio-keys が設定済み。同じポートにコールバックを追加する
+    gpio_init_callback(&key_edge_cb, key_edge_isr, BIT(key_button.pin));
+    int err = gpio_add_callback(key_button.port, &key_edge_cb);
+    if (err) {
+        printk("gpio_add_callback() failed (err %d)\n", err);
+    }
 }
 
 
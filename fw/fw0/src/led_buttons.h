@@ -13,6 +13,8 @@ void init_gpio_dev();
 // キー押下検知のコールバック登録関数を追加
 void register_key_press_cb(void (*cb)(int));
 int get_key_pressed(void);
+uint32_t get_key_edge_cycles(void);
+void input_print_stats(void);
 
 #endif /* LED_BUTTONS_H_ */
 
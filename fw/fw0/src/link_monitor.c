@@ -0,0 +1,384 @@
+/* This file is link_monitor.c, connection health monitor and key press replay buffer */
+
+#include "includes.h"
+#include <string.h>
+#include "hci_util.h"
+#include "deadline.h"
+#include "tx_power.h"
+#include "phy_policy.h"
+#include "notify_track.h"
+#include "link_monitor.h"
+
+// 接続ごとの状態 (bt_conn_index() で引く)
+static struct link_conn {
+    struct bt_conn *conn;
+    int16_t rssi;               // 平滑化した RSSI (dBm)
+    bool rssi_valid;
+    bool closing;               // リンク断と判断して切断を要求した
+    uint8_t fails;              // 続けて送信に失敗した数
+    bool replaying;             // 再送の途中 (送信完了待ちがなくなったら続きを送る)
+    uint8_t peeked;             // link_monitor_peek_replay() で見た数
+    uint8_t peeked_idx[LINK_REPLAY_MAX];    // 見たキー入力の taps のインデックス
+    uint8_t host;               // hosts のインデックス
+    uint32_t interval_us;       // 接続間隔
+    uint32_t missed;            // 評価間隔中に取りこぼした接続イベント (推定値)
+} lc[CONFIG_BT_MAX_CONN];
+
+// 再送先のホスト。キー入力はホストごとに届いたかどうかを持つ
+static struct link_host {
+    bt_addr_le_t addr;
+    bool valid;
+    bool lost;                  // 接続が切れて再接続を待っている
+} hosts[LINK_HOST_MAX];
+static uint8_t host_next;       // 次に上書きする hosts のインデックス
+
+BUILD_ASSERT(LINK_HOST_MAX <= 32, "pending is a bit mask of hosts");
+
+// 再送用に保持するキー入力
+static struct link_tap {
+    uint8_t usage;
+    uint32_t pending;           // 届いていないホスト (hosts のインデックスのビット)。0 なら空き
+    uint32_t press_ms;
+    uint32_t release_ms;
+} taps[LINK_REPLAY_MAX];
+static uint8_t tap_next;
+
+static struct link_stats stats;
+static bool active = true;      // 評価する (fast の接続パラメータで送信している)
+
+// 送信完了コールバックは BT のスレッドから、評価はシステムワークキューから、
+// キー入力の記録はメインループから呼ばれるのでミューテックスで保護する
+static K_MUTEX_DEFINE(lm_mutex);
+
+static const char *const loss_names[LINK_LOSS_REASON_COUNT] = {
+    [LINK_LOSS_FAILS] = "send failures",
+    [LINK_LOSS_STALL] = "notification stall",
+    [LINK_LOSS_WEAK] = "weak signal",
+    [LINK_LOSS_TIMEOUT] = "supervision timeout",
+};
+
+static void link_monitor_work_handler(struct k_work *work);
+static K_WORK_DEFINE(link_monitor_work, link_monitor_work_handler);
+
+// 評価の周期。他のタイムアウトと一度の起床にまとめられるよう許容遅延を持たせる
+static void link_monitor_timer_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(link_monitor_timer, link_monitor_timer_handler, LINK_MONITOR_SLACK_MS);
+
+static void link_monitor_timer_handler(struct deadline *dummy)
+{
+    // タイマー ISR から呼ばれるので、HCI コマンドの完了を待つ評価はワークキューで行う
+    k_work_submit(&link_monitor_work);
+}
+
+// 評価するときに接続があればタイマーを動かし、なければ止める (lm_mutex 取得済みで呼ぶこと)
+static void update_timer(void)
+{
+    bool any = false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(lc); i++) {
+        if (lc[i].conn) any = true;
+    }
+    if (!active || !any) {
+        deadline_stop(&link_monitor_timer);
+    } else if (!deadline_is_active(&link_monitor_timer)) {
+        deadline_start(&link_monitor_timer, K_MSEC(LINK_MONITOR_INTERVAL_MS),
+                       K_MSEC(LINK_MONITOR_INTERVAL_MS));
+    }
+}
+
+// since 以降に解放を送ったキー入力は、そのホストに届いていない可能性があるので再送の対象にする
+// (lm_mutex 取得済みで呼ぶこと)
+static void mark_pending_since(uint8_t host, uint32_t since)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(taps); i++) {
+        if (taps[i].release_ms && !(taps[i].pending & BIT(host)) &&
+            (int32_t)(taps[i].release_ms - since) >= 0) {
+            taps[i].pending |= BIT(host);
+            stats.taps_buffered++;
+        }
+    }
+}
+
+// 接続先のホストの hosts のインデックスを返す。初めてのホストにはいちばん古いエントリを使う
+// (lm_mutex 取得済みで呼ぶこと)
+static uint8_t host_index(const bt_addr_le_t *addr)
+{
+    for (uint8_t i = 0; i < ARRAY_SIZE(hosts); i++) {
+        if (hosts[i].valid && bt_addr_le_eq(&hosts[i].addr, addr)) return i;
+    }
+
+    uint8_t i = host_next;
+    host_next = (host_next + 1) % ARRAY_SIZE(hosts);
+    // 前のホストのための再送は捨てる
+    for (size_t k = 0; k < ARRAY_SIZE(taps); k++) {
+        if (taps[k].pending & BIT(i)) {
+            taps[k].pending &= ~BIT(i);
+            stats.taps_expired++;
+        }
+    }
+    bt_addr_le_copy(&hosts[i].addr, addr);
+    hosts[i].valid = true;
+    hosts[i].lost = false;
+    return i;
+}
+
+// 完了していないレポートがあれば、それ以降のキー入力はこのホストに届いていない
+// (lm_mutex 取得済みで呼ぶこと)
+static void mark_pending_inflight(const struct link_conn *l)
+{
+    struct notify_track oldest;
+
+    if (notify_track_peek(l->conn, &oldest)) {
+        mark_pending_since(l->host, oldest.sent_ms);
+    }
+}
+
+// リンク断かどうかを判断する。リンク断でなければ -1 を返す (lm_mutex 取得済みで呼ぶこと)
+static int check_link(const struct link_conn *l, uint32_t now)
+{
+    struct notify_track oldest;
+
+    if (l->fails >= LINK_FAIL_LIMIT) {
+        return LINK_LOSS_FAILS;
+    }
+    if (notify_track_peek(l->conn, &oldest) && now - oldest.sent_ms >= LINK_STALL_MS) {
+        return LINK_LOSS_STALL;
+    }
+    if (l->rssi_valid && l->rssi < LINK_RSSI_WEAK && l->missed >= LINK_MISSED_LIMIT) {
+        return LINK_LOSS_WEAK;
+    }
+    return -1;
+}
+
+static void link_monitor_work_handler(struct k_work *work)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(lc); i++) {
+        struct bt_conn *conn = NULL;
+
+        k_mutex_lock(&lm_mutex, K_FOREVER);
+        if (lc[i].conn && !lc[i].closing) {
+            conn = bt_conn_ref(lc[i].conn);
+        }
+        k_mutex_unlock(&lm_mutex);
+
+        if (!conn) continue;
+
+        // HCI コマンドの完了を待つので、ロックの外で読む。
+        // RSSI を読むのはここだけで、PHY の方針にも同じ値を渡す
+        int8_t rssi = 127;  // 127 は読めなかったときの値
+        int err = read_conn_rssi(conn, &rssi);
+        phy_policy_tick(conn, rssi, !err && rssi != 127);
+        struct bt_conn_info info;
+        uint32_t interval_us = 0;
+        if (bt_conn_get_info(conn, &info) == 0) {
+            interval_us = info.le.interval * 1250U;
+        }
+
+        int loss = -1;
+        struct link_conn snap = { 0 };
+        k_mutex_lock(&lm_mutex, K_FOREVER);
+        struct link_conn *l = &lc[i];
+        if (l->conn == conn) {
+            if (!err && rssi != 127) {
+                l->rssi = l->rssi_valid ? (l->rssi * 3 + rssi) / 4 : rssi;
+                l->rssi_valid = true;
+            }
+            if (interval_us) l->interval_us = interval_us;
+
+            loss = check_link(l, k_uptime_get_32());
+            if (loss >= 0) {
+                l->closing = true;
+                stats.losses[loss]++;
+                mark_pending_inflight(l);
+            }
+            snap = *l;
+            l->missed = 0;
+        }
+        k_mutex_unlock(&lm_mutex);
+
+        if (loss >= 0) {
+            // スーパービジョンタイムアウトを待たずに切断し、すぐ再接続のアドバタイズに移る
+            printk("Link loss suspected on conn %d: %s (rssi %d)\n", (int)i, loss_names[loss], snap.rssi);
+            bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        } else if (snap.conn) {
+            // 同じ評価結果で送信電力を調整する
+            tx_power_update(conn, (int8_t)snap.rssi, snap.rssi_valid, snap.missed, snap.fails,
+                            snap.interval_us);
+        }
+        bt_conn_unref(conn);
+    }
+}
+
+void link_monitor_connected(struct bt_conn *conn)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    memset(l, 0, sizeof(*l));
+    l->conn = bt_conn_ref(conn);
+    l->host = host_index(bt_conn_get_dst(conn));
+    hosts[l->host].lost = false;
+    // 接続は fast の接続パラメータで始まる
+    active = true;
+    update_timer();
+    k_mutex_unlock(&lm_mutex);
+}
+
+void link_monitor_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    if (l->conn == conn) {
+        if (reason == BT_HCI_ERR_CONN_TIMEOUT) {
+            stats.losses[LINK_LOSS_TIMEOUT]++;
+        }
+        mark_pending_inflight(l);
+        hosts[l->host].lost = true;
+        bt_conn_unref(l->conn);
+        l->conn = NULL;
+        update_timer();
+    }
+    k_mutex_unlock(&lm_mutex);
+}
+
+void link_monitor_set_active(bool on)
+{
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    active = on;
+    update_timer();
+    k_mutex_unlock(&lm_mutex);
+}
+
+void link_monitor_report_sent(struct bt_conn *conn, int err, bool replay)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    // 再送は送れなければやめるだけなので、リンク断の判断には数えない
+    if (l->conn == conn && err && !replay && l->fails < UINT8_MAX) {
+        l->fails++;
+    }
+    k_mutex_unlock(&lm_mutex);
+}
+
+bool link_monitor_report_done(struct bt_conn *conn, const struct notify_track *n)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+    bool next = false;
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    if (l->conn == conn) {
+        // データがあれば次の接続イベントで送れるはずなので、それより遅れた分を取りこぼしとみなす
+        uint32_t us = (k_uptime_get_32() - n->sent_ms) * 1000U;
+        if (l->interval_us && us > l->interval_us) {
+            uint32_t missed = us / l->interval_us - 1;
+            l->missed += missed;
+            stats.missed_events += missed;
+        }
+        l->fails = 0;
+        next = l->replaying && notify_track_count(conn) == 0;
+    }
+    k_mutex_unlock(&lm_mutex);
+    return next;
+}
+
+void link_monitor_tap(uint8_t usage, uint32_t press_ms, bool delivered)
+{
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    struct link_tap *t = &taps[tap_next];
+    tap_next = (tap_next + 1) % ARRAY_SIZE(taps);
+    // 再送できないまま上書きされる分
+    stats.taps_expired += popcount(t->pending);
+
+    t->usage = usage;
+    t->press_ms = press_ms;
+    t->release_ms = k_uptime_get_32() | 1;  // 0 は空きのエントリ
+    t->pending = 0;
+    if (!delivered) {
+        // どこにも届いていない。切れたまま再接続を待っているホストに送り直す
+        for (uint8_t i = 0; i < ARRAY_SIZE(hosts); i++) {
+            if (hosts[i].valid && hosts[i].lost) t->pending |= BIT(i);
+        }
+        stats.taps_buffered += popcount(t->pending);
+    }
+    k_mutex_unlock(&lm_mutex);
+}
+
+int link_monitor_peek_replay(struct bt_conn *conn, uint8_t *usages, int max)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+    uint32_t now = k_uptime_get_32();
+    int n = 0;
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    if (l->conn != conn) {
+        k_mutex_unlock(&lm_mutex);
+        return 0;
+    }
+    uint32_t bit = BIT(l->host);
+
+    // このホストに届いていないものを古い順に見る (他のホストの分は残す)。
+    // 古すぎるものだけはここで捨てる
+    for (size_t k = 0; k < ARRAY_SIZE(taps) && n < MIN(max, LINK_REPLAY_MAX); k++) {
+        uint8_t idx = (tap_next + k) % ARRAY_SIZE(taps);
+        struct link_tap *t = &taps[idx];
+        if (!(t->pending & bit)) continue;
+
+        if (now - t->press_ms <= LINK_REPLAY_WINDOW_MS) {
+            l->peeked_idx[n] = idx;
+            usages[n++] = t->usage;
+        } else {
+            t->pending &= ~bit;
+            stats.taps_expired++;
+        }
+    }
+    l->peeked = n;
+    l->replaying = (n > 0);
+    k_mutex_unlock(&lm_mutex);
+    return n;
+}
+
+void link_monitor_commit_replay(struct bt_conn *conn, int count)
+{
+    struct link_conn *l = &lc[bt_conn_index(conn)];
+
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    if (l->conn == conn) {
+        uint32_t bit = BIT(l->host);
+
+        for (int k = 0; k < MIN(count, l->peeked); k++) {
+            struct link_tap *t = &taps[l->peeked_idx[k]];
+            if (t->pending & bit) {
+                t->pending &= ~bit;
+                stats.taps_replayed++;
+            }
+        }
+        l->peeked = 0;
+    }
+    k_mutex_unlock(&lm_mutex);
+}
+
+void link_monitor_get_stats(struct link_stats *st)
+{
+    k_mutex_lock(&lm_mutex, K_FOREVER);
+    *st = stats;
+    k_mutex_unlock(&lm_mutex);
+}
+
+void link_monitor_print_stats(void)
+{
+    struct link_stats st;
+
+    link_monitor_get_stats(&st);
+    for (int i = 0; i < LINK_LOSS_REASON_COUNT; i++) {
+        if (st.losses[i]) {
+            printk("link loss by %s: %u\n", loss_names[i], st.losses[i]);
+        }
+    }
+    printk("link: missed conn events %u, taps buffered %u replayed %u expired %u\n",
+        st.missed_events, st.taps_buffered, st.taps_replayed, st.taps_expired);
+}
+
+
+/* End of link_monitor.c */
@@ -0,0 +1,73 @@
+/* This file is link_monitor.h, connection health monitor and key press replay buffer */
+
+#ifndef LINK_MONITOR_H_
+#define LINK_MONITOR_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+#include "notify_track.h"
+
+#define LINK_MONITOR_INTERVAL_MS 1000   // リンク状態を評価する間隔 (fast の接続パラメータの間だけ)
+#define LINK_MONITOR_SLACK_MS 250       // 評価が遅れてよい時間 (他のタイムアウトと起床をまとめる)
+#define LINK_STALL_MS 1500              // 通知がこれ以上完了しなければリンク断とみなす
+#define LINK_FAIL_LIMIT 3               // 通知の送信が続けてこれ以上失敗したらリンク断とみなす
+#define LINK_RSSI_WEAK (-90)            // RSSI (dBm) がこれを下回り、かつ
+#define LINK_MISSED_LIMIT 4             // 評価間隔中に取りこぼした接続イベントがこれ以上ならリンク断とみなす
+
+#define LINK_REPLAY_MAX 8               // 再送のために保持するキー入力の数
+#define LINK_REPLAY_WINDOW_MS 5000      // これより古いキー入力は再接続しても再送しない
+#define LINK_REPLAY_CHUNK 2             // 一度に再送するキー入力の数 (前の分の通知が完了してから次を送る)
+#define LINK_HOST_MAX (CONFIG_BT_MAX_PAIRED + 1)   // 再送先として覚えておくホストの数
+
+// リンク断と判断した理由
+enum link_loss_reason {
+    LINK_LOSS_FAILS,        // 通知の送信失敗が続いた
+    LINK_LOSS_STALL,        // 通知が完了しない
+    LINK_LOSS_WEAK,         // RSSI が低く、接続イベントの取りこぼしが多い
+    LINK_LOSS_TIMEOUT,      // スーパービジョンタイムアウト (コントローラが検出)
+
+    LINK_LOSS_REASON_COUNT
+};
+
+struct link_stats {
+    uint32_t losses[LINK_LOSS_REASON_COUNT];
+    uint32_t missed_events;     // 取りこぼした接続イベントの数 (通知の完了までの時間からの推定値)
+    uint32_t taps_buffered;     // 届かなかったので再送用に保持したキー入力
+    uint32_t taps_replayed;     // 再接続後に再送したキー入力
+    uint32_t taps_expired;      // 古すぎて再送しなかったキー入力
+};
+
+// 接続/切断時に BT のコールバックから呼ぶ
+void link_monitor_connected(struct bt_conn *conn);
+void link_monitor_disconnected(struct bt_conn *conn, uint8_t reason);
+
+// fast の接続パラメータ (またはファームウェア更新) の間だけ RSSI を読んでリンク状態を評価する。
+// slow の間はレポートを送らないので、評価せずにリンクを休ませる (接続すると評価を始める)
+void link_monitor_set_active(bool on);
+
+// レポートの送信を要求したあと (err はその結果)、送信完了コールバックで呼ぶ。
+// replay は再送のレポート (送れなくても、再送をやめるだけでリンク断の判断には数えない)。
+// report_done には完了したレポートの記録を渡し、notify_track_done() で降ろしたあとに呼ぶ。
+// 再送の途中で送信完了待ちがなくなった (続きを送れる) ときに真を返す
+void link_monitor_report_sent(struct bt_conn *conn, int err, bool replay);
+bool link_monitor_report_done(struct bt_conn *conn, const struct notify_track *n);
+
+// キーの押下から解放までが終わったときに、メインループから呼ぶ。
+// delivered が偽 (どのホストにも接続していない) なら、接続が切れたホストへの再送用に保持する。
+// 接続中のホストに届かなかったもの (リンク断の時点で完了していないもの) は、そのホストにだけ再送する
+void link_monitor_tap(uint8_t usage, uint32_t press_ms, bool delivered);
+
+// 再接続した conn のホストに届いていないキー入力を、古い順に最大 max 個見る (取り除かない)。
+// 見た数を返す。0 なら再送は終わり。送れた分だけ link_monitor_commit_replay() で取り除く。
+// どちらもメインループから続けて呼ぶこと
+int link_monitor_peek_replay(struct bt_conn *conn, uint8_t *usages, int max);
+void link_monitor_commit_replay(struct bt_conn *conn, int count);
+
+void link_monitor_get_stats(struct link_stats *stats);
+void link_monitor_print_stats(void);
+
+#endif /* LINK_MONITOR_H_ */
+
+
+/* End of link_monitor.h */
@@ -1,6 +1,38 @@
 /* This file is main.c, main program of 1-key simple BLE keyboard */
 #include "includes.h"
+#include <string.h>
 #include "led_buttons.h"
+#include "events.h"
+#include "stress_test.h"
+#include "adv_sched.h"
+#include "phy_policy.h"
+#include "notify_track.h"
+#include "host_sync.h"
+#include "deadline.h"
+#include "gesture.h"
+#include "dfu.h"
+#include "storage.h"
+#if defined(CONFIG_SETTINGS_NVS)
+#include "storage_wb.h"
+#endif
+#include "metrics.h"
+#include "state_machine.h"
+#include "link_monitor.h"
+#include "tx_power.h"
+#include "gatt_cache.h"
+#include "pair_timing.h"
+#include "ctlr_bench.h"
+#include "hub_link.h"
+#include "press_time.h"
+#if defined(CONFIG_BT_CENTRAL)
+#include "hub.h"
+#endif
+#if defined(CONFIG_USB_DEVICE_HID)
+#include "usb_transport.h"
+#endif
+#if defined(CONFIG_INIT_STACKS)
+#include "stack_usage.h"
+#endif
 
 // 現在のスレッド情報を出力するマクロ
 #ifdef DEBUG_THREAD
@@ -22,73 +54,45 @@
 
 #if USE_ONE_BYTE_REPORT
     #define INPUT_REPORT_MAX_LEN 1
+#elif defined(CONFIG_BT_CENTRAL)
+    #define INPUT_REPORT_MAX_LEN HUB_REPORT_LEN // ハブモードでは子機のキーもまとめた NKRO のレポート
 #else
     #define INPUT_REPORT_MAX_LEN 8
 #endif
 
-#define DEVICE_NAME CONFIG_BT_DEVICE_NAME
-#define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
+#if defined(CONFIG_USB_DEVICE_HID)
+// 有線でも同じレポートを 1 パケットで送る。ハブモードの NKRO のレポートは収まらないので、hub.conf は USB を使わない
+BUILD_ASSERT(INPUT_REPORT_MAX_LEN <= USB_REPORT_MAX_LEN, "input report does not fit CONFIG_HID_INTERRUPT_EP_MPS");
+#endif
 
 #define BASE_USB_HID_SPEC_VERSION 0x0101
 
-#define ADV_LED_BLINK_ON_TIME 20 // in ms // ペアリング待ちのときの LED 点滅時間
-#define ADV_LED_BLINK_OFF_TIME 500 // in ms
-
-#define CONFIRM_LED_BLINK_ON_TIME 20 // in ms // 確認待ちのときの LED 点滅時間
-#define CONFIRM_LED_BLINK_OFF_TIME 200 // in ms
-
-
-
-#define ADV_TIME_UNIT_IN_MS 0.625
-#define ADV_INTERVAL_MIN (int)(200 / ADV_TIME_UNIT_IN_MS)   // 0.2秒
-#define ADV_INTERVAL_MAX (int)(500 / ADV_TIME_UNIT_IN_MS)   // 0.2秒
-
-// ペアリングタイムアウト時間（ミリ秒）
-#define PAIRING_TIMEOUT_MS 30000
-
 // BTアドレス文字列変換マクロ
 #define DEF_BT_ADDR_LE_TO_STR \
   char addr[BT_ADDR_LE_STR_LEN]; \
   bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
-#define KEY_RESEND_INTERVAL 100 // キーコード再送信用インターバル
-#define USE_KEY_RESEND 0 // キーコードを繰り返しホストに送信するかどうか
 
 
 /* HIDS instance. */
 BT_HIDS_DEF(hids_obj, INPUT_REPORT_MAX_LEN);
 
-// イベントキューの定義
-K_MSGQ_DEFINE(event_queue, sizeof(uint8_t), 10, 4);
-
-// LED点滅用タイマーの定義
-static void led_timeout_handler(struct k_timer *dummy);
-K_TIMER_DEFINE(adv_led_timer, led_timeout_handler, NULL);
-
-// ペアリングタイムアウト用タイマーの定義
-static void pairing_timeout_handler(struct k_timer *dummy);
-K_TIMER_DEFINE(pairing_timeout_timer, pairing_timeout_handler, NULL);
+// タイマーはすべて deadline.c のスケジューラで扱う。最後の引数は許容遅延 (ms)
 
 // アイドルモード用タイマーの定義
-static void fast_mode_timeout_handler(struct k_timer *dummy);
-K_TIMER_DEFINE(fast_mode_timeout_timer, fast_mode_timeout_handler, NULL);
-
-#if USE_KEY_RESEND
-// キー状態再送信用タイマー
-static void key_state_resend_timeout_handler(struct k_timer *dummy);
-K_TIMER_DEFINE(key_state_resend_timeout_timer, key_state_resend_timeout_handler, NULL);
-#endif
+static void fast_mode_timeout_handler(struct deadline *dummy);
+DEADLINE_DEFINE(fast_mode_timeout_timer, fast_mode_timeout_handler, 1000);
 
 // 接続パラメータの定義（単位: 1.25ms）
 #define MIN_CONN_INTERVAL_FAST  0x30
 #define MAX_CONN_INTERVAL_FAST  0x60 
 #define SLAVE_LATENCY_FAST      0x0002 // スレーブ遅延（2イベント分）
-#define CONN_SUP_TIMEOUT_FAST   0x07D0 // スーパータイムアウト 2000 * 10ms = 20秒
+#define CONN_SUP_TIMEOUT_FAST   200    // スーパータイムアウト 200 * 10ms = 2秒 (最大間隔 120ms * (1 + 遅延 2) * 2 = 720ms 以上)
 
 #define MIN_CONN_INTERVAL_SLOW  (int)(120 / 1.25)
 #define MAX_CONN_INTERVAL_SLOW  (int)(240 / 1.25)
 #define SLAVE_LATENCY_SLOW      0x0004 // スレーブ遅延（4イベント分）
-#define CONN_SUP_TIMEOUT_SLOW   0x07D0 // スーパータイムアウト 2000 * 10ms = 20秒
+#define CONN_SUP_TIMEOUT_SLOW   600    // スーパータイムアウト 600 * 10ms = 6秒 (最大間隔 240ms * (1 + 遅延 4) * 2 = 2.4秒 以上)
 
 // 接続パラメータの構造体
 static const struct bt_le_conn_param conn_params_fast = {
@@ -105,224 +109,125 @@ static const struct bt_le_conn_param conn_params_slow = {
     .timeout = CONN_SUP_TIMEOUT_SLOW,
 };
 
+// スーパービジョンタイムアウトは、最大間隔 * (1 + スレーブ遅延) の 3 倍より長くする
+// (仕様の下限は 2 倍。ホストの指針 (Apple の Accessory Design Guidelines) に合わせて 3 倍)。
+//   fast: 120ms * 3 * 3 = 1.08秒 < 2秒。スレーブ遅延で寝ていても、起きる機会を 5 回逃すまで切れない
+//   slow: 240ms * 5 * 3 = 3.6秒 < 6秒。同じく 5 回
+// これより短くすると、遅延で寝ている間の数回の取りこぼしで切れる。長くしてもリンク断の検出は
+// link_monitor.c が先に行うが、コントローラが検出するまでの上限 (再接続の遅れ) が延びる
+#define CONN_SUP_TIMEOUT_OK(max, latency, timeout) \
+    ((timeout) * 10U * 4U > (max) * 5U * ((latency) + 1U) * 3U)
+BUILD_ASSERT(CONN_SUP_TIMEOUT_OK(MAX_CONN_INTERVAL_FAST, SLAVE_LATENCY_FAST, CONN_SUP_TIMEOUT_FAST));
+BUILD_ASSERT(CONN_SUP_TIMEOUT_OK(MAX_CONN_INTERVAL_SLOW, SLAVE_LATENCY_SLOW, CONN_SUP_TIMEOUT_SLOW));
+
+// ファームウェア更新中とペアリング中の接続パラメータ (転送速度・往復の速さ優先)
+#define MIN_CONN_INTERVAL_DFU   6      // 7.5ms
+#define MAX_CONN_INTERVAL_DFU   12     // 15ms
+#define SLAVE_LATENCY_DFU       0
+#define CONN_SUP_TIMEOUT_DFU    400    // 4秒
+
+BUILD_ASSERT(CONN_SUP_TIMEOUT_OK(MAX_CONN_INTERVAL_DFU, SLAVE_LATENCY_DFU, CONN_SUP_TIMEOUT_DFU));
+
+// ペアリングでも使う (公開鍵の交換から鍵の配布まで、やりとりの往復を速くする)
+static const struct bt_le_conn_param conn_params_dfu = {
+    .interval_min = MIN_CONN_INTERVAL_DFU,
+    .interval_max = MAX_CONN_INTERVAL_DFU,
+    .latency = SLAVE_LATENCY_DFU,
+    .timeout = CONN_SUP_TIMEOUT_DFU,
+};
+
 
 // 低消費電力モードへ切り替えるまでの時間
 #define FAST_MODE_TIMEOUT 1000*30 // in ms
 
 
-static const struct bt_data ad[] = {
-    BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE, (CONFIG_BT_DEVICE_APPEARANCE >> 0) & 0xff, (CONFIG_BT_DEVICE_APPEARANCE >> 8) & 0xff),
-    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-    BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL), BT_UUID_16_ENCODE(BT_UUID_BAS_VAL)),
-};
-
-static const struct bt_data sd[] = {
-    BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
-};
-
 static struct conn_mode {
     struct bt_conn *conn;
     bool in_boot_mode;
     bool is_waiting_confirm; // 確認まちかどうか
+    bool pairing_params; // ペアリングのために更新用の接続パラメータにしている
+    bool restore_params; // ペアリングが終わったので、いまのモードの接続パラメータに戻す
+    uint8_t phy; // 使用中の送信 PHY (BT_GAP_LE_PHY_*)
 } cm[CONFIG_BT_HIDS_MAX_CLIENT_COUNT];
 static struct k_mutex cm_mutex; // 上記 cm 構造体を保護するためのミューテックス
 #define CM_MUTEX_LOCK() do { k_mutex_lock(&cm_mutex, K_FOREVER); } while(0)
 #define CM_MUTEX_UNLOCK() do { k_mutex_unlock(&cm_mutex); } while(0)
 
-// コールバック関数で使用するイベントタイプ
-enum event_type {
-    EVENT_PAIRING_BUTTON_PRESS,
-    EVENT_KEY_PRESS,
-    EVENT_KEY_RELEASE,
-#if USE_KEY_RESEND
-    EVENT_KEY_STATUS_RESEND,
-#endif
-    EVENT_PAIRING_TIMEOUT,
-    EVENT_CHECK_ADV_COND,
-    EVENT_FAST_MODE_TIMEOUT,
-};
-
-volatile bool is_waiting_pairing = false; // ペアリングボタンが押されて、タイムアウトするまでの間、真になる
-volatile bool is_any_connected = false; // どれか一つでもセントラルが接続していたら真になる
+static bool any_connected = false; // どれか一つでもセントラルが接続していたら真になる (メインループのみ)
+static bool usb_active = false; // USB で有線接続中。レポートは USB だけに送る (メインループのみ)
 
-volatile bool is_adv_ongoing = false; // アドバタイズが進行中かどうか
-static bool led_on = false; // LEDが点灯中かどうか
-static bool led_blinking = false; // LEDが点滅中かどうか
-static bool is_waiting_confirm = false; // 「確認」待ちかどうか
-
-static void post_check_adv();
-
-// ペアリング用にLED点滅開始
-static void start_led_blinking() {
-    // LED点滅を開始
-    if(!led_blinking) {
-        led_blinking = true;
-        led_on = false;
-        k_timer_start(&adv_led_timer, K_MSEC(ADV_LED_BLINK_ON_TIME), K_NO_WAIT);
-    }
-}
-
-// LED点滅終了
-static void stop_led_blinking() {
-    // LED点滅を終了
-    if(led_blinking) {
-        led_blinking = false;
-        led_on = false;
-        set_led(0);
-        k_timer_stop(&adv_led_timer);
-    }
-}
-
-// LED点滅用のタイマーコールバックハンドラ
-static void led_timeout_handler(struct k_timer *dummy) {
-    if(led_on)
-    {
-        set_led(1);
-        k_timer_start(&adv_led_timer,
-            is_waiting_confirm ? K_MSEC(CONFIRM_LED_BLINK_ON_TIME) : K_MSEC(ADV_LED_BLINK_ON_TIME), K_NO_WAIT);
-    }
-    else
-    {
-        set_led(0);
-        k_timer_start(&adv_led_timer,
-            is_waiting_confirm ? K_MSEC(CONFIRM_LED_BLINK_OFF_TIME) : K_MSEC(ADV_LED_BLINK_OFF_TIME), K_NO_WAIT);
-        post_check_adv(); // アドバタイズを続けるかどうかをチェック
-    }   
-    led_on = !led_on;
-}
-
-static bool is_adv_condition();
-static bool is_led_blinking_condition();
-
-// LEDが点滅すべき状態かどうかをチェックし、点滅の開始や停止を行う
-static void check_led_blink()
-{
-    if(is_led_blinking_condition()) start_led_blinking(); else stop_led_blinking();
-}
-
-// LED 点滅を行うべきかかどうか
-static bool is_led_blinking_condition() {
-    return is_adv_condition() || is_waiting_confirm || is_waiting_pairing;
-}
-
-// アドバタイズを行うべきかどうか
-static bool is_adv_condition() { 
-    printk("check: %d %d %d %d \n", is_adv_ongoing, is_waiting_pairing, is_any_connected, is_waiting_confirm);
-    return is_waiting_pairing || !is_any_connected;
-}
-
-// Stops advertizing
-static void stop_adv() {
-    if(is_adv_ongoing)
-    {
-        int err = bt_le_adv_stop();
-        if (err) {
-            printk("bt_le_adv_stop() failed (err %d)\n", err);
-        } else {
-            printk("Advertising stopped\n");
-            is_adv_ongoing = false;
-            is_waiting_pairing = false;
-            check_led_blink();
-        }
-
-        post_check_adv();
-
-    }
-}
-// Starts advertising process
-static void advertising_start(void) {
-    if(!is_adv_ongoing)
-    {
-        int err;
-
-        const struct bt_le_adv_param adv_param = {
-            .options = BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_ONE_TIME,
-            .interval_min = ADV_INTERVAL_MIN,
-            .interval_max = ADV_INTERVAL_MAX,
-            .peer = NULL
-        };
-
-        err = bt_le_adv_start(&adv_param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
-        if (err) {
-            if (err == -EALREADY) {
-                printk("Advertising continued\n");
-            } else {
-                printk("bt_le_adv_start() failed (err %d)\n", err);
-            }
-
-            return;
-        }
-
-        printk("Advertising successfully started\n");
-        is_adv_ongoing = true;
-        check_led_blink();
-    }
-}
-
-
-// アドバタイズは以下のどちらかの場合に該当した場合に行わる
-// ・ペアリングボタンが押されてからそれがタイムアウトするまで
-// ・何も接続がないとき
-// 以下の関数はこれらの状態をチェックし、状況に合わせてアドバタイズを開始し、
-// 状況に合わせてアドバタイズを終了する
-// 安全性の確保のため、メインスレッドからのみ呼び出すこと
-static void check_adv()
-{
-    if(is_adv_condition()) advertising_start(); else stop_adv();
-    check_led_blink();
-}
-
-
-// アドバタイズの状態を再チェックするようにキューにメッセージを投入する関数
-static void post_check_adv()
-{
-    uint8_t event = EVENT_CHECK_ADV_COND;
-
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue EVENT_CHECK_ADV_COND event\n");
-    }
-}
+static bool last_mode = false; // 現在の通信速度 (fast = true)
+static bool dfu_active = false; // ファームウェア更新中かどうか
 
 // 通信速度の頻度を設定する
 static void set_ble_speed(bool fast)
 {
     DEBUG_PRINT_THREAD_INFO();
 
-    static bool last_mode = false;
+    // ファームウェア更新中は更新用のパラメータのままにする
+    if(dfu_active) return;
+
+    // 接続直後は last_mode によらず fast なので、変わらなくても伝える
+    link_monitor_set_active(fast);
+
     if(last_mode != fast)
     {
         printk("Fast mode: %s\n", fast ? "on" : "off");
-#if USE_KEY_RESEND
-        if(fast) // fast 中はキーボードイベントを繰り返し送信する
-            k_timer_start(&key_state_resend_timeout_timer, K_MSEC(KEY_RESEND_INTERVAL), K_MSEC(KEY_RESEND_INTERVAL));
-        else
-            k_timer_stop(&key_state_resend_timeout_timer);
-#endif
         CM_MUTEX_LOCK();
         for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
-            if (cm[i].conn) {
+            // ペアリング中の接続は、終わってから restore_pairing_params() で合わせる
+            if (cm[i].conn && !cm[i].pairing_params) {
                 bt_conn_le_param_update(cm[i].conn, fast ? &conn_params_fast : &conn_params_slow); // パラメータの更新
                 bt_conn_le_param_update(cm[i].conn, fast ? &conn_params_fast : &conn_params_slow); // パラメータの更新
             }
         }
         CM_MUTEX_UNLOCK();
         last_mode = fast;
+        metrics_set_mode(fast ? METRICS_MODE_FAST : METRICS_MODE_SLOW);
     }
 }
 
 // 通信速度 fast = true のタイムアウトを設定する
 static void reset_fast_mode_timeout_timer()
 {
-    k_timer_start(&fast_mode_timeout_timer, K_MSEC(FAST_MODE_TIMEOUT), K_NO_WAIT);
+    deadline_start(&fast_mode_timeout_timer, K_MSEC(FAST_MODE_TIMEOUT), K_NO_WAIT);
 }
 
 // 通信速度 fast = true のタイムアウトハンドラー
-void fast_mode_timeout_handler(struct k_timer *dummy)
+void fast_mode_timeout_handler(struct deadline *dummy)
 {
-    uint8_t event = EVENT_FAST_MODE_TIMEOUT;
+    post_event(EVENT_FAST_MODE_TIMEOUT);
+}
 
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue EVENT_FAST_MODE_TIMEOUT event\n");
+// ファームウェア更新の開始/終了に合わせて接続を設定する
+static void set_dfu_mode(bool active)
+{
+    if(dfu_active == active) return;
+    dfu_active = active;
+    printk("DFU mode: %s\n", active ? "on" : "off");
+
+    if(active)
+    {
+        metrics_set_mode(METRICS_MODE_DFU);
+        link_monitor_set_active(true);
+        // 大きなデータを速く送れるよう、最速の接続パラメータにする
+        CM_MUTEX_LOCK();
+        for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+            if (cm[i].conn) {
+                bt_conn_le_param_update(cm[i].conn, &conn_params_dfu);
+            }
+        }
+        CM_MUTEX_UNLOCK();
+        // データ長と PHY は PHY の方針に任せる (電波が弱ければ 2M にはしない)
+        phy_policy_set_bulk(true);
+    }
+    else
+    {
+        phy_policy_set_bulk(false);
+        // 通常の fast モードに戻す
+        last_mode = false;
+        set_ble_speed(true);
+        reset_fast_mode_timeout_timer();
     }
 }
 
@@ -331,6 +236,14 @@ void fast_mode_timeout_handler(struct k_timer *dummy)
 static void connected(struct bt_conn *conn, uint8_t err) {
     DEBUG_PRINT_THREAD_INFO();
 
+#if defined(CONFIG_BT_CENTRAL)
+    // ハブとして子機に接続したものはホストとの接続とは別に扱う
+    if (hub_is_node(conn)) {
+        hub_connected(conn, err);
+        return;
+    }
+#endif
+
     DEF_BT_ADDR_LE_TO_STR
 
     if (err) {
@@ -339,6 +252,10 @@ static void connected(struct bt_conn *conn, uint8_t err) {
     }
 
     printk("Connected %s\n", addr);
+    pair_timing_connected(conn);
+
+    adv_sched_connected();
+    adv_sched_print_stats();
 
     err = bt_conn_set_security(conn, BT_SECURITY_L2);
     if (err) {
@@ -367,19 +284,39 @@ static void connected(struct bt_conn *conn, uint8_t err) {
             cm[i].conn = conn;
             cm[i].in_boot_mode = false;
             cm[i].is_waiting_confirm = false;
-            is_any_connected = true;
+            cm[i].pairing_params = false;
+            cm[i].restore_params = false;
+            cm[i].phy = BT_GAP_LE_PHY_1M;
             break;
         }
     }
     CM_MUTEX_UNLOCK();
 
-    post_check_adv();
+    notify_track_connected(conn);
+    host_sync_connected(conn);
+    gatt_cache_connected(conn);
+    tx_power_connected(conn);
+    link_monitor_connected(conn);
+    metrics_connected(conn);
+
+    phy_policy_connected(conn);
+
+    post_event(EVENT_CONNECTED);
 }
 
 // Callback function when a device is disconnected
 static void disconnected(struct bt_conn *conn, uint8_t reason) {
     DEBUG_PRINT_THREAD_INFO();
 
+    press_time_disconnected(conn);
+
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) {
+        hub_disconnected(conn, reason);
+        return;
+    }
+#endif
+
     int err;
     DEF_BT_ADDR_LE_TO_STR
 
@@ -391,6 +328,17 @@ static void disconnected(struct bt_conn *conn, uint8_t reason) {
         printk("bt_hids_disconnected() failed\n");
     }
 
+    phy_policy_disconnected(conn);
+    phy_policy_print_stats();
+    host_sync_disconnected(conn);
+    gatt_cache_disconnected(conn);
+    link_monitor_disconnected(conn, reason);
+    tx_power_disconnected(conn);
+    tx_power_print_stats();
+    metrics_disconnected(conn);
+    // 送信完了待ちは各モジュールが切断時に参照するので最後に消す
+    notify_track_disconnected(conn);
+
     // Clear the connection slot
     CM_MUTEX_LOCK();
     for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
@@ -399,20 +347,40 @@ static void disconnected(struct bt_conn *conn, uint8_t reason) {
             break;
         }
     }
+    CM_MUTEX_UNLOCK();
 
-    // check if all connection was lost
-    bool any_connected = false;
+    post_event(EVENT_DISCONNECTED);
+}
+
+// 接続が一つでもあるかどうか
+static bool is_any_connected(void)
+{
+    bool any = false;
+
+    CM_MUTEX_LOCK();
     for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
         if (cm[i].conn) {
-            any_connected = true;
+            any = true;
             break;
         }
     }
     CM_MUTEX_UNLOCK();
-    is_any_connected = any_connected;
+    return any;
+}
 
-    post_check_adv();
+#if defined(CONFIG_USB_DEVICE_HID)
+// すべての BLE 接続を切る (有線に切り替えたとき)
+static void disconnect_all(void)
+{
+    CM_MUTEX_LOCK();
+    for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+        if (cm[i].conn) {
+            bt_conn_disconnect(cm[i].conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        }
+    }
+    CM_MUTEX_UNLOCK();
 }
+#endif
 
 // 指定された接続の「確認まち」を有効にする
 static void set_waiting_confirm(struct bt_conn *conn)
@@ -433,6 +401,7 @@ static void confirm_all()
     CM_MUTEX_LOCK();
     for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
         if (cm[i].conn && cm[i].is_waiting_confirm) {
+            pair_timing_phase(cm[i].conn, PAIR_PHASE_USER_CONFIRM);
             int err = bt_conn_auth_passkey_confirm(cm[i].conn);
             if (err) {
                 printk("bt_conn_auth_passkey_confirm() failed\n");
@@ -441,6 +410,10 @@ static void confirm_all()
         }
     }
     CM_MUTEX_UNLOCK();
+#if defined(CONFIG_BT_CENTRAL)
+    // 登録を待っている子機も同じボタンで確認する
+    hub_confirm_all();
+#endif
 }
 
 // すべての接続にて「確認」をキャンセルする
@@ -459,19 +432,75 @@ static void cancel_confirm_all()
 static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err) {
     DEBUG_PRINT_THREAD_INFO();
 
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) {
+        hub_security_changed(conn, level, err);
+        return;
+    }
+#endif
+
     DEF_BT_ADDR_LE_TO_STR
 
     if (!err) {
         printk("Security changed: %s level %u\n", addr, level);
+        pair_timing_phase(conn, PAIR_PHASE_ENCRYPTED);
+        gatt_cache_encrypted(conn);
+        // 暗号化が完了して通知できるようになったので、ホスト側のキー状態を揃える
+        host_sync_request(conn, HOST_SYNC_RECONNECT);
+#if defined(CONFIG_MCUMGR)
+        // ホストと暗号化した接続ができたので、テスト中のイメージなら確定する
+        dfu_link_ok();
+#endif
     } else {
         printk("Security failed: %s level %u err %d %s\n", addr, level, err, bt_security_err_to_str(err));
     }
 }
 
+// Callback function when the PHY is updated
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param) {
+    DEBUG_PRINT_THREAD_INFO();
+
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) return;
+#endif
+
+    DEF_BT_ADDR_LE_TO_STR
+
+    printk("PHY updated %s: tx %u rx %u\n", addr, param->tx_phy, param->rx_phy);
+
+    CM_MUTEX_LOCK();
+    for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+        if (cm[i].conn == conn) {
+            cm[i].phy = param->tx_phy;
+            break;
+        }
+    }
+    CM_MUTEX_UNLOCK();
+
+    phy_policy_updated(conn, param->tx_phy);
+}
+
+// 接続パラメータが変わった。押下の時刻の外挿に使うアンカーは接続間隔ごとに取り直す
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout) {
+    press_time_param_updated(conn);
+}
+
+#if defined(CONFIG_BT_CENTRAL)
+// 接続パラメータの更新要求。ホストとの接続ではセントラルにならないので、要求してくるのは子機だけ
+static bool le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param) {
+    return hub_is_node(conn) ? hub_le_param_req(conn, param) : true;
+}
+#endif
+
 struct bt_conn_cb conn_callbacks = {
     .connected = connected,
     .disconnected = disconnected,
     .security_changed = security_changed,
+    .le_phy_updated = le_phy_updated,
+    .le_param_updated = le_param_updated,
+#if defined(CONFIG_BT_CENTRAL)
+    .le_param_req = le_param_req,
+#endif
 };
 
 // HID profile event handler
@@ -498,11 +527,13 @@ static void hids_pm_evt_handler(enum bt_hids_pm_evt evt, struct bt_conn *conn) {
     case BT_HIDS_PM_EVT_BOOT_MODE_ENTERED:
         printk("Boot mode entered %s\n", addr);
         cm[i].in_boot_mode = true;
+        host_sync_request(conn, HOST_SYNC_CURRENT);
         break;
 
     case BT_HIDS_PM_EVT_REPORT_MODE_ENTERED:
         printk("Report mode entered %s\n", addr);
         cm[i].in_boot_mode = false;
+        host_sync_request(conn, HOST_SYNC_CURRENT);
         break;
 
     default:
@@ -511,14 +542,20 @@ static void hids_pm_evt_handler(enum bt_hids_pm_evt evt, struct bt_conn *conn) {
     CM_MUTEX_UNLOCK();
 }
 
-// Initialize the HID service
-static void hid_init(void) {
-    int err;
-    struct bt_hids_init_param hids_init = {0};
-    struct bt_hids_inp_rep *inp_rep;
+// Input report notification enable/disable handler
+static void hids_notify_handler(enum bt_hids_notify_evt evt) {
+    DEBUG_PRINT_THREAD_INFO();
 
+    // どの接続が購読したかは分からないので、すべての接続で現在の状態を送り直す
+    // (既に同じ状態を受け取っているホストには送らない)
+    if (evt == BT_HIDS_CCCD_EVT_NOTIFY_ENABLED) {
+        host_sync_request(NULL, HOST_SYNC_CURRENT);
+    }
+}
+
+// レポートディスクリプタ (BLE の HIDS と USB HID で共通)
 #if USE_ONE_BYTE_REPORT
-    static const uint8_t report_map[] = {
+static const uint8_t report_map[] = {
 		0x05, 0x01,       /* Usage Page (Generic Desktop) */
 		0x09, 0x06,       /* Usage (Keyboard) */
 		0xA1, 0x01,       /* Collection (Application) */
@@ -538,10 +575,41 @@ static void hid_init(void) {
 		0x81, 0x00,       /* Input  1 bytes */
 
 		0xC0              /* End Collection (Application) */
-    };
+};
+#elif defined(CONFIG_BT_CENTRAL)
+// ハブモード: 子機のキーと同時に押されても取りこぼさないように NKRO (キーごとに 1 ビット)
+static const uint8_t report_map[] = {
+		0x05, 0x01,       /* Usage Page (Generic Desktop) */
+		0x09, 0x06,       /* Usage (Keyboard) */
+		0xA1, 0x01,       /* Collection (Application) */
+
+		/* Keys */
+#if INPUT_REP_KEYS_REF_ID
+		0x85, INPUT_REP_KEYS_REF_ID,
+#endif
+		0x05, 0x07,       /* Usage Page (Key Codes) */
+		0x19, 0xe0,       /* Usage Minimum (224) */
+		0x29, 0xe7,       /* Usage Maximum (231) */
+		0x15, 0x00,       /* Logical Minimum (0) */
+		0x25, 0x01,       /* Logical Maximum (1) */
+		0x75, 0x01,       /* Report Size (1) */
+		0x95, 0x08,       /* Report Count (8) */
+		0x81, 0x02,       /* Input (Data, Variable, Absolute) */
+
+		0x05, 0x07,       /* Usage Page (Key codes) */
+		0x19, 0x00,       /* Usage Minimum (0) */
+		0x29, HUB_NKRO_USAGE_MAX, /* Usage Maximum (103) */
+		0x15, 0x00,       /* Logical Minimum (0) */
+		0x25, 0x01,       /* Logical Maximum (1) */
+		0x75, 0x01,       /* Report Size (1) */
+		0x95, HUB_NKRO_USAGE_MAX + 1, /* Report Count (104) */
+		0x81, 0x02,       /* Input (Data, Variable, Absolute) Key bitmap(13 bytes) */
+
+		0xC0              /* End Collection (Application) */
+};
 #else
-    // standard 6 byte report
-    static const uint8_t report_map[] = {
+// standard 6 byte report
+static const uint8_t report_map[] = {
 		0x05, 0x01,       /* Usage Page (Generic Desktop) */
 		0x09, 0x06,       /* Usage (Keyboard) */
 		0xA1, 0x01,       /* Collection (Application) */
@@ -575,9 +643,14 @@ static void hid_init(void) {
 
 		0xC0              /* End Collection (Application) */
 
-    };
+};
 #endif
 
+// Initialize the HID service
+static void hid_init(void) {
+    int err;
+    struct bt_hids_init_param hids_init = {0};
+    struct bt_hids_inp_rep *inp_rep;
 
     hids_init.rep_map.data = report_map;
     hids_init.rep_map.size = sizeof(report_map);
@@ -589,9 +662,11 @@ static void hid_init(void) {
     inp_rep = &hids_init.inp_rep_group_init.reports[0];
     inp_rep->size = INPUT_REPORT_MAX_LEN;
     inp_rep->id = 0;
+    inp_rep->handler = hids_notify_handler;
     hids_init.inp_rep_group_init.cnt++;
 
     hids_init.is_kb = true;
+    hids_init.boot_kb_notif_handler = hids_notify_handler;
     hids_init.pm_evt_handler = hids_pm_evt_handler;
 
     err = bt_hids_init(&hids_obj, &hids_init);
@@ -620,47 +695,124 @@ static void auth_passkey_entry(struct bt_conn *conn) {
 }
 #endif
 
+// ペアリング要求を受け付けるときに呼ばれる
+static enum bt_security_err auth_pairing_accept(struct bt_conn *conn,
+                                                const struct bt_conn_pairing_feat *const feat) {
+    DEBUG_PRINT_THREAD_INFO();
+    pair_timing_phase(conn, PAIR_PHASE_REQUEST);
+    gatt_cache_pairing(conn);
+#if defined(CONFIG_SETTINGS_NVS)
+    // ボンディングが変わる前に、溜めてあるもの (他のホストの CCC など) を書いておく
+    storage_wb_flush("pairing");
+#endif
+
+    // ペアリングが終わるまで最速の接続パラメータにする (終わったら EVENT_PAIRING_END で戻す)
+    if (!dfu_active && bt_conn_le_param_update(conn, &conn_params_dfu) == 0) {
+        CM_MUTEX_LOCK();
+        for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+            if (cm[i].conn == conn) {
+                cm[i].pairing_params = true;
+                break;
+            }
+        }
+        CM_MUTEX_UNLOCK();
+    }
+    return BT_SECURITY_ERR_SUCCESS;
+}
+
+// ペアリングが終わった接続を、EVENT_PAIRING_END でいまのモードの接続パラメータに戻すよう印を付ける
+static void end_pairing_params(struct bt_conn *conn)
+{
+    CM_MUTEX_LOCK();
+    for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+        if (cm[i].conn == conn && cm[i].pairing_params) {
+            cm[i].pairing_params = false;
+            cm[i].restore_params = true;
+            break;
+        }
+    }
+    CM_MUTEX_UNLOCK();
+}
+
+// 印を付けた接続だけを、いまのモードの接続パラメータに戻す (メインループ)
+static void restore_pairing_params(void)
+{
+    CM_MUTEX_LOCK();
+    for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+        if (cm[i].conn && cm[i].restore_params) {
+            cm[i].restore_params = false;
+            bt_conn_le_param_update(cm[i].conn, dfu_active ? &conn_params_dfu :
+                                    last_mode ? &conn_params_fast : &conn_params_slow);
+        }
+    }
+    CM_MUTEX_UNLOCK();
+}
+
 // Confirms passkey during pairing
 static void auth_passkey_confirm(struct bt_conn *conn, unsigned int passkey) {
     DEBUG_PRINT_THREAD_INFO();
     DEF_BT_ADDR_LE_TO_STR
     printk("Confirm passkey for %s: %06u\n", addr, passkey);
+    pair_timing_phase(conn, PAIR_PHASE_CONFIRM_REQUEST);
     set_waiting_confirm(conn);
-    is_waiting_confirm = true;
-    post_check_adv();
+    post_event(EVENT_CONFIRM_REQUEST);
 }
 
 // Called if pairing is cancelled
 static void auth_cancel(struct bt_conn *conn) {
     DEBUG_PRINT_THREAD_INFO();
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) return;
+#endif
     DEF_BT_ADDR_LE_TO_STR
     printk("Pairing cancelled: %s\n", addr);
+    pair_timing_end(conn, false);
+    end_pairing_params(conn);
     cancel_confirm_all();
-    is_waiting_confirm = false;
-    is_waiting_pairing = false;
-    post_check_adv();
+    post_event(EVENT_PAIRING_END);
 }
 
 // Callback when pairing is completed
 static void pairing_complete(struct bt_conn *conn, bool bonded) {
     DEBUG_PRINT_THREAD_INFO();
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) {
+        // 子機の登録 (ペアリングモードの終わりは hub.c が知らせる)
+        hub_pairing_complete(conn, bonded);
+#if defined(CONFIG_SETTINGS_NVS)
+        // 子機の鍵と登録をその場で書く
+        if (bonded) storage_wb_flush("node bond");
+#endif
+        return;
+    }
+#endif
+#if defined(CONFIG_SETTINGS_NVS)
+    // ボンディング情報は溜めずに、完了を扱う前にこのスレッドで書く (ペアリングは稀なので BT のスレッドを待たせてよい)
+    if (bonded) storage_wb_flush("bond");
+#endif
     DEF_BT_ADDR_LE_TO_STR
     printk("Pairing completed: %s, bonded: %d\n", addr, bonded);
+    pair_timing_end(conn, true);
+    end_pairing_params(conn);
     cancel_confirm_all();
-    is_waiting_confirm = false;
-    is_waiting_pairing = false;
-    post_check_adv();
+    post_event(EVENT_PAIRING_END);
 }
 
 // Callback when pairing fails
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason) {
     DEBUG_PRINT_THREAD_INFO();
+#if defined(CONFIG_BT_CENTRAL)
+    if (hub_is_node(conn)) {
+        hub_pairing_failed(conn);
+        return;
+    }
+#endif
     DEF_BT_ADDR_LE_TO_STR
     printk("Pairing failed conn: %s, reason %d %s\n", addr, reason, bt_security_err_to_str(reason));
+    pair_timing_end(conn, false);
+    end_pairing_params(conn);
     cancel_confirm_all();
-    is_waiting_confirm = false;
-    is_waiting_pairing = false;
-    post_check_adv();
+    post_event(EVENT_PAIRING_END);
 }
 
 static struct bt_conn_auth_cb conn_auth_callbacks = {
@@ -668,40 +820,146 @@ static struct bt_conn_auth_cb conn_auth_callbacks = {
     .passkey_entry = NULL, // auth_passkey_entry, このデバイスはパスキー入力ができない
     .passkey_confirm = auth_passkey_confirm, // このデバイスは「確認」入力はできる
     .cancel = auth_cancel,
+    .pairing_accept = auth_pairing_accept,
 };
 
+#if defined(CONFIG_SETTINGS_NVS)
+// ボンディング情報が消されたとき (CONFIG_BT_KEYS_OVERWRITE_OLDEST で古いものを消したときなど)。
+// 新しい鍵を書く前に、消したことをその場で書く
+static void bond_deleted(uint8_t id, const bt_addr_le_t *peer) {
+    storage_wb_flush("bond deleted");
+}
+#endif
+
 static struct bt_conn_auth_info_cb conn_auth_info_callbacks = {
     .pairing_complete = pairing_complete,
     .pairing_failed = pairing_failed,
+#if defined(CONFIG_SETTINGS_NVS)
+    .bond_deleted = bond_deleted,
+#endif
 };
 
 // current keyboard state
 static bool key_pressed;
 static uint8_t key_code;
+static uint8_t keycode;         // DIPSW で選んだキーコード (タップで送る)
+
+// 最後のキー入力のエッジの時刻 (レポート送信までの遅延の計測用)
+static uint32_t key_edge_cycles;
+static bool key_edge_pending;
+
+static uint32_t key_press_ms;   // 最後にキーコードを押下した時刻
+
+// レポートの送信完了コールバック
+static void key_report_sent_cb(struct bt_conn *conn, void *user_data) {
+    struct notify_track nt;
+
+    if (notify_track_peek(conn, &nt)) {
+        // ホストが受け取った状態は、送信完了待ちから降ろす前に更新する
+        host_sync_report_done(conn, &nt);
+        notify_track_done(conn);
+        phy_policy_report_done(conn, &nt);
+        ctlr_bench_report_done(conn, &nt);
+        if (link_monitor_report_done(conn, &nt)) {
+            // 再送の前の分が届いたので、続きを送る
+            host_sync_request(conn, HOST_SYNC_REPLAY);
+        }
+    }
+    gatt_cache_report_done(conn);
+#if defined(CONFIG_MCUMGR)
+    dfu_link_ok();
+#endif
+}
+
+// レポートバイト列を作る (BLE と USB で共通)
+static void build_report(uint8_t report[INPUT_REPORT_MAX_LEN], uint8_t code, bool pressed) {
+    memset(report, 0, INPUT_REPORT_MAX_LEN);
+#if USE_ONE_BYTE_REPORT
+    report[0] = pressed ? code : 0;
+#elif defined(CONFIG_BT_CENTRAL)
+    hub_build_report(report, pressed ? code : 0); // 子機で押されているキーも含める
+#else
+    report[2] = pressed ? code : 0; // [シフトステート, 予約, キーコード, 0,0,0,0,0]
+#endif
+}
+
+// Send key report to one client (call with CM_MUTEX locked)
+// replay は届かなかったキー入力の再送 (失敗してもリンク断の判断に数えない)
+static int key_report_send_to(size_t i, uint8_t code, bool pressed, bool replay) {
+    int err;
+    uint8_t report[INPUT_REPORT_MAX_LEN]; // レポートバイト列
+
+    build_report(report, code, pressed);
+
+    // ハブに接続している子機なら、キーは HID ではなくハブへの通知 (hub_link_send()) で送る
+    if (hub_link_is_hub(cm[i].conn)) return 0;
+
+    // 送信完了コールバックは送信の要求から戻る前に呼ばれることがあるので、待ちは先に記録する
+    // (失敗したら notify_track_sent() で取り消す)
+    struct notify_track nt = {
+#if defined(CONFIG_BT_CENTRAL)
+        .pressed = pressed || hub_any_pressed(),
+#else
+        .pressed = pressed,
+#endif
+        .replay = replay,
+        .edge_cycles = key_edge_pending ? key_edge_cycles : 0,
+    };
+    notify_track_sending(cm[i].conn, &nt);
+
+    if (cm[i].in_boot_mode) {
+#if defined(CONFIG_BT_CENTRAL)
+        // ブートプロトコルのホストには NKRO ではなく 6 キーのレポートを送る
+        uint8_t boot_report[HUB_BOOT_REPORT_LEN];
+
+        hub_build_boot_report(boot_report, pressed ? code : 0);
+        err = bt_hids_boot_kb_inp_rep_send(&hids_obj, cm[i].conn, 
+                                           boot_report, 
+                                           sizeof(boot_report), key_report_sent_cb);
+#else
+        err = bt_hids_boot_kb_inp_rep_send(&hids_obj, cm[i].conn, 
+                                           report, 
+                                           sizeof(report), key_report_sent_cb);
+#endif
+    } else {
+        err = bt_hids_inp_rep_send(&hids_obj, cm[i].conn, 0, 
+                                   report, 
+                                   sizeof(report), key_report_sent_cb);
+    }
+    notify_track_sent(cm[i].conn, err);
+    phy_policy_report_sent(cm[i].conn, sizeof(report), err);
+    metrics_report_sent(cm[i].conn, err);
+    link_monitor_report_sent(cm[i].conn, err, replay);
+    gatt_cache_report_sent(cm[i].conn, err);
+    return err;
+}
 
 // Send key report to all connected clients
 static int key_report_send() {
     int err = 0;
-    uint8_t report[INPUT_REPORT_MAX_LEN] = {0}; // レポートバイト列
 
-#if USE_ONE_BYTE_REPORT
-    report[0] = key_pressed ? key_code : 0;
-#else
-    report[2] = key_pressed ? key_code : 0; // [シフトステート, 予約, キーコード, 0,0,0,0,0]
+#if defined(CONFIG_USB_DEVICE_HID)
+    if (usb_active) {
+        uint8_t report[INPUT_REPORT_MAX_LEN];
+
+        build_report(report, key_code, key_pressed);
+        err = usb_transport_send(report, sizeof(report));
+        if (err) {
+            printk("usb_transport_send() failed: %d\n", err);
+        }
+#if defined(CONFIG_MCUMGR)
+        else {
+            dfu_link_ok();
+        }
+#endif
+        return err;
+    }
 #endif
 
     CM_MUTEX_LOCK();
     for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
         if (cm[i].conn) {
-            if (cm[i].in_boot_mode) {
-                err = bt_hids_boot_kb_inp_rep_send(&hids_obj, cm[i].conn, 
-                                                   report, 
-                                                   sizeof(report), NULL);
-            } else {
-                err = bt_hids_inp_rep_send(&hids_obj, cm[i].conn, 0, 
-                                           report, 
-                                           sizeof(report), NULL);
-            }
+            err = key_report_send_to(i, key_code, key_pressed, false);
             if (err) {
                 CM_MUTEX_UNLOCK();
                 printk("key_report_send() failed: %d\n", err);
@@ -713,45 +971,100 @@ static int key_report_send() {
     return 0;
 }
 
-#if USE_KEY_RESEND
-// キーボード情報再送信用ハンドラー
-static void key_state_resend_timeout_handler(struct k_timer *dummy)
-{
-    uint8_t event = EVENT_KEY_STATUS_RESEND;
-
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue EVENT_KEY_STATUS_RESEND event\n");
-    } 
-}
+// ジェスチャーの判定結果のキーコードを送信する
+static void gesture_emit(uint8_t usage, bool pressed) {
+    key_code = pressed ? usage : 0;
+    key_pressed = pressed;
+#if defined(CONFIG_MCUMGR)
+    dfu_set_key_pressed(pressed);
 #endif
+    // ハブに接続していれば、ハブにもキーの状態を通知する
+    hub_link_send(key_code, key_edge_pending ? key_edge_cycles : k_cycle_get_32());
+    if (key_report_send() == 0 && key_edge_pending && (any_connected || usb_active)) {
+        metrics_key_latency(k_cyc_to_us_floor32(k_cycle_get_32() - key_edge_cycles));
+    }
+    key_edge_pending = false;
+
+    // 接続していないときの入力は、再接続後に送り直せるように残しておく
+    if (pressed) {
+        key_press_ms = k_uptime_get_32();
+    } else if (usage) {
+        // キーコード 0 (空のレポート) は送り直しても意味がない
+        link_monitor_tap(usage, key_press_ms, any_connected || usb_active);
+    }
+}
 
-// ペアリングボタンが押されたときのコールバック関数
-static void pairing_button_callback(void) {
-    uint8_t event = EVENT_PAIRING_BUTTON_PRESS;
-
-    printk("Pairing button pressed\n");
+// 接続が切れている間に届かなかったキー入力を、再接続したホストに送り直す (CM_MUTEX 取得済みで呼ぶこと)。
+// 送信バッファを埋めないよう LINK_REPLAY_CHUNK 個ずつ送り、続きはその通知が完了してから
+// (HOST_SYNC_REPLAY で) 送る。送れなかったものは残り、次の通知の完了でやり直す
+static int replay_taps(size_t i) {
+    uint8_t usages[LINK_REPLAY_CHUNK];
+    int n = link_monitor_peek_replay(cm[i].conn, usages, ARRAY_SIZE(usages));
+    int sent = 0;
+    int err = 0;
 
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue pairing button event\n");
+    for (int k = 0; k < n && !err; k++) {
+        err = key_report_send_to(i, usages[k], true, true);
+        if (err) break;
+        err = key_report_send_to(i, usages[k], false, true);
+        if (err) {
+            // 押下だけ届いたので、解放は現在の状態の同期で送る (押しっぱなしにしない)
+            host_sync_request(cm[i].conn, HOST_SYNC_CURRENT);
+        }
+        sent++;
+    }
+    // キーの内容はログに残さない
+    if (sent) {
+        printk("Replayed %d keys\n", sent);
     }
+    link_monitor_commit_replay(cm[i].conn, sent);
+    return err;
 }
 
-// キーが押されたときのコールバック関数
-static void key_press_callback(int press) {
-    uint8_t event = press ? EVENT_KEY_PRESS : EVENT_KEY_RELEASE;
+// 同期を要求されたホストにキー状態を送り直す
+// (定期的な再送信の代わりに、ホスト側の状態が食い違う可能性があるときだけ送る)
+static void host_sync_all() {
+    CM_MUTEX_LOCK();
+    for (size_t i = 0; i < CONFIG_BT_HIDS_MAX_CLIENT_COUNT; i++) {
+        if (!cm[i].conn) continue;
 
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue key press event\n");
+        uint8_t req = host_sync_take(cm[i].conn);
+        int err = 0;
+
+        if (req & HOST_SYNC_RECONNECT) {
+            // 再接続したホストには、キーが押されていても解放だけを送る
+            // (途中から押下を送ると、ホスト側でキーリピートが始まってしまう)
+            if (host_sync_host_may_see_pressed(cm[i].conn)) {
+                printk("Host sync: release\n");
+                err = key_report_send_to(i, key_code, false, false);
+            }
+            if (!err) err = replay_taps(i);
+        } else {
+            if (req & HOST_SYNC_CURRENT) {
+                if (key_pressed || host_sync_host_may_see_pressed(cm[i].conn)) {
+                    printk("Host sync: %s\n", key_pressed ? "press" : "release");
+                    err = key_report_send_to(i, key_code, key_pressed, false);
+                }
+            }
+            if (!err && (req & HOST_SYNC_REPLAY)) err = replay_taps(i);
+        }
+        if (err) {
+            printk("Host sync failed: %d\n", err);
+        }
     }
+    CM_MUTEX_UNLOCK();
 }
 
-// ペアリングタイムアウトハンドラ
-static void pairing_timeout_handler(struct k_timer *dummy) {
-    uint8_t event = EVENT_PAIRING_TIMEOUT;
+// ペアリングボタンが押されたときのコールバック関数
+static void pairing_button_callback(void) {
+    printk("Pairing button pressed\n");
 
-    if (k_msgq_put(&event_queue, &event, K_NO_WAIT) != 0) {
-        printk("Failed to queue pairing timeout event\n");
-    }
+    post_event(EVENT_PAIRING_BUTTON_PRESS);
+}
+
+// キーが押されたときのコールバック関数
+static void key_press_callback(int press) {
+    post_event(press ? EVENT_KEY_PRESS : EVENT_KEY_RELEASE);
 }
 
 
@@ -774,124 +1087,236 @@ static bool is_bonding_info_present(void) {
     return bonding_exists;
 }
 
-
-// ペアリングとタイマーを開始する
-static void start_pairing_and_timer()
+#if defined(CONFIG_USB_DEVICE_HID)
+// 状態機械が SM_USB に入る/出るときに呼ばれる (メインループ)
+static void usb_state_changed(bool active)
 {
-    // ペアリングモードを開始
-    is_waiting_pairing = true;
+    usb_active = active;
+    if (active) {
+        // 同じホストに二重に届かないよう、BLE の接続は切る (確認待ちのペアリングも取りやめる)
+        disconnect_all();
+        // ホスト側のキー状態を揃える
+        key_report_send();
+    }
+}
+#endif
+
+// メインループ。イベントを一つずつ処理する (システムワークキューから呼ばれる)
+static void handle_event(const struct app_event *event) {
+    switch (event->type) {
+    case EVENT_PAIRING_BUTTON_PRESS:
+        if (sm_state() == SM_CONFIRM) {
+            confirm_all();
+        } else {
+            sm_event(SM_EV_PAIRING_START);
+        }
+        break;
+
+    case EVENT_PAIRING_TIMEOUT:
+        sm_event(SM_EV_PAIRING_TIMEOUT);
+        break;
+
+    case EVENT_PAIRING_END:
+        restore_pairing_params();
+        sm_event(SM_EV_PAIRING_END);
+        break;
+
+    case EVENT_CONFIRM_REQUEST:
+        sm_event(SM_EV_CONFIRM_REQUEST);
+        break;
+
+    case EVENT_CONNECTED:
+        any_connected = true;
+        sm_event(SM_EV_CONNECTED);
+        break;
+
+    case EVENT_DISCONNECTED:
+        any_connected = is_any_connected();
+        if (!any_connected) sm_event(SM_EV_ALL_DISCONNECTED);
+        break;
+
+    case EVENT_KEY_PRESS:
+    case EVENT_KEY_RELEASE:
+        printk("%d Key %s: %02x\n", k_uptime_get_32(),
+          (event->type == EVENT_KEY_PRESS) ? "Pressed" : "Released", keycode);
+        set_ble_speed(true);
+        reset_fast_mode_timeout_timer();
+        key_edge_cycles = get_key_edge_cycles();
+        key_edge_pending = true;
+        // 押された順を決められるように、エッジの時刻を接続イベントに対応づけて通知する
+        press_time_send(key_edge_cycles, event->type == EVENT_KEY_PRESS);
+        // 送信するキーコードはジェスチャーの判定結果で決まる (gesture_emit() から送信)
+        gesture_input(event->type == EVENT_KEY_PRESS, event->cycles);
+        // 接続待ちのときにキーが押されたら、すぐ接続できるように高速バーストに戻す
+        sm_adv_reset();
+        break;
+
+    case EVENT_DFU_STARTED:
+        set_dfu_mode(true);
+        break;
+
+    case EVENT_DFU_STOPPED:
+        set_dfu_mode(false);
+        break;
+
+#if defined(CONFIG_MCUMGR)
+    case EVENT_DFU_CONFIRM:
+        dfu_confirm_image();
+        break;
+#endif
+
+    case EVENT_GESTURE_TIMEOUT:
+        gesture_timeout();
+        break;
+
+    case EVENT_HOST_SYNC:
+        host_sync_all();
+        break;
+
+#if defined(CONFIG_BT_CENTRAL)
+    case EVENT_HUB_REPORT:
+        // 子機のキーが変わったので、まとめたレポートをホストに送る
+        hub_report_sent(key_report_send());
+        break;
+#endif
+
+    case EVENT_ADV_SCHEDULE:
+        sm_adv_advance();
+        break;
 
-    // タイマーを設定してタイムアウトを待つ
-    k_timer_start(&pairing_timeout_timer, K_MSEC(PAIRING_TIMEOUT_MS), K_NO_WAIT);
-    check_adv();
+    case EVENT_ADV_RETRY:
+        sm_adv_retry();
+        break;
+
+#if defined(CONFIG_USB_DEVICE_HID)
+    case EVENT_USB_ATTACHED:
+        // 送信先の切り替えと BLE の切断は SM_USB に入るとき (usb_state_changed) に行う
+        sm_event(SM_EV_USB_ATTACHED);
+        break;
+
+    case EVENT_USB_DETACHED:
+        sm_event(SM_EV_USB_DETACHED);
+        break;
+#endif
+
+    case EVENT_FAST_MODE_TIMEOUT:
+        set_ble_speed(false);
+        // しばらく操作がないので、ストレージの保守をするならここで
+        if (IS_ENABLED(CONFIG_SETTINGS) && !dfu_active && sm_state() != SM_PAIRING) {
+            storage_idle();
+        }
+        break;
+    }
+
+#if defined(CONFIG_BT_CENTRAL)
+    // 子機の登録はホストのペアリングと同じく、ペアリングモードの間だけ受け付ける
+    hub_set_enrolling(sm_state() == SM_PAIRING || sm_state() == SM_CONFIRM);
+#endif
 }
 
+// 初期化の後半。RTT が接続するのを待ってからアドバタイズとイベントの処理を始める
+static void start_work_handler(struct k_work *work) {
+    // スレッドの情報を表示
+    DEBUG_PRINT_THREAD_INFO();
 
+    // 初期化後すぐにアドバタイズを開始します
+#if defined(CONFIG_USB_DEVICE_HID)
+    sm_init(usb_state_changed);
+#else
+    sm_init(NULL);
+#endif
 
-int main(void) {
-    int err;
-    uint8_t keycode;
-    uint8_t event;
+#if defined(CONFIG_BT_CENTRAL)
+    // ハブモードでは子機を探して接続する
+    hub_start();
+#endif
 
-    printk("SmallKB booted\n");
+    if (IS_ENABLED(CONFIG_SETTINGS)) {
+        storage_load_deferred();
+    }
 
-    k_mutex_init(&cm_mutex);
+#if USE_STRESS_TEST
+    stress_test_start();
+#endif
 
-    init_gpio_dev();
+    // 初期化中に溜まったイベントから処理を始める
+    events_start(handle_event);
+}
 
-    set_led(0);
+static K_WORK_DELAYABLE_DEFINE(start_work, start_work_handler);
 
-    hid_init();
+// 初期化の前半。入力が安定してから DIPSW を読み、BLE を有効にする
+static void boot_work_handler(struct k_work *work) {
+    int err;
 
     // 起動時に keycode を読み込む
-    k_msleep(100UL); // 入力が安定するまでのダミーウェイト
     keycode = get_dipsw();
     printk("Key code : 0x%02x (%d)\n", keycode, keycode);
 
     register_pairing_button_cb(pairing_button_callback);
+    gesture_init(keycode, gesture_emit);
     register_key_press_cb(key_press_callback);
 
     err = bt_enable(NULL);
     if (err) {
         printk("bt_enable() failed (err %d)\n", err);
-        return 0;
+        return;
     }
 
     printk("Bluetooth initialized\n");
+    ctlr_bench_init();
+    press_time_init();
 
     if (IS_ENABLED(CONFIG_SETTINGS)) {
-        settings_load();
+        // 前回の起動時からデータベースが変わっていないかを確かめる
+        const struct bt_gatt_attr *reports[] = {
+            &hids_obj.gp.svc.attrs[hids_obj.inp_rep_group.reports[0].att_ind],
+            &hids_obj.gp.svc.attrs[hids_obj.boot_kb_inp_rep.att_ind],
+        };
+        gatt_cache_check(reports, ARRAY_SIZE(reports));
+        // 再接続に必要なものだけを読み込み、残りはアドバタイズ開始後に読む
+        storage_load_boot();
     }
 
+#if defined(CONFIG_MCUMGR)
+    dfu_init();
+#endif
+
     bt_conn_cb_register(&conn_callbacks);
     bt_conn_auth_cb_register(&conn_auth_callbacks);         // conn_auth_callbacksの登録
     bt_conn_auth_info_cb_register(&conn_auth_info_callbacks); // conn_auth_info_callbacksの登
 
     // RTTが接続するまで待つ
-    k_msleep(5000UL);
+    k_work_schedule(&start_work, K_MSEC(5000));
+}
 
-    // スレッドの情報を表示
-    DEBUG_PRINT_THREAD_INFO();
+static K_WORK_DELAYABLE_DEFINE(boot_work, boot_work_handler);
 
-    // 初期化後すぐにアドバタイズを開始します
-    check_adv();
-
-    while (true) {
-        if (k_msgq_get(&event_queue, &event, K_FOREVER) == 0) {
-            switch (event) {
-            case EVENT_PAIRING_BUTTON_PRESS:
-                if(is_waiting_confirm) {
-                    confirm_all();
-                    check_adv();
-                }
-                else if (!is_waiting_pairing) {
-                    start_pairing_and_timer();
-                }
-                break;
+// メインスレッドは初期化の入口だけを受け持つ。bt_enable() と設定の読み込み (boot_work)、
+// アドバタイズの開始とメインループ (start_work) はシステムワークキューで動かすので、
+// メインスレッドのスタック (CONFIG_MAIN_STACK_SIZE) は下の処理が収まる大きさに減らしてある
+int main(void) {
+    printk("SmallKB booted\n");
 
-            case EVENT_PAIRING_TIMEOUT:
-                if (is_waiting_pairing) {
-                    printk("Pairing timeout\n");
-                    is_waiting_pairing = false;
-                    check_adv();
-                }
-                break;
+    k_mutex_init(&cm_mutex);
 
-            case EVENT_KEY_PRESS:
-            case EVENT_KEY_RELEASE:
-                printk("%d Key %s: %02x\n", k_uptime_get_32(),
-                  (event == EVENT_KEY_PRESS) ? "Pressed" : "Released", keycode);
-                if(event == EVENT_KEY_PRESS)
-                {
-                    key_code = keycode;
-                    key_pressed = true;
-                }
-                else
-                {
-                    key_code = 0;
-                    key_pressed = false;
-                }
-                set_ble_speed(true);
-                reset_fast_mode_timeout_timer();
-                key_report_send();
-                break;
+    init_gpio_dev();
 
-#if USE_KEY_RESEND
-            case EVENT_KEY_STATUS_RESEND:
-                printk("resending keycode\n");
-                key_report_send();
-                break;
+    set_led(0);
+
+    hid_init();
+#if defined(CONFIG_USB_DEVICE_HID)
+    // VBUS を検出してホストに認識されたら有線に切り替える
+    usb_transport_init(report_map, sizeof(report_map));
 #endif
-            case EVENT_CHECK_ADV_COND:
-                check_adv();
-                break;
 
-            case EVENT_FAST_MODE_TIMEOUT:
-                set_ble_speed(false);
-                break;
-            }
-        }
-    }
+    // 入力が安定するまで待ってから続ける
+    k_work_schedule(&boot_work, K_MSEC(100));
+
+#if defined(CONFIG_INIT_STACKS)
+    stack_usage_main_done();
+#endif
+    return 0;
 }
 
 /* End of main.c */
@@ -0,0 +1,283 @@
+/* This file is metrics.c, runtime performance counters exposed through a vendor GATT service */
+
+#include "includes.h"
+#include <string.h>
+#include <zephyr/sys/atomic.h>
+#include "events.h"
+#include "metrics.h"
+
+static const uint32_t latency_bounds_us[METRICS_LATENCY_BUCKETS - 1] = METRICS_LATENCY_BOUNDS_US;
+
+// ホストごとのカウンタ。アドレスの割り当ては接続/切断時だけなのでスピンロックで、
+// カウンタは送信のたびに更新するので atomic で扱う
+static struct host_metrics {
+    bt_addr_le_t addr;
+    bool valid;
+    bool disconnected;          // 切断されて再接続を待っている
+    uint32_t disconnected_at;   // 切断した時刻 (ms)
+    atomic_t send_ok;
+    atomic_t send_fail;
+    atomic_t reconnects;
+} hosts[METRICS_HOST_MAX];
+static uint8_t host_next;   // 次に上書きする hosts のインデックス
+static struct k_spinlock lock;
+
+// 接続 (bt_conn_index()) ごとに、対応する hosts のインデックス + 1 (0 なら未割り当て)
+static atomic_t conn_host[CONFIG_BT_MAX_CONN];
+
+static atomic_t latency_hist[METRICS_LATENCY_BUCKETS];
+
+// モードは atomic で読めるようにし、時間の集計はスピンロックで保護する
+static atomic_t mode = ATOMIC_INIT(METRICS_MODE_SLOW);
+static uint32_t mode_since;     // 現在のモードの集計を始めた時刻 (ms)
+static uint32_t mode_time_ms[METRICS_MODE_COUNT];
+
+static atomic_t reconnects;
+static atomic_t reconnect_sum_ms;
+static atomic_t reconnect_max_ms;
+
+static uint32_t period_start;   // 前回リセットした時刻 (ms、スピンロックで保護する)
+
+// GATT の読み出し用のスナップショット (下の GATT サービスを参照)。
+// 読み出しは接続ごとに BT の RX スレッドから順に来るので、接続ごとのバッファにロックは要らない
+static struct metrics_snapshot gatt_snap[CONFIG_BT_MAX_CONN];
+static bool gatt_snap_held[CONFIG_BT_MAX_CONN];   // リセット直前の値を次の読み出しまで取っておく
+
+// 最大値を更新する
+static void atomic_max(atomic_t *target, atomic_val_t value)
+{
+    atomic_val_t cur;
+    do {
+        cur = atomic_get(target);
+        if (cur >= value) return;
+    } while (!atomic_cas(target, cur, value));
+}
+
+// 値を読む。reset が真なら同時にゼロに戻す
+static uint32_t take(atomic_t *target, bool reset)
+{
+    return reset ? atomic_clear(target) : atomic_get(target);
+}
+
+void metrics_report_sent(struct bt_conn *conn, int err)
+{
+    atomic_val_t h = atomic_get(&conn_host[bt_conn_index(conn)]);
+
+    if (h) {
+        atomic_inc(err ? &hosts[h - 1].send_fail : &hosts[h - 1].send_ok);
+    }
+}
+
+void metrics_key_latency(uint32_t us)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(latency_bounds_us); i++) {
+        if (us < latency_bounds_us[i]) break;
+    }
+    atomic_inc(&latency_hist[i]);
+}
+
+void metrics_set_mode(enum metrics_mode new_mode)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t now = k_uptime_get_32();
+    atomic_val_t old = atomic_set(&mode, new_mode);
+
+    mode_time_ms[old] += now - mode_since;
+    mode_since = now;
+    k_spin_unlock(&lock, key);
+}
+
+enum metrics_mode metrics_get_mode(void)
+{
+    return (enum metrics_mode)atomic_get(&mode);
+}
+
+void metrics_connected(struct bt_conn *conn)
+{
+    const bt_addr_le_t *addr = bt_conn_get_dst(conn);
+    uint32_t now = k_uptime_get_32();
+    struct host_metrics *h = NULL;
+    size_t i;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (i = 0; i < ARRAY_SIZE(hosts); i++) {
+        if (hosts[i].valid && bt_addr_le_eq(&hosts[i].addr, addr)) {
+            h = &hosts[i];
+            break;
+        }
+    }
+    if (!h) {
+        // 新しいホスト。いちばん古いエントリを使う
+        i = host_next;
+        host_next = (host_next + 1) % ARRAY_SIZE(hosts);
+        h = &hosts[i];
+        bt_addr_le_copy(&h->addr, addr);
+        h->valid = true;
+        h->disconnected = false;
+        atomic_clear(&h->send_ok);
+        atomic_clear(&h->send_fail);
+        atomic_clear(&h->reconnects);
+    }
+
+    if (h->disconnected) {
+        uint32_t ms = now - h->disconnected_at;
+        h->disconnected = false;
+        atomic_inc(&h->reconnects);
+        atomic_inc(&reconnects);
+        atomic_add(&reconnect_sum_ms, ms);
+        atomic_max(&reconnect_max_ms, ms);
+    }
+    atomic_set(&conn_host[bt_conn_index(conn)], i + 1);
+    k_spin_unlock(&lock, key);
+}
+
+void metrics_disconnected(struct bt_conn *conn)
+{
+    atomic_val_t h = atomic_clear(&conn_host[bt_conn_index(conn)]);
+
+    // 取っておいたリセット直前の値は、同じ番号の次の接続には返さない
+    gatt_snap_held[bt_conn_index(conn)] = false;
+
+    if (h) {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        hosts[h - 1].disconnected = true;
+        hosts[h - 1].disconnected_at = k_uptime_get_32();
+        k_spin_unlock(&lock, key);
+    }
+}
+
+void metrics_snapshot(struct metrics_snapshot *snap, bool reset)
+{
+    struct event_queue_stats qs;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->version = METRICS_SNAPSHOT_VERSION;
+    snap->host_count = METRICS_HOST_MAX;
+    snap->latency_buckets = METRICS_LATENCY_BUCKETS;
+    snap->mode_count = METRICS_MODE_COUNT;
+
+    // 読み出しとリセットの間に他の値が変わらないよう、全体を一つのロックの中で行う
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t now = k_uptime_get_32();
+
+    snap->uptime_ms = now;
+    snap->period_ms = now - period_start;
+    if (reset) period_start = now;
+
+    if (reset) {
+        take_event_queue_stats(&qs);
+    } else {
+        get_event_queue_stats(&qs);
+    }
+    snap->queue_posted = qs.posted;
+    snap->queue_dropped = qs.dropped;
+    snap->queue_high_water = qs.high_water;
+    snap->queue_capacity = qs.capacity;
+
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        snap->latency_hist[i] = take(&latency_hist[i], reset);
+    }
+
+    // 現在のモードの経過時間は、モードを変えずに足して読む
+    atomic_val_t cur = atomic_get(&mode);
+    for (int i = 0; i < METRICS_MODE_COUNT; i++) {
+        snap->mode_time_ms[i] = mode_time_ms[i] + (i == cur ? now - mode_since : 0);
+        if (reset) mode_time_ms[i] = 0;
+    }
+    if (reset) mode_since = now;
+
+    uint32_t sum = take(&reconnect_sum_ms, reset);
+    snap->reconnects = take(&reconnects, reset);
+    snap->reconnect_avg_ms = snap->reconnects ? sum / snap->reconnects : 0;
+    snap->reconnect_max_ms = take(&reconnect_max_ms, reset);
+
+    // ホストはアドレスを出さず、エントリの番号だけで区別する
+    for (int i = 0; i < METRICS_HOST_MAX; i++) {
+        snap->hosts[i].valid = hosts[i].valid;
+        snap->hosts[i].send_ok = take(&hosts[i].send_ok, reset);
+        snap->hosts[i].send_fail = take(&hosts[i].send_fail, reset);
+        snap->hosts[i].reconnects = take(&hosts[i].reconnects, reset);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void metrics_print(void)
+{
+    static const char *const mode_names[METRICS_MODE_COUNT] = { "slow", "fast", "dfu" };
+    struct metrics_snapshot snap;
+
+    metrics_snapshot(&snap, false);
+    printk("metrics: uptime %u ms, queue %u posted %u dropped hw %u/%u, reconnects %u avg %u ms max %u ms\n",
+        snap.uptime_ms, snap.queue_posted, snap.queue_dropped, snap.queue_high_water,
+        snap.queue_capacity, snap.reconnects, snap.reconnect_avg_ms, snap.reconnect_max_ms);
+    for (int i = 0; i < METRICS_MODE_COUNT; i++) {
+        printk("metrics: mode %s %u ms\n", mode_names[i], snap.mode_time_ms[i]);
+    }
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        if (i < ARRAY_SIZE(latency_bounds_us)) {
+            printk("metrics: latency < %u us: %u\n", latency_bounds_us[i], snap.latency_hist[i]);
+        } else {
+            printk("metrics: latency >= %u us: %u\n", latency_bounds_us[i - 1], snap.latency_hist[i]);
+        }
+    }
+    for (int i = 0; i < METRICS_HOST_MAX; i++) {
+        if (snap.hosts[i].send_ok || snap.hosts[i].send_fail) {
+            printk("metrics: host %d sent %u failed %u reconnects %u\n", i,
+                snap.hosts[i].send_ok, snap.hosts[i].send_fail, snap.hosts[i].reconnects);
+        }
+    }
+}
+
+
+// GATT サービス
+// スナップショットは MTU より大きくなり得るので、オフセット 0 の読み出しのときだけ取り直し、
+// 続きの読み出し (Read Blob) では同じ内容を返す。途中で他の接続の読み出しに
+// 上書きされないよう、バッファは接続ごとに持つ
+//
+// リセットは書き込み (0x01) で行う。リセットの直前の値をその接続のバッファに取っておき、
+// 次のスナップショットの読み出しで返すので、読み出しとリセットの間の分も失われない
+static struct bt_uuid_128 metrics_svc_uuid = BT_UUID_INIT_128(METRICS_UUID_ENCODE(0));
+static struct bt_uuid_128 metrics_snapshot_uuid = BT_UUID_INIT_128(METRICS_UUID_ENCODE(1));
+static struct bt_uuid_128 metrics_reset_uuid = BT_UUID_INIT_128(METRICS_UUID_ENCODE(3));
+
+static ssize_t read_snapshot(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                             void *buf, uint16_t len, uint16_t offset)
+{
+    uint8_t idx = bt_conn_index(conn);
+
+    if (offset == 0) {
+        if (gatt_snap_held[idx]) {
+            gatt_snap_held[idx] = false;
+        } else {
+            metrics_snapshot(&gatt_snap[idx], false);
+        }
+    }
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &gatt_snap[idx], sizeof(gatt_snap[idx]));
+}
+
+static ssize_t write_reset(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                           const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    uint8_t idx = bt_conn_index(conn);
+
+    if (offset != 0) return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (len != 1 || *(const uint8_t *)buf != 0x01) return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+
+    metrics_snapshot(&gatt_snap[idx], true);
+    gatt_snap_held[idx] = true;
+    return len;
+}
+
+// 読み出し・リセットとも暗号化された接続 (ボンディング済みのホスト) からのみ許可する
+BT_GATT_SERVICE_DEFINE(metrics_svc,
+    BT_GATT_PRIMARY_SERVICE(&metrics_svc_uuid.uuid),
+    BT_GATT_CHARACTERISTIC(&metrics_snapshot_uuid.uuid, BT_GATT_CHRC_READ,
+                           BT_GATT_PERM_READ_ENCRYPT, read_snapshot, NULL, NULL),
+    BT_GATT_CHARACTERISTIC(&metrics_reset_uuid.uuid, BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_WRITE_ENCRYPT, NULL, write_reset, NULL),
+);
+
+
+/* End of metrics.c */
@@ -0,0 +1,76 @@
+/* This file is metrics.h, runtime performance counters exposed through a vendor GATT service */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// ベンダー UUID のベース (最後のフィールドで区別する)
+#define METRICS_UUID_ENCODE(n) BT_UUID_128_ENCODE(0x0ce10000 + (n), 0x1145, 0x4419, 0x8a5e, 0x536d616c6c4b)
+
+// 統計を取るホストの数 (ボンディングできる数 + 未ボンディングの接続用に 1 つ)
+#define METRICS_HOST_MAX (CONFIG_BT_MAX_PAIRED + 1)
+
+// キー入力からレポート送信までの遅延のヒストグラムの区切り (us)。最後のバケットはそれ以上すべて
+#define METRICS_LATENCY_BOUNDS_US { 1000, 2000, 5000, 10000, 20000, 50000, 100000 }
+#define METRICS_LATENCY_BUCKETS 8
+
+// 接続パラメータのモード
+enum metrics_mode {
+    METRICS_MODE_SLOW,
+    METRICS_MODE_FAST,
+    METRICS_MODE_DFU,
+
+    METRICS_MODE_COUNT
+};
+
+// GATT で読み出すスナップショット (リトルエンディアン)
+#define METRICS_SNAPSHOT_VERSION 2
+
+// ホストのアドレスは出さない (エントリの番号で区別する)
+struct metrics_host {
+    uint8_t valid;              // 使用中のエントリなら 1
+    uint32_t send_ok;           // レポートの送信に成功した数
+    uint32_t send_fail;         // 同失敗した数
+    uint32_t reconnects;        // 再接続の回数
+} __packed;
+
+struct metrics_snapshot {
+    uint8_t version;
+    uint8_t host_count;
+    uint8_t latency_buckets;
+    uint8_t mode_count;
+    uint32_t uptime_ms;
+    uint32_t period_ms;                 // 前回のリセットからの時間
+    uint32_t queue_posted;
+    uint32_t queue_dropped;
+    uint16_t queue_high_water;
+    uint16_t queue_capacity;
+    uint32_t latency_hist[METRICS_LATENCY_BUCKETS];
+    uint32_t mode_time_ms[METRICS_MODE_COUNT];
+    uint32_t reconnects;
+    uint32_t reconnect_avg_ms;          // 切断から再接続までの時間
+    uint32_t reconnect_max_ms;
+    struct metrics_host hosts[METRICS_HOST_MAX];
+} __packed;
+
+// 以下はどのスレッド・ISR からも呼び出し可能 (atomic かスピンロックで更新する)
+void metrics_report_sent(struct bt_conn *conn, int err);
+void metrics_key_latency(uint32_t us);
+void metrics_set_mode(enum metrics_mode mode);
+enum metrics_mode metrics_get_mode(void);
+
+// 接続/切断時に BT のコールバックから呼ぶ
+void metrics_connected(struct bt_conn *conn);
+void metrics_disconnected(struct bt_conn *conn);
+
+// スナップショットを取る。reset が真なら、取った値を同じロックの中でゼロに戻す
+void metrics_snapshot(struct metrics_snapshot *snap, bool reset);
+void metrics_print(void);
+
+#endif /* METRICS_H_ */
+
+
+/* End of metrics.h */
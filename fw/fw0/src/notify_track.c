@@ -0,0 +1,133 @@
+/* This file is notify_track.c, per-connection record of key report notifications awaiting completion */
+
+#include "includes.h"
+#include "notify_track.h"
+
+// 接続ごとの送信完了待ち (bt_conn_index() で引く)
+static struct track_conn {
+    struct bt_conn *conn;
+    uint8_t head;               // 最も古いエントリ
+    uint8_t count;              // 送信完了待ちの数
+    bool added_by_last;         // 最後の送信で積んだ (失敗したら取り消す)
+    struct notify_track q[NOTIFY_TRACK_MAX];
+} tc[CONFIG_BT_MAX_CONN];
+
+// 送信はメインループから、完了は BT のスレッドから、状態の問い合わせは他のモジュールの
+// スピンロックの中から呼ばれるので、ブロックしないスピンロックで保護する
+static struct k_spinlock lock;
+
+void notify_track_connected(struct bt_conn *conn)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    t->conn = conn;
+    t->head = 0;
+    t->count = 0;
+    t->added_by_last = false;
+    k_spin_unlock(&lock, key);
+}
+
+void notify_track_disconnected(struct bt_conn *conn)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn) {
+        t->conn = NULL;
+        t->count = 0;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+bool notify_track_sending(struct bt_conn *conn, struct notify_track *n)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+    bool added = false;
+
+    n->sent_ms = k_uptime_get_32();
+    n->sent_cycles = k_cycle_get_32();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn && t->count < NOTIFY_TRACK_MAX) {
+        t->q[(t->head + t->count) % NOTIFY_TRACK_MAX] = *n;
+        t->count++;
+        added = true;
+    }
+    t->added_by_last = added;
+    k_spin_unlock(&lock, key);
+    return added;
+}
+
+bool notify_track_sent(struct bt_conn *conn, int err)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+    bool dropped = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn && err && t->added_by_last && t->count) {
+        // 送れなかったものは完了しないので、最後に積んだもの (最も新しい) を降ろす
+        t->count--;
+        dropped = true;
+    }
+    t->added_by_last = false;
+    k_spin_unlock(&lock, key);
+    return dropped;
+}
+
+bool notify_track_peek(struct bt_conn *conn, struct notify_track *n)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+    bool found = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn && t->count) {
+        *n = t->q[t->head];
+        found = true;
+    }
+    k_spin_unlock(&lock, key);
+    return found;
+}
+
+void notify_track_done(struct bt_conn *conn)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn && t->count) {
+        t->head = (t->head + 1) % NOTIFY_TRACK_MAX;
+        t->count--;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+int notify_track_count(struct bt_conn *conn)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+    int count = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn) {
+        count = t->count;
+    }
+    k_spin_unlock(&lock, key);
+    return count;
+}
+
+bool notify_track_any_pressed(struct bt_conn *conn)
+{
+    struct track_conn *t = &tc[bt_conn_index(conn)];
+    bool pressed = false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t->conn == conn) {
+        for (uint8_t k = 0; k < t->count && !pressed; k++) {
+            pressed = t->q[(t->head + k) % NOTIFY_TRACK_MAX].pressed;
+        }
+    }
+    k_spin_unlock(&lock, key);
+    return pressed;
+}
+
+
+/* End of notify_track.c */
@@ -0,0 +1,46 @@
+/* This file is notify_track.h, per-connection record of key report notifications awaiting completion */
+
+#ifndef NOTIFY_TRACK_H_
+#define NOTIFY_TRACK_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+#define NOTIFY_TRACK_MAX 8      // 接続ごとに覚えておく送信完了待ちの数 (ATT の送信バッファ数より多ければよい)
+
+// 送信完了待ちのレポート 1 つの記録。通知は送信した順に完了する
+struct notify_track {
+    uint32_t sent_ms;           // 送信を要求した時刻 (k_uptime_get_32())
+    uint32_t sent_cycles;       // 同じ時刻 (k_cycle_get_32())
+    uint32_t edge_cycles;       // レポートの元になったキーのエッジの時刻 (0 ならキー入力によらない送信)
+    bool pressed;               // ホストが受け取る状態が押下
+    bool replay;                // 届かなかったキー入力の再送
+};
+
+// 接続/切断時に BT のコールバックから呼ぶ (切断時は他のモジュールより後に呼ぶこと)
+void notify_track_connected(struct bt_conn *conn);
+void notify_track_disconnected(struct bt_conn *conn);
+
+// レポートの送信を要求する直前に呼ぶ。時刻を埋めて積み、積めたら真を返す (あふれたら積まない)。
+// 送信完了コールバックが送信の要求から戻る前に呼ばれても対応がずれないよう、必ず先に積むこと
+bool notify_track_sending(struct bt_conn *conn, struct notify_track *n);
+
+// 送信を要求したあとに結果と共に呼ぶ。失敗していれば最後に積んだもの (完了しない) を降ろして真を返す
+bool notify_track_sent(struct bt_conn *conn, int err);
+
+// 送信完了コールバックで、完了したもの (最も古いもの) を見る。なければ偽を返す。
+// 各モジュールに渡したあとで notify_track_done() で降ろす
+bool notify_track_peek(struct bt_conn *conn, struct notify_track *n);
+void notify_track_done(struct bt_conn *conn);
+
+// 送信完了待ちの数
+int notify_track_count(struct bt_conn *conn);
+
+// 押下の状態を送信中かどうか
+bool notify_track_any_pressed(struct bt_conn *conn);
+
+#endif /* NOTIFY_TRACK_H_ */
+
+
+/* End of notify_track.h */
@@ -0,0 +1,134 @@
+/* This file is pair_timing.c, LE Secure Connections pairing phase timing */
+
+#include "includes.h"
+#include <string.h>
+#include "pair_timing.h"
+
+// 接続ごとの記録 (bt_conn_index() で引く)
+static struct pair_conn {
+    struct bt_conn *conn;
+    bool active;                // ペアリング中
+    uint8_t reached;            // 記録した段階のビット
+    uint32_t connect_ms;
+    uint32_t at_ms[PAIR_PHASE_COUNT];   // 接続からの時間
+} pt[CONFIG_BT_MAX_CONN];
+
+// BT のコールバックとメインループから呼ばれるのでスピンロックで保護する
+static struct k_spinlock lock;
+
+static struct pair_timing_stats stats;
+static uint64_t phase_sum_ms[PAIR_PHASE_COUNT];
+static uint32_t phase_count[PAIR_PHASE_COUNT];
+static uint64_t total_sum_ms;
+
+static const char *const phase_names[PAIR_PHASE_COUNT] = {
+    [PAIR_PHASE_REQUEST] = "request",
+    [PAIR_PHASE_CONFIRM_REQUEST] = "confirm request",
+    [PAIR_PHASE_USER_CONFIRM] = "user confirm",
+    [PAIR_PHASE_ENCRYPTED] = "encrypted",
+    [PAIR_PHASE_COMPLETE] = "complete",
+};
+
+void pair_timing_connected(struct bt_conn *conn)
+{
+    struct pair_conn *p = &pt[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    p->conn = conn;
+    p->active = false;
+    p->reached = 0;
+    p->connect_ms = k_uptime_get_32();
+    k_spin_unlock(&lock, key);
+}
+
+void pair_timing_phase(struct bt_conn *conn, enum pair_phase phase)
+{
+    struct pair_conn *p = &pt[bt_conn_index(conn)];
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (p->conn == conn) {
+        if (phase == PAIR_PHASE_REQUEST) {
+            p->active = true;
+            p->reached = 0;
+        }
+        if (p->active && !(p->reached & BIT(phase))) {
+            p->at_ms[phase] = k_uptime_get_32() - p->connect_ms;
+            p->reached |= BIT(phase);
+        }
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void pair_timing_end(struct bt_conn *conn, bool success)
+{
+    struct pair_conn *p = &pt[bt_conn_index(conn)];
+    uint32_t at_ms[PAIR_PHASE_COUNT];
+    uint8_t reached;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (p->conn != conn || !p->active) {
+        k_spin_unlock(&lock, key);
+        return;
+    }
+    p->active = false;
+    if (success) {
+        p->at_ms[PAIR_PHASE_COMPLETE] = k_uptime_get_32() - p->connect_ms;
+        p->reached |= BIT(PAIR_PHASE_COMPLETE);
+    }
+    reached = p->reached;
+    memcpy(at_ms, p->at_ms, sizeof(at_ms));
+
+    if (success) {
+        // 記録した段階ごとに、その前の段階からの時間を集計する
+        uint32_t prev = 0;
+        for (int i = 0; i < PAIR_PHASE_COUNT; i++) {
+            if (!(reached & BIT(i))) continue;
+            uint32_t ms = at_ms[i] - prev;
+            phase_sum_ms[i] += ms;
+            phase_count[i]++;
+            if (ms > stats.phases[i].max_ms) stats.phases[i].max_ms = ms;
+            prev = at_ms[i];
+        }
+        stats.completed++;
+        total_sum_ms += at_ms[PAIR_PHASE_COMPLETE];
+        if (at_ms[PAIR_PHASE_COMPLETE] > stats.total_max_ms) stats.total_max_ms = at_ms[PAIR_PHASE_COMPLETE];
+    } else {
+        stats.failed++;
+    }
+    k_spin_unlock(&lock, key);
+
+    printk("Pairing %s:", success ? "timing" : "failed after");
+    for (int i = 0; i < PAIR_PHASE_COUNT; i++) {
+        if (reached & BIT(i)) {
+            printk(" %s %u ms,", phase_names[i], at_ms[i]);
+        }
+    }
+    printk(" (from connect)\n");
+}
+
+void pair_timing_get_stats(struct pair_timing_stats *st)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *st = stats;
+    st->total_avg_ms = stats.completed ? (uint32_t)(total_sum_ms / stats.completed) : 0;
+    for (int i = 0; i < PAIR_PHASE_COUNT; i++) {
+        st->phases[i].avg_ms = phase_count[i] ? (uint32_t)(phase_sum_ms[i] / phase_count[i]) : 0;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void pair_timing_print_stats(void)
+{
+    struct pair_timing_stats st;
+
+    pair_timing_get_stats(&st);
+    printk("pairing: completed %u failed %u, total avg %u ms max %u ms\n",
+        st.completed, st.failed, st.total_avg_ms, st.total_max_ms);
+    if (!st.completed) return;
+    for (int i = 0; i < PAIR_PHASE_COUNT; i++) {
+        printk("pairing phase %s: avg %u ms max %u ms\n", phase_names[i], st.phases[i].avg_ms, st.phases[i].max_ms);
+    }
+}
+
+
+/* End of pair_timing.c */
@@ -0,0 +1,47 @@
+/* This file is pair_timing.h, LE Secure Connections pairing phase timing */
+
+#ifndef PAIR_TIMING_H_
+#define PAIR_TIMING_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+// ペアリングの段階 (記録する時刻)。
+// P-256 の鍵ペアはホストが bt_enable() の中で生成を始めるので、ここでは生成しない。
+// 鍵の生成を待ったかどうかは、要求から確認要求までの時間 (公開鍵の交換を含む) に現れる
+enum pair_phase {
+    PAIR_PHASE_REQUEST,         // ペアリング要求を受け付けた (pairing_accept)
+    PAIR_PHASE_CONFIRM_REQUEST, // 公開鍵の交換が終わり、数値比較の確認を求められた
+    PAIR_PHASE_USER_CONFIRM,    // ペアリングボタンで確認した
+    PAIR_PHASE_ENCRYPTED,       // DHKey の確認が終わり、暗号化された
+    PAIR_PHASE_COMPLETE,        // 鍵の配布が終わり、ペアリングが完了した
+
+    PAIR_PHASE_COUNT
+};
+
+struct pair_phase_stats {
+    uint32_t avg_ms;            // 前の段階からの時間
+    uint32_t max_ms;
+};
+
+struct pair_timing_stats {
+    uint32_t completed;
+    uint32_t failed;
+    uint32_t total_avg_ms;      // 接続からペアリング完了まで
+    uint32_t total_max_ms;
+    struct pair_phase_stats phases[PAIR_PHASE_COUNT];
+};
+
+// 以下は BT のコールバック (USER_CONFIRM はメインループ) から呼ぶ
+void pair_timing_connected(struct bt_conn *conn);
+void pair_timing_phase(struct bt_conn *conn, enum pair_phase phase);
+void pair_timing_end(struct bt_conn *conn, bool success);
+
+void pair_timing_get_stats(struct pair_timing_stats *stats);
+void pair_timing_print_stats(void);
+
+#endif /* PAIR_TIMING_H_ */
+
+
+/* End of pair_timing.h */
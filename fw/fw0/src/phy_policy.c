@@ -0,0 +1,289 @@
+/* This file is phy_policy.c, per-connection PHY selection policy */
+
+#include "includes.h"
+#include "link_monitor.h"
+#include "phy_policy.h"
+
+// L2CAP ヘッダ (4) + ATT Handle Value Notification ヘッダ (3) + MIC (4)
+#define NOTIFY_PDU_OVERHEAD 11
+
+// link_monitor.c の評価の何回に一度 PHY を選び直すか
+#define PHY_POLICY_TICKS MAX(1, PHY_POLICY_INTERVAL_MS / LINK_MONITOR_INTERVAL_MS)
+
+// 接続ごとの状態 (bt_conn_index() で引く)
+static struct phy_conn {
+    struct bt_conn *conn;
+    uint8_t phy;            // BT_GAP_LE_PHY_*
+    int16_t rssi;           // 平滑化した RSSI (dBm)
+    bool rssi_valid;
+    uint32_t fails;         // 評価間隔中の送信失敗数
+    uint8_t ticks;          // 前回 PHY を選んでからの link_monitor.c の評価の回数
+    int64_t phy_since;      // 現在の PHY になった時刻
+} pc[CONFIG_BT_MAX_CONN];
+static K_MUTEX_DEFINE(pc_mutex);
+static bool bulk;           // 大きなデータを転送中 (DFU)。電波が弱くなければ 2M を使う
+
+// 統計 (pc_mutex で保護)
+static uint32_t stat_time_ms[PHY_IDX_COUNT];
+static uint32_t stat_reports[PHY_IDX_COUNT];
+static uint32_t stat_airtime_us[PHY_IDX_COUNT];
+static uint32_t stat_latency_max_us[PHY_IDX_COUNT];
+static uint64_t stat_latency_sum_us[PHY_IDX_COUNT];
+static uint32_t stat_latency_count[PHY_IDX_COUNT];
+
+static const char *const phy_names[PHY_IDX_COUNT] = { "1M", "2M", "Coded" };
+
+static enum phy_index phy_to_index(uint8_t phy)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_2M:
+        return PHY_IDX_2M;
+    case BT_GAP_LE_PHY_CODED:
+        return PHY_IDX_CODED;
+    default:
+        return PHY_IDX_1M;
+    }
+}
+
+static const char *phy_to_str(uint8_t phy)
+{
+    return phy_names[phy_to_index(phy)];
+}
+
+// 1 パケットの送信時間 (us) の推定値。pdu_len は LL ヘッダを除いたペイロード長
+static uint32_t packet_airtime_us(uint8_t phy, size_t pdu_len)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_2M:
+        // プリアンブル 2 + アクセスアドレス 4 + ヘッダ 2 + ペイロード + CRC 3 バイト、4us/バイト
+        return (2 + 4 + 2 + pdu_len + 3) * 4;
+    case BT_GAP_LE_PHY_CODED:
+        // S=8: プリアンブル 80 + AA 256 + CI 16 + TERM1 24 + (ヘッダ+ペイロード+CRC)*64 + TERM2 24
+        return 80 + 256 + 16 + 24 + (2 + pdu_len + 3) * 64 + 24;
+    default:
+        // プリアンブル 1 + アクセスアドレス 4 + ヘッダ 2 + ペイロード + CRC 3 バイト、8us/バイト
+        return (1 + 4 + 2 + pdu_len + 3) * 8;
+    }
+}
+
+// 現在の PHY で接続していた時間を集計する (pc_mutex 取得済みで呼ぶこと)
+static void account_phy_time(struct phy_conn *p)
+{
+    int64_t now = k_uptime_get();
+    stat_time_ms[phy_to_index(p->phy)] += (uint32_t)(now - p->phy_since);
+    p->phy_since = now;
+}
+
+static int request_phy(struct bt_conn *conn, uint8_t phy)
+{
+    struct bt_conn_le_phy_param param = {
+        .options = BT_CONN_LE_PHY_OPT_NONE,
+        .pref_tx_phy = phy,
+        .pref_rx_phy = phy,
+    };
+
+    if (phy == BT_GAP_LE_PHY_CODED) {
+        param.options = BT_CONN_LE_PHY_OPT_CODED_S8;
+    }
+
+    int err = bt_conn_le_phy_update(conn, &param);
+    if (err) {
+        printk("bt_conn_le_phy_update(%s) failed (err %d)\n", phy_to_str(phy), err);
+    }
+    return err;
+}
+
+// RSSI と送信失敗数から、次に使うべき PHY を決める
+static uint8_t choose_phy(const struct phy_conn *p)
+{
+    bool weak = (p->rssi_valid && p->rssi < PHY_RSSI_LOW) || p->fails >= PHY_FAIL_LIMIT;
+    bool strong = p->rssi_valid && p->rssi > PHY_RSSI_HIGH && p->fails == 0;
+
+    if (weak) {
+        // 一段階ずつ遅い (遠くまで届く) PHY へ
+        if (p->phy == BT_GAP_LE_PHY_2M) return BT_GAP_LE_PHY_1M;
+        if (USE_CODED_PHY && IS_ENABLED(CONFIG_BT_CTLR_PHY_CODED)) return BT_GAP_LE_PHY_CODED;
+        return p->phy;
+    }
+    if (strong || bulk) {
+        return BT_GAP_LE_PHY_2M;
+    }
+    return p->phy;
+}
+
+void phy_policy_connected(struct bt_conn *conn)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    p->conn = bt_conn_ref(conn);
+    p->phy = BT_GAP_LE_PHY_1M;
+    p->rssi_valid = false;
+    p->fails = 0;
+    p->ticks = 0;
+    p->phy_since = k_uptime_get();
+    k_mutex_unlock(&pc_mutex);
+
+    // 小さなレポートでは 2M PHY の方が電波の送信時間が短くて済むので、まず 2M を要求する
+    request_phy(conn, BT_GAP_LE_PHY_2M);
+}
+
+void phy_policy_disconnected(struct bt_conn *conn)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    if (p->conn == conn) {
+        account_phy_time(p);
+        bt_conn_unref(p->conn);
+        p->conn = NULL;
+    }
+    k_mutex_unlock(&pc_mutex);
+}
+
+void phy_policy_set_bulk(bool on)
+{
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    bulk = on;
+    k_mutex_unlock(&pc_mutex);
+
+    for (size_t i = 0; i < ARRAY_SIZE(pc); i++) {
+        struct bt_conn *conn = NULL;
+        uint8_t want = 0;
+
+        k_mutex_lock(&pc_mutex, K_FOREVER);
+        if (pc[i].conn) {
+            conn = bt_conn_ref(pc[i].conn);
+            want = choose_phy(&pc[i]);
+            if (want == pc[i].phy) want = 0;
+        }
+        k_mutex_unlock(&pc_mutex);
+
+        if (!conn) continue;
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+        // 最大データ長は転送中だけ使う (ACL バッファはボードの defconfig で 251 にしてある)
+        int err = bt_conn_le_data_len_update(conn, on ? BT_LE_DATA_LEN_PARAM_MAX
+                                                      : BT_LE_DATA_LEN_PARAM_DEFAULT);
+        if (err) {
+            printk("bt_conn_le_data_len_update() failed (err %d)\n", err);
+        }
+#endif
+        // 転送の終わりは次の評価に任せる (電波が強ければ 2M のまま)
+        if (want) {
+            request_phy(conn, want);
+        }
+        bt_conn_unref(conn);
+    }
+}
+
+void phy_policy_tick(struct bt_conn *conn, int8_t rssi, bool rssi_valid)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+    uint8_t want = 0;
+    uint8_t cur = 0;
+    int16_t avg = 0;
+    uint32_t fails = 0;
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    if (p->conn == conn) {
+        if (rssi_valid) {
+            // 急な変化で PHY が行ったり来たりしないように平滑化する
+            p->rssi = p->rssi_valid ? (p->rssi * 3 + rssi) / 4 : rssi;
+            p->rssi_valid = true;
+        }
+        if (++p->ticks >= PHY_POLICY_TICKS) {
+            p->ticks = 0;
+            cur = p->phy;
+            avg = p->rssi;
+            fails = p->fails;
+            want = choose_phy(p);
+            if (want == p->phy) want = 0;
+            p->fails = 0;
+        }
+    }
+    k_mutex_unlock(&pc_mutex);
+
+    // 変えるときだけ表示する
+    if (want) {
+        printk("PHY policy: conn %d rssi %d fails %u phy %s -> %s\n", (int)bt_conn_index(conn),
+            avg, fails, phy_to_str(cur), phy_to_str(want));
+        request_phy(conn, want);
+    }
+}
+
+void phy_policy_updated(struct bt_conn *conn, uint8_t tx_phy)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    if (p->conn == conn) {
+        account_phy_time(p);
+        p->phy = tx_phy;
+    }
+    k_mutex_unlock(&pc_mutex);
+}
+
+void phy_policy_report_sent(struct bt_conn *conn, size_t len, int err)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    if (p->conn == conn) {
+        if (err) {
+            p->fails++;
+        } else {
+            enum phy_index idx = phy_to_index(p->phy);
+            stat_reports[idx]++;
+            stat_airtime_us[idx] += packet_airtime_us(p->phy, len + NOTIFY_PDU_OVERHEAD);
+        }
+    }
+    k_mutex_unlock(&pc_mutex);
+}
+
+void phy_policy_report_done(struct bt_conn *conn, const struct notify_track *n)
+{
+    struct phy_conn *p = &pc[bt_conn_index(conn)];
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - n->sent_cycles);
+
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    if (p->conn == conn) {
+        enum phy_index idx = phy_to_index(p->phy);
+        stat_latency_sum_us[idx] += us;
+        stat_latency_count[idx]++;
+        if (us > stat_latency_max_us[idx]) stat_latency_max_us[idx] = us;
+    }
+    k_mutex_unlock(&pc_mutex);
+}
+
+void phy_policy_get_stats(struct phy_stats stats[PHY_IDX_COUNT])
+{
+    k_mutex_lock(&pc_mutex, K_FOREVER);
+    for (size_t i = 0; i < ARRAY_SIZE(pc); i++) {
+        if (pc[i].conn) account_phy_time(&pc[i]);
+    }
+    for (int i = 0; i < PHY_IDX_COUNT; i++) {
+        stats[i].time_ms = stat_time_ms[i];
+        stats[i].reports = stat_reports[i];
+        stats[i].airtime_us = stat_airtime_us[i];
+        stats[i].latency_max_us = stat_latency_max_us[i];
+        stats[i].latency_avg_us =
+            stat_latency_count[i] ? (uint32_t)(stat_latency_sum_us[i] / stat_latency_count[i]) : 0;
+    }
+    k_mutex_unlock(&pc_mutex);
+}
+
+void phy_policy_print_stats(void)
+{
+    struct phy_stats stats[PHY_IDX_COUNT];
+
+    phy_policy_get_stats(stats);
+    for (int i = 0; i < PHY_IDX_COUNT; i++) {
+        printk("PHY %s: %u ms, %u reports, airtime %u us, latency avg %u us max %u us\n",
+            phy_names[i], stats[i].time_ms, stats[i].reports, stats[i].airtime_us,
+            stats[i].latency_avg_us, stats[i].latency_max_us);
+    }
+}
+
+
+/* End of phy_policy.c */
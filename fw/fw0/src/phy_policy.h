@@ -0,0 +1,64 @@
+/* This file is phy_policy.h, per-connection PHY selection policy */
+
+#ifndef PHY_POLICY_H_
+#define PHY_POLICY_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+#include "notify_track.h"
+
+// 電波が弱いときに Coded PHY (長距離) を使うかどうか。
+// nRF52832 は Coded PHY に対応していないので 0 にしておく
+#define USE_CODED_PHY 0
+
+#define PHY_POLICY_INTERVAL_MS 5000 // PHY を選び直す間隔 (link_monitor.c の評価の間隔の倍数)
+#define PHY_RSSI_LOW  (-80)         // RSSI (dBm) がこれを下回ったら遅い PHY へ
+#define PHY_RSSI_HIGH (-70)         // RSSI (dBm) がこれを上回ったら 2M PHY へ
+#define PHY_FAIL_LIMIT 2            // 評価間隔中の送信失敗がこれ以上ならリンク品質が悪いとみなす
+
+// 統計用の PHY の番号
+enum phy_index {
+    PHY_IDX_1M,
+    PHY_IDX_2M,
+    PHY_IDX_CODED,
+
+    PHY_IDX_COUNT
+};
+
+// PHY ごとの統計情報
+struct phy_stats {
+    uint32_t time_ms;           // この PHY で接続していた合計時間
+    uint32_t reports;           // 送信したレポート数
+    uint32_t airtime_us;        // レポート送信にかかった電波の送信時間 (推定値)
+    uint32_t latency_avg_us;    // レポート送信から送信完了までの時間
+    uint32_t latency_max_us;
+};
+
+void phy_policy_connected(struct bt_conn *conn);
+void phy_policy_disconnected(struct bt_conn *conn);
+
+// link_monitor.c がリンク状態を評価するたびに、読んだ RSSI (dBm) と共に呼ぶ (読めなければ rssi_valid が偽)。
+// PHY_POLICY_INTERVAL_MS ごとに PHY を選び直す。PHY の方針は自分のタイマーを持たない
+void phy_policy_tick(struct bt_conn *conn, int8_t rssi, bool rssi_valid);
+
+// PHY が変更されたときに呼ぶ (bt_conn_cb.le_phy_updated から)
+void phy_policy_updated(struct bt_conn *conn, uint8_t tx_phy);
+
+// 大きなデータの転送 (DFU) の開始/終了に呼ぶ。転送中は電波が弱くなければ 2M PHY を使い、
+// 最大データ長を要求する (CONFIG_BT_USER_DATA_LEN_UPDATE があれば)
+void phy_policy_set_bulk(bool on);
+
+// レポートを送信したあとに送信結果と共に呼ぶ
+void phy_policy_report_sent(struct bt_conn *conn, size_t len, int err);
+
+// レポートの送信完了コールバックで、完了したレポートの記録 (notify_track_peek() で見たもの) と共に呼ぶ
+void phy_policy_report_done(struct bt_conn *conn, const struct notify_track *n);
+
+void phy_policy_get_stats(struct phy_stats stats[PHY_IDX_COUNT]);
+void phy_policy_print_stats(void);
+
+#endif /* PHY_POLICY_H_ */
+
+
+/* End of phy_policy.h */
@@ -0,0 +1,333 @@
+/* This file is press_time.c, key edge timestamps mapped to the connection event timeline */
+
+#include "includes.h"
+#include <stdlib.h>
+#include "press_time.h"
+#if PRESS_TIME_ANCHOR
+#include <sdc_hci_vs.h>
+#include <hal/nrf_rtc.h>
+#include "hci_util.h"
+#endif
+
+static struct bt_uuid_128 press_svc_uuid = BT_UUID_INIT_128(PRESS_TIME_UUID_SVC_VAL);
+static struct bt_uuid_128 press_chr_uuid = BT_UUID_INIT_128(PRESS_TIME_UUID_CHR_VAL);
+
+// 最後のエッジ (読み出しには、読み出した接続のアンカーに対応づけて返す)。メインループからのみ更新される
+static uint8_t seq;
+static uint8_t last_flags;
+static uint32_t last_edge_cycles;
+
+static struct press_time_stats stats;
+
+// アンカーの報告は BT の RX スレッドから、対応づけと通知はメインループや BT のスレッドから呼ばれるので
+// アンカーと統計をスピンロックで保護する
+static struct k_spinlock lock;
+
+#if PRESS_TIME_ANCHOR
+
+// カーネルのサイクルカウンタは RTC1 のカウンタ値 (の拡張) なので、RTC0 を使うコントローラの時刻と
+// 同じ LFCLK で進む。両者の差を一度測っておけば、アンカーの時刻をサイクルカウンタ値に直せる
+BUILD_ASSERT(IS_ENABLED(CONFIG_NRF_RTC_TIMER) && CONFIG_SYS_CLOCK_HW_CYCLES_PER_SEC == 32768,
+             "press_time expects the RTC1 system timer");
+#define RTC_HZ 32768U
+#define RTC_MASK 0x00ffffffU            // RTC のカウンタは 24 ビット
+
+// 接続ごとの最後のアンカー (報告は接続ハンドルで届くのでハンドルで引く)
+static struct anchor {
+    bool valid;
+    uint16_t handle;
+    uint16_t counter;       // 接続イベントカウンタ
+    uint32_t cycles;        // アンカーの時刻 (サイクルカウンタ値、切り捨て)
+    uint16_t frac_us;       // cycles からアンカーまでの端数
+} anchors[CONFIG_BT_MAX_CONN];
+
+static uint32_t rtc_offset;     // RTC1 - RTC0 のカウンタの差
+
+static void measure_rtc_offset(void)
+{
+    uint32_t r0, r1, r0_after;
+
+    // 二つの RTC は同じクロックの同じエッジで進むので、RTC0 が変わらない間に読めば差は正確
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    do {
+        r0 = nrf_rtc_counter_get(NRF_RTC0);
+        r1 = nrf_rtc_counter_get(NRF_RTC1);
+        r0_after = nrf_rtc_counter_get(NRF_RTC0);
+    } while (r0 != r0_after);
+    rtc_offset = (r1 - r0) & RTC_MASK;
+    k_spin_unlock(&lock, key);
+}
+
+// 接続ハンドルのアンカーを探す (ロック取得済みで呼ぶこと)。alloc なら空きを割り当てる
+static struct anchor *find_anchor(uint16_t handle, bool alloc)
+{
+    struct anchor *free_slot = NULL;
+
+    for (size_t i = 0; i < ARRAY_SIZE(anchors); i++) {
+        if (anchors[i].valid && anchors[i].handle == handle) return &anchors[i];
+        if (!anchors[i].valid && !free_slot) free_slot = &anchors[i];
+    }
+    return alloc ? free_slot : NULL;
+}
+
+// ベンダー固有イベント (BT の RX スレッド)。接続イベントごとのアンカーの報告を記録する
+static bool vs_event(struct net_buf_simple *buf)
+{
+    const sdc_hci_subevent_vs_conn_anchor_point_update_report_t *evt;
+
+    if (buf->len < 1 + sizeof(*evt) ||
+        buf->data[0] != SDC_HCI_SUBEVENT_VS_CONN_ANCHOR_POINT_UPDATE_REPORT) {
+        return false;
+    }
+    evt = (const void *)&buf->data[1];
+
+    // コントローラの時刻 (us) は RTC0 のカウンタを拡張したもの。カウンタ値と端数に分け、
+    // RTC1 のカウンタ値に直してから、いまの時刻に最も近い過去のサイクルカウンタ値にする
+    uint64_t anchor_us = sys_le64_to_cpu(evt->anchor_point_us);
+    uint64_t ticks = anchor_us * RTC_HZ / USEC_PER_SEC;
+    uint16_t frac_us = (uint16_t)(anchor_us - ticks * USEC_PER_SEC / RTC_HZ);
+    uint32_t now = k_cycle_get_32();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t rtc1 = ((uint32_t)ticks + rtc_offset) & RTC_MASK;
+    struct anchor *a = find_anchor(sys_le16_to_cpu(evt->conn_handle), true);
+    if (a) {
+        a->valid = true;
+        a->handle = sys_le16_to_cpu(evt->conn_handle);
+        a->counter = sys_le16_to_cpu(evt->event_counter);
+        a->cycles = now - ((now - rtc1) & RTC_MASK);
+        a->frac_us = frac_us;
+    }
+    stats.anchor_reports++;
+    k_spin_unlock(&lock, key);
+
+    return true;
+}
+
+static bool get_anchor(struct bt_conn *conn, struct anchor *out)
+{
+    uint16_t handle;
+
+    if (bt_hci_get_conn_handle(conn, &handle)) return false;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct anchor *a = find_anchor(handle, false);
+    if (a) *out = *a;
+    k_spin_unlock(&lock, key);
+    return a != NULL;
+}
+
+// サイクルカウンタの差 (符号付き) を us にする
+static int32_t cyc_to_us_signed(int32_t cycles)
+{
+    return cycles < 0 ? -(int32_t)k_cyc_to_us_floor32(-cycles) : (int32_t)k_cyc_to_us_floor32(cycles);
+}
+
+// アンカーから使える範囲 (実際に起きる接続イベントの間隔の数)。ペリフェラルレイテンシで間引いた
+// 接続イベントでは報告が来ないので、(latency + 1) 間隔を 1 つと数える
+static uint32_t max_age_us(const struct bt_conn_info *info)
+{
+    return PRESS_TIME_ANCHOR_MAX_PERIODS * (info->le.latency + 1U) * info->le.interval * 1250U;
+}
+
+static void count_stale(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.stale++;
+    k_spin_unlock(&lock, key);
+}
+
+#endif /* PRESS_TIME_ANCHOR */
+
+bool press_time_map(struct bt_conn *conn, uint32_t edge_cycles, uint16_t *event_counter, int32_t *offset_us)
+{
+#if PRESS_TIME_ANCHOR
+    struct bt_conn_info info;
+    struct anchor a;
+
+    if (bt_conn_get_info(conn, &info) || !get_anchor(conn, &a)) return false;
+
+    int32_t offset = cyc_to_us_signed((int32_t)(edge_cycles - a.cycles)) - a.frac_us;
+    // 古いアンカーからは送らない (報告が止まっている、またはスリープクロックの誤差が積もる)
+    if ((uint32_t)abs(offset) > max_age_us(&info)) {
+        count_stale();
+        return false;
+    }
+
+    *event_counter = a.counter;
+    *offset_us = offset;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool press_time_event_us(struct bt_conn *conn, uint16_t event_counter, uint32_t *us)
+{
+#if PRESS_TIME_ANCHOR
+    struct bt_conn_info info;
+    struct anchor a;
+
+    if (bt_conn_get_info(conn, &info) || !get_anchor(conn, &a)) return false;
+
+    // 接続間隔が一定とみなせるのは、アンカーが新しい (接続パラメータの更新で捨てている) 間だけ
+    int16_t events = (int16_t)(event_counter - a.counter);
+    int32_t interval_us = info.le.interval * 1250U;
+    if ((uint32_t)abs(events) * interval_us > max_age_us(&info)) {
+        count_stale();
+        return false;
+    }
+
+    *us = k_cyc_to_us_floor32(a.cycles) + a.frac_us + events * interval_us;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void build(struct bt_conn *conn, struct press_time_report *rep)
+{
+    rep->seq = seq;
+    rep->flags = last_flags;
+    rep->event_counter = 0;
+    rep->offset_us = 0;
+    rep->edge_us = k_cyc_to_us_floor32(last_edge_cycles);
+    if (press_time_map(conn, last_edge_cycles, &rep->event_counter, &rep->offset_us)) {
+        rep->flags |= PRESS_TIME_FLAG_ANCHOR;
+    }
+}
+
+static ssize_t read_press(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                          void *buf, uint16_t len, uint16_t offset)
+{
+    struct press_time_report rep;
+
+    build(conn, &rep);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &rep, sizeof(rep));
+}
+
+BT_GATT_SERVICE_DEFINE(press_time_svc,
+    BT_GATT_PRIMARY_SERVICE(&press_svc_uuid.uuid),
+    BT_GATT_CHARACTERISTIC(&press_chr_uuid.uuid, BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ_ENCRYPT, read_press, NULL, NULL),
+    BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+);
+
+// 購読している接続ごとに、その接続のアンカーに対応づけて通知する
+static void notify_conn(struct bt_conn *conn, void *data)
+{
+    struct press_time_report rep;
+
+    if (!bt_gatt_is_subscribed(conn, &press_time_svc.attrs[1], BT_GATT_CCC_NOTIFY)) return;
+
+    build(conn, &rep);
+    int err = bt_gatt_notify(conn, &press_time_svc.attrs[1], &rep, sizeof(rep));
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (rep.flags & PRESS_TIME_FLAG_ANCHOR) {
+        stats.mapped++;
+    } else {
+        stats.unmapped++;
+    }
+    if (err) stats.notify_fails++;
+    k_spin_unlock(&lock, key);
+
+    if (err) {
+        printk("press time notify failed: %d\n", err);
+    }
+}
+
+void press_time_init(void)
+{
+#if PRESS_TIME_ANCHOR
+    measure_rtc_offset();
+
+    int err = bt_hci_register_vnd_evt_cb(vs_event);
+    if (!err) {
+        err = enable_conn_anchor_report(true);
+    }
+    if (err) {
+        printk("press time: anchor report not available (err %d)\n", err);
+    }
+#endif
+}
+
+void press_time_send(uint32_t edge_cycles, bool pressed)
+{
+    seq++;
+    last_flags = pressed ? PRESS_TIME_FLAG_PRESSED : 0;
+    last_edge_cycles = edge_cycles;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.edges++;
+    k_spin_unlock(&lock, key);
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, notify_conn, NULL);
+}
+
+#if PRESS_TIME_ANCHOR
+static void mark_live(struct bt_conn *conn, void *data)
+{
+    bool *live = data;
+    uint16_t handle;
+
+    if (bt_hci_get_conn_handle(conn, &handle)) return;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct anchor *a = find_anchor(handle, false);
+    if (a) live[a - anchors] = true;
+    k_spin_unlock(&lock, key);
+}
+#endif
+
+void press_time_param_updated(struct bt_conn *conn)
+{
+#if PRESS_TIME_ANCHOR
+    uint16_t handle;
+
+    if (bt_hci_get_conn_handle(conn, &handle)) return;
+
+    // 前の接続間隔のアンカーからは外挿できないので、次の報告を待つ
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct anchor *a = find_anchor(handle, false);
+    if (a) a->valid = false;
+    k_spin_unlock(&lock, key);
+#endif
+}
+
+void press_time_disconnected(struct bt_conn *conn)
+{
+#if PRESS_TIME_ANCHOR
+    // 切断した接続のハンドルはもう引けないので、接続中の接続のもの以外を捨てる
+    // (同じハンドルが次の接続で使われたとき、古いアンカーに対応づけないように)
+    bool live[ARRAY_SIZE(anchors)] = { 0 };
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, mark_live, live);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (size_t i = 0; i < ARRAY_SIZE(anchors); i++) {
+        if (!live[i]) anchors[i].valid = false;
+    }
+    k_spin_unlock(&lock, key);
+#endif
+}
+
+void press_time_get_stats(struct press_time_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *out = stats;
+    k_spin_unlock(&lock, key);
+    out->anchor = PRESS_TIME_ANCHOR;
+}
+
+void press_time_print_stats(void)
+{
+    struct press_time_stats st;
+
+    press_time_get_stats(&st);
+    printk("press time: anchor %s, %u anchor reports, %u edges, %u mapped, %u unmapped, %u stale, %u notify fails\n",
+        st.anchor ? "on" : "off", st.anchor_reports, st.edges, st.mapped, st.unmapped, st.stale, st.notify_fails);
+}
+
+
+/* End of press_time.c */
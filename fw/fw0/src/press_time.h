@@ -0,0 +1,81 @@
+/* This file is press_time.h, key edge timestamps mapped to the connection event timeline */
+
+#ifndef PRESS_TIME_H_
+#define PRESS_TIME_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+#include "hub_link.h"
+
+// 接続イベントのアンカーの時刻は SoftDevice Controller のベンダー固有イベントで受け取る (press_time.conf)。
+// それ以外のコントローラでは、エッジの時刻だけを送る
+#if defined(CONFIG_BT_LL_SOFTDEVICE) && defined(CONFIG_BT_HCI_VS_EVT_USER)
+#define PRESS_TIME_ANCHOR 1
+#else
+#define PRESS_TIME_ANCHOR 0
+#endif
+
+// アンカーから何周期 (実際に起きる接続イベントの間隔) 離れたエッジまで対応づけるか
+#define PRESS_TIME_ANCHOR_MAX_PERIODS 2
+
+// ベンダー UUID のベースは hub_link.h と共通
+#define PRESS_TIME_UUID_SVC_VAL HUB_UUID_ENCODE(2)
+#define PRESS_TIME_UUID_CHR_VAL HUB_UUID_ENCODE(3)
+
+#define PRESS_TIME_FLAG_PRESSED BIT(0)  // 押下のエッジ (0 なら解放)
+#define PRESS_TIME_FLAG_ANCHOR BIT(1)   // event_counter と offset_us が有効
+
+// 押下/解放のエッジの時刻の通知。ホストは自分の側の接続イベント event_counter のアンカーの
+// 時刻に offset_us を足せば、リンクの接続間隔やペリフェラルレイテンシによらずエッジの時刻が分かる。
+// 複数のユニットのエッジをホストの時計で並べて、どれが先に押されたかを決められる。
+// エッジの時刻はキーのピンの割り込みでサイクルカウンタ (RTC1, 32768Hz) を読んだもので、
+// 分解能は 1/32768 秒 (約 30.5us) に割り込みの遅延が加わる。1us 単位の捕捉 (GPIOTE から PPI で
+// TIMER をキャプチャ) は TIMER のために HFCLK を動かし続けることになり、電池で動く 1 キーの
+// ユニットには重いので行わない。これより近い押下の順はホスト側で同着として扱うこと
+struct press_time_report {
+    uint8_t seq;                // 通知ごとに 1 ずつ増える
+    uint8_t flags;              // PRESS_TIME_FLAG_*
+    uint16_t event_counter;     // 基準にした接続イベントのカウンタ (この接続のもの)
+    int32_t offset_us;          // その接続イベントのアンカーからエッジまで (負ならアンカーより前)
+    uint32_t edge_us;           // エッジの時刻 (このユニットの起動からの us)
+} __packed;
+
+struct press_time_stats {
+    bool anchor;                // アンカーの時刻を受け取れる (PRESS_TIME_ANCHOR)
+    uint32_t anchor_reports;    // 受け取ったアンカーの報告
+    uint32_t edges;             // 送ったエッジ
+    uint32_t mapped;            // 接続イベントに対応づけて送った通知
+    uint32_t unmapped;          // アンカーがまだない・古いので、エッジの時刻だけで送った通知
+    uint32_t stale;             // アンカーから離れすぎていて対応づけなかった数 (PRESS_TIME_ANCHOR_MAX_PERIODS)
+    uint32_t notify_fails;
+};
+
+// bt_enable() の後に呼ぶ。アンカーの時刻の報告を有効にする
+void press_time_init(void);
+
+// エッジの時刻 (サイクルカウンタ値) を、この接続の接続イベントのアンカーからの時間に変換する。
+// アンカーがないか、PRESS_TIME_ANCHOR_MAX_PERIODS より離れていれば偽
+bool press_time_map(struct bt_conn *conn, uint32_t edge_cycles, uint16_t *event_counter, int32_t *offset_us);
+
+// この接続の接続イベント event_counter のアンカーの時刻 (起動からの us)。
+// 最後に受け取ったアンカーから接続間隔で外挿する (ハブで子機のエッジの時刻を復元する)。
+// 外挿は PRESS_TIME_ANCHOR_MAX_PERIODS の範囲だけで、それより離れていれば偽
+bool press_time_event_us(struct bt_conn *conn, uint16_t event_counter, uint32_t *us);
+
+// キーの押下/解放が確定したときにメインループから呼ぶ。購読しているすべての接続に通知する
+void press_time_send(uint32_t edge_cycles, bool pressed);
+
+// 接続パラメータが変わったときに BT のコールバックから呼ぶ (前の接続間隔のアンカーを捨てる)
+void press_time_param_updated(struct bt_conn *conn);
+
+// 切断時に BT のコールバックから呼ぶ
+void press_time_disconnected(struct bt_conn *conn);
+
+void press_time_get_stats(struct press_time_stats *stats);
+void press_time_print_stats(void);
+
+#endif /* PRESS_TIME_H_ */
+
+
+/* End of press_time.h */
@@ -0,0 +1,61 @@
+/* This file is stack_usage.c, thread stack high-water report for sizing the stacks */
+
+#include "includes.h"
+#include "stack_usage.h"
+
+// スタックの使用量は未使用部分のパターン (CONFIG_INIT_STACKS) から求める。
+// stack.conf を重ねてビルドしたときだけ有効になる
+
+static size_t main_size;
+static size_t main_used;
+
+struct stack_total {
+    size_t size;
+    size_t used;
+};
+
+void stack_usage_main_done(void)
+{
+    size_t unused;
+
+    if (k_thread_stack_space_get(k_current_get(), &unused) == 0) {
+        main_size = k_current_get()->stack_info.size;
+        main_used = main_size - unused;
+    }
+}
+
+static void print_thread(const struct k_thread *cthread, void *user_data)
+{
+    struct k_thread *thread = (struct k_thread *)cthread;
+    struct stack_total *total = user_data;
+    const char *name = k_thread_name_get(thread);
+    size_t size = thread->stack_info.size;
+    size_t unused;
+
+    if (k_thread_stack_space_get(thread, &unused) != 0) return;
+
+    printk("stack %-20s %5u/%5u bytes (%u%%)\n", name ? name : "unnamed",
+        (uint32_t)(size - unused), (uint32_t)size,
+        size ? (uint32_t)((size - unused) * 100 / size) : 0);
+    total->size += size;
+    total->used += size - unused;
+}
+
+void stack_usage_print_stats(void)
+{
+    struct stack_total total = { 0 };
+
+    k_thread_foreach(print_thread, &total);
+    if (main_size) {
+        // メインスレッドは初期化だけをして終了している
+        printk("stack %-20s %5u/%5u bytes (exited)\n", "main",
+            (uint32_t)main_used, (uint32_t)main_size);
+        total.size += main_size;
+        total.used += main_used;
+    }
+    printk("stack total: %u bytes allocated, %u bytes high water, %u bytes spare\n",
+        (uint32_t)total.size, (uint32_t)total.used, (uint32_t)(total.size - total.used));
+}
+
+
+/* End of stack_usage.c */
@@ -0,0 +1,19 @@
+/* This file is stack_usage.h, thread stack high-water report for sizing the stacks */
+
+#ifndef STACK_USAGE_H_
+#define STACK_USAGE_H_
+
+#include <zephyr/types.h>
+#include <stddef.h>
+
+// main() が return する直前に呼ぶ。メインスレッドは終了して列挙できなくなるので、
+// ここで使用量を記録しておく
+void stack_usage_main_done(void);
+
+// スレッドごとのスタックのサイズと最大使用量、全体の合計を表示する
+void stack_usage_print_stats(void);
+
+#endif /* STACK_USAGE_H_ */
+
+
+/* End of stack_usage.h */
@@ -0,0 +1,385 @@
+/* This file is state_machine.c, advertising / LED / pairing state machine */
+
+#include "includes.h"
+#include "events.h"
+#include "deadline.h"
+#include "adv_sched.h"
+#include "led_buttons.h"
+#include "tx_power.h"
+#include "state_machine.h"
+
+#define DEVICE_NAME CONFIG_BT_DEVICE_NAME
+#define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
+
+#define ADV_LED_BLINK_ON_TIME 20 // in ms // ペアリング待ちのときの LED 点滅時間
+#define ADV_LED_BLINK_OFF_TIME 500 // in ms
+
+#define CONFIRM_LED_BLINK_ON_TIME 20 // in ms // 確認待ちのときの LED 点滅時間
+#define CONFIRM_LED_BLINK_OFF_TIME 200 // in ms
+
+// ペアリングタイムアウト時間（ミリ秒）
+#define PAIRING_TIMEOUT_MS 30000
+
+// アドバタイズの開始に失敗したとき (接続の空き待ちやバッファ不足) にやり直すまでの時間
+#define ADV_RETRY_MS 1000
+
+static const struct bt_data ad[] = {
+    BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE, (CONFIG_BT_DEVICE_APPEARANCE >> 0) & 0xff, (CONFIG_BT_DEVICE_APPEARANCE >> 8) & 0xff),
+    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+    BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL), BT_UUID_16_ENCODE(BT_UUID_BAS_VAL)),
+};
+
+static const struct bt_data sd[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
+};
+
+// LED の点滅パターン
+enum led_pattern {
+    LED_OFF,
+    LED_BLINK_ADV,
+    LED_BLINK_CONFIRM,
+};
+
+// LED点滅用タイマーの定義
+static void led_timeout_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(adv_led_timer, led_timeout_handler, 10);
+
+// ペアリングタイムアウト用タイマーの定義
+static void pairing_timeout_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(pairing_timeout_timer, pairing_timeout_handler, 1000);
+
+// アドバタイズのやり直し用タイマーの定義
+static void adv_retry_handler(struct deadline *dummy);
+static DEADLINE_DEFINE(adv_retry_timer, adv_retry_handler, 500);
+
+// 状態ごとの定義。アドバタイズと LED は、遷移のたびに現在の状態と比べて違うときだけ操作する
+struct sm_state_desc {
+    const char *name;
+    bool adv;                   // アドバタイズするかどうか
+    uint8_t led;                // enum led_pattern
+    void (*entry)(void);        // 入るときの処理
+    void (*exit)(void);         // 出るときの処理
+};
+
+static void pairing_entry(void);
+static void pairing_exit(void);
+static void usb_entry(void);
+static void usb_exit(void);
+
+static const struct sm_state_desc states[SM_STATE_COUNT] = {
+    [SM_ADVERTISING] = { "advertising", true,  LED_BLINK_ADV,     NULL,          NULL },
+    [SM_CONNECTED]   = { "connected",   false, LED_OFF,           NULL,          NULL },
+    [SM_PAIRING]     = { "pairing",     true,  LED_BLINK_ADV,     pairing_entry, pairing_exit },
+    [SM_CONFIRM]     = { "confirm",     false, LED_BLINK_CONFIRM, NULL,          NULL },
+    [SM_USB]         = { "usb",         false, LED_OFF,           usb_entry,     usb_exit },
+};
+
+static const char *const event_names[SM_EV_COUNT] = {
+    [SM_EV_CONNECTED] = "connected",
+    [SM_EV_ALL_DISCONNECTED] = "all disconnected",
+    [SM_EV_PAIRING_START] = "pairing start",
+    [SM_EV_PAIRING_TIMEOUT] = "pairing timeout",
+    [SM_EV_PAIRING_END] = "pairing end",
+    [SM_EV_CONFIRM_REQUEST] = "confirm request",
+    [SM_EV_USB_ATTACHED] = "usb attached",
+    [SM_EV_USB_DETACHED] = "usb detached",
+};
+
+// 遷移表。0 はその状態に留まる。RESOLVE は USB と接続の有無で SM_USB / SM_CONNECTED / SM_ADVERTISING に決まる
+#define STAY 0
+#define TO(state) ((state) + 1)
+#define RESOLVE (SM_STATE_COUNT + 1)
+BUILD_ASSERT(RESOLVE <= UINT8_MAX, "state table entry overflow");
+
+static const uint8_t transitions[SM_STATE_COUNT][SM_EV_COUNT] = {
+    [SM_ADVERTISING] = {
+        [SM_EV_CONNECTED] = TO(SM_CONNECTED),
+        [SM_EV_PAIRING_START] = TO(SM_PAIRING),
+        [SM_EV_CONFIRM_REQUEST] = TO(SM_CONFIRM),
+        [SM_EV_USB_ATTACHED] = TO(SM_USB),
+    },
+    [SM_CONNECTED] = {
+        [SM_EV_ALL_DISCONNECTED] = TO(SM_ADVERTISING),
+        [SM_EV_PAIRING_START] = TO(SM_PAIRING),
+        [SM_EV_CONFIRM_REQUEST] = TO(SM_CONFIRM),
+        [SM_EV_USB_ATTACHED] = TO(SM_USB),
+    },
+    [SM_PAIRING] = {
+        // 接続されるとアドバタイズは止まるが、受付時間中は再開する (状態はそのまま)
+        [SM_EV_PAIRING_TIMEOUT] = RESOLVE,
+        [SM_EV_PAIRING_END] = RESOLVE,
+        [SM_EV_CONFIRM_REQUEST] = TO(SM_CONFIRM),
+        [SM_EV_USB_ATTACHED] = TO(SM_USB),
+    },
+    [SM_CONFIRM] = {
+        // 確認中に USB が挿されたら確認は取りやめる (SM_USB に入るときに BLE の接続を切る)
+        [SM_EV_ALL_DISCONNECTED] = RESOLVE,
+        [SM_EV_PAIRING_END] = RESOLVE,
+        [SM_EV_USB_ATTACHED] = TO(SM_USB),
+    },
+    [SM_USB] = {
+        // 有線の間はペアリングボタンを無視する
+        [SM_EV_USB_DETACHED] = RESOLVE,
+    },
+};
+
+// 以下はメインループからのみ触る (LED のパターンだけはタイマーのハンドラからも読む)
+static enum sm_state state = SM_ADVERTISING;
+static bool connected;          // 接続が一つでもあるか
+static bool usb;                // USB のホストに認識されているか
+static bool adv_on;             // アドバタイズ中かどうか
+static volatile uint8_t led_pattern = LED_OFF;
+static sm_usb_cb usb_cb;        // SM_USB に入る/出るときに呼ぶ
+static bool led_on;             // 点滅中の LED の次の状態
+
+static struct sm_trace_entry trace[SM_TRACE_LEN];
+static uint8_t trace_next;
+static struct sm_stats stats;
+
+// LED点滅用のタイマーコールバックハンドラ
+static void led_timeout_handler(struct deadline *dummy)
+{
+    bool confirm = led_pattern == LED_BLINK_CONFIRM;
+
+    if (led_pattern == LED_OFF) return;
+
+    set_led(led_on);
+    if (led_on) {
+        deadline_start(&adv_led_timer,
+            confirm ? K_MSEC(CONFIRM_LED_BLINK_ON_TIME) : K_MSEC(ADV_LED_BLINK_ON_TIME), K_NO_WAIT);
+    } else {
+        deadline_start(&adv_led_timer,
+            confirm ? K_MSEC(CONFIRM_LED_BLINK_OFF_TIME) : K_MSEC(ADV_LED_BLINK_OFF_TIME), K_NO_WAIT);
+    }
+    led_on = !led_on;
+}
+
+static void set_led_pattern(uint8_t pattern)
+{
+    if (pattern == led_pattern) return;
+
+    bool was_blinking = led_pattern != LED_OFF;
+    led_pattern = pattern;
+    if (pattern == LED_OFF) {
+        deadline_stop(&adv_led_timer);
+        set_led(0);
+    } else if (!was_blinking) {
+        // 消灯から点滅へ。パターンの切り替えだけなら、次の満了から新しい時間になる
+        led_on = false;
+        deadline_start(&adv_led_timer, K_MSEC(ADV_LED_BLINK_ON_TIME), K_NO_WAIT);
+    }
+}
+
+// Starts advertising process
+static void adv_start(void)
+{
+    int err;
+
+    struct bt_le_adv_param adv_param = {
+        .options = BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_ONE_TIME,
+        .peer = NULL
+    };
+
+    // アドバタイズ間隔はスケジューラが決める
+    adv_sched_get_param(&adv_param);
+
+    stats.adv_starts++;
+    err = bt_le_adv_start(&adv_param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+    if (err == -EALREADY) {
+        printk("Advertising continued\n");
+    } else if (err) {
+        // -ENOMEM (接続の解放待ち) や -ECONNLIMIT などは時間をおけば通るので、タイマーでやり直す
+        printk("bt_le_adv_start() failed (err %d)\n", err);
+        stats.adv_retries++;
+        deadline_start(&adv_retry_timer, K_MSEC(ADV_RETRY_MS), K_NO_WAIT);
+        return;
+    } else {
+        printk("Advertising successfully started\n");
+    }
+    adv_on = true;
+    adv_sched_started();
+    tx_power_adv_started();
+}
+
+// Stops advertizing
+static void adv_stop(void)
+{
+    stats.adv_stops++;
+    int err = bt_le_adv_stop();
+    if (err) {
+        printk("bt_le_adv_stop() failed (err %d)\n", err);
+        return;
+    }
+    printk("Advertising stopped\n");
+    adv_on = false;
+    adv_sched_stopped();
+}
+
+static void adv_retry_handler(struct deadline *dummy)
+{
+    post_event(EVENT_ADV_RETRY);
+}
+
+// アドバタイズを状態の定義に合わせる
+static void apply_adv(void)
+{
+    bool want = states[state].adv;
+
+    // やり直し待ちは、ここで始めるか不要になるかのどちらか
+    deadline_stop(&adv_retry_timer);
+
+    if (want && !adv_on) {
+        adv_start();
+    } else if (!want && adv_on) {
+        adv_stop();
+    }
+}
+
+// アドバタイズ間隔を変更するため、アドバタイズをやり直す
+static void restart_adv(void)
+{
+    if (adv_on) {
+        adv_stop();
+        apply_adv();
+    }
+}
+
+static void pairing_timeout_handler(struct deadline *dummy)
+{
+    post_event(EVENT_PAIRING_TIMEOUT);
+}
+
+static void pairing_entry(void)
+{
+    // タイマーを設定してタイムアウトを待つ
+    deadline_start(&pairing_timeout_timer, K_MSEC(PAIRING_TIMEOUT_MS), K_NO_WAIT);
+    // アドバタイズ中なら高速バーストからやり直す
+    if (adv_sched_reset()) restart_adv();
+}
+
+static void pairing_exit(void)
+{
+    deadline_stop(&pairing_timeout_timer);
+}
+
+static void usb_entry(void)
+{
+    if (usb_cb) usb_cb(true);
+}
+
+static void usb_exit(void)
+{
+    if (usb_cb) usb_cb(false);
+}
+
+static void record_trace(enum sm_state from, enum sm_state to, enum sm_event ev)
+{
+    struct sm_trace_entry *t = &trace[trace_next];
+
+    t->time_ms = k_uptime_get_32();
+    t->from = from;
+    t->to = to;
+    t->event = ev;
+    trace_next = (trace_next + 1) % SM_TRACE_LEN;
+}
+
+void sm_init(sm_usb_cb cb)
+{
+    usb_cb = cb;
+    state = SM_ADVERTISING;
+    apply_adv();
+    set_led_pattern(states[state].led);
+}
+
+void sm_event(enum sm_event ev)
+{
+    stats.events++;
+
+    switch (ev) {
+    case SM_EV_CONNECTED:
+        // 接続されたらコネクタブルなアドバタイズはコントローラが止めている
+        connected = true;
+        if (adv_on) {
+            adv_on = false;
+            adv_sched_stopped();
+        }
+        break;
+    case SM_EV_ALL_DISCONNECTED:
+        connected = false;
+        break;
+    case SM_EV_USB_ATTACHED:
+        usb = true;
+        break;
+    case SM_EV_USB_DETACHED:
+        usb = false;
+        break;
+    default:
+        break;
+    }
+
+    uint8_t next = transitions[state][ev];
+    if (next == RESOLVE) {
+        next = TO(usb ? SM_USB : connected ? SM_CONNECTED : SM_ADVERTISING);
+    }
+
+    if (next != STAY && next - 1 != state) {
+        enum sm_state from = state;
+
+        if (states[from].exit) states[from].exit();
+        state = next - 1;
+        stats.transitions++;
+        record_trace(from, state, ev);
+        printk("State %s -(%s)-> %s\n", states[from].name, event_names[ev], states[state].name);
+        apply_adv();
+        set_led_pattern(states[state].led);
+        if (states[state].entry) states[state].entry();
+    } else {
+        // 状態が変わらなくても、接続でアドバタイズが止まった場合などは合わせる
+        apply_adv();
+    }
+}
+
+enum sm_state sm_state(void)
+{
+    return state;
+}
+
+void sm_adv_reset(void)
+{
+    if (adv_sched_reset()) restart_adv();
+}
+
+void sm_adv_advance(void)
+{
+    if (adv_sched_advance()) restart_adv();
+}
+
+void sm_adv_retry(void)
+{
+    apply_adv();
+}
+
+const char *sm_state_name(uint8_t s)
+{
+    return s < SM_STATE_COUNT ? states[s].name : "?";
+}
+
+void sm_get_stats(struct sm_stats *st)
+{
+    *st = stats;
+}
+
+void sm_print_trace(void)
+{
+    printk("state machine: %u events, %u transitions, adv start %u stop %u retry %u\n",
+        stats.events, stats.transitions, stats.adv_starts, stats.adv_stops, stats.adv_retries);
+    for (int i = 0; i < SM_TRACE_LEN; i++) {
+        const struct sm_trace_entry *t = &trace[(trace_next + i) % SM_TRACE_LEN];
+        if (t->time_ms == 0) continue;
+        printk("  %u ms: %s -(%s)-> %s\n", t->time_ms, states[t->from].name,
+            event_names[t->event], states[t->to].name);
+    }
+}
+
+
+/* End of state_machine.c */
@@ -0,0 +1,77 @@
+/* This file is state_machine.h, advertising / LED / pairing state machine */
+
+#ifndef STATE_MACHINE_H_
+#define STATE_MACHINE_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+// 状態。アドバタイズと LED の点滅パターンは状態ごとに決まっている
+enum sm_state {
+    SM_ADVERTISING,     // 接続がない: アドバタイズ中、LED はアドバタイズの点滅
+    SM_CONNECTED,       // 接続中: アドバタイズしない、LED 消灯
+    SM_PAIRING,         // ペアリングボタンが押されてからタイムアウトまで: アドバタイズ中
+    SM_CONFIRM,         // パスキーの「確認」待ち: LED は確認待ちの点滅
+    SM_USB,             // USB で有線接続中: アドバタイズしない、LED 消灯
+
+    SM_STATE_COUNT
+};
+
+// 状態機械への入力
+enum sm_event {
+    SM_EV_CONNECTED,        // 接続された
+    SM_EV_ALL_DISCONNECTED, // すべての接続が切れた
+    SM_EV_PAIRING_START,    // ペアリングボタンが押された
+    SM_EV_PAIRING_TIMEOUT,  // ペアリングの受付時間が過ぎた
+    SM_EV_PAIRING_END,      // ペアリングが完了/失敗/キャンセルされた
+    SM_EV_CONFIRM_REQUEST,  // パスキーの確認を求められた
+    SM_EV_USB_ATTACHED,     // USB のホストに認識された
+    SM_EV_USB_DETACHED,     // VBUS がなくなった
+
+    SM_EV_COUNT
+};
+
+// 遷移の履歴を残す数
+#define SM_TRACE_LEN 16
+
+struct sm_trace_entry {
+    uint32_t time_ms;
+    uint8_t from;       // enum sm_state
+    uint8_t to;         // enum sm_state
+    uint8_t event;      // enum sm_event
+};
+
+struct sm_stats {
+    uint32_t events;        // 入力されたイベントの数
+    uint32_t transitions;   // 状態が変わった回数
+    uint32_t adv_starts;    // bt_le_adv_start() を呼んだ回数
+    uint32_t adv_stops;     // bt_le_adv_stop() を呼んだ回数
+    uint32_t adv_retries;   // bt_le_adv_start() に失敗してやり直しを予定した回数
+};
+
+// SM_USB に入る (active = true) / 出るときに呼ばれる。
+// BLE の接続を切る・送信先を切り替えるなどは、どの遷移で入っても同じようにここで行う
+typedef void (*sm_usb_cb)(bool active);
+
+// 初期状態 (SM_ADVERTISING) に入る。bt_enable() と設定の読み込みの後で呼ぶ
+void sm_init(sm_usb_cb cb);
+
+// イベントを入力する。以下の関数はすべてメインループから呼ぶこと
+void sm_event(enum sm_event ev);
+enum sm_state sm_state(void);
+
+// アドバタイズ間隔のスケジュールを高速バーストに戻す (キー入力時)
+void sm_adv_reset(void);
+// アドバタイズ間隔のスケジュールを進める (EVENT_ADV_SCHEDULE)
+void sm_adv_advance(void);
+// アドバタイズの開始に失敗したあとのやり直し (EVENT_ADV_RETRY)
+void sm_adv_retry(void);
+
+const char *sm_state_name(uint8_t state);
+void sm_get_stats(struct sm_stats *stats);
+void sm_print_trace(void);
+
+#endif /* STATE_MACHINE_H_ */
+
+
+/* End of state_machine.h */
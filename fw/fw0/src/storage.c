@@ -0,0 +1,236 @@
+/* This file is storage.c, staged settings load and idle-time storage maintenance */
+
+#include "includes.h"
+#include <string.h>
+#include <zephyr/fs/nvs.h>
+#include "storage.h"
+#if defined(CONFIG_SETTINGS_NVS)
+#include "storage_wb.h"
+#endif
+
+// バックグラウンドで読み込むトップレベルのサブツリーの最大数。
+// 統計を取る先頭 2 階層のサブツリーより多くはならない ("hub" と Zephyr のサブシステムの分で足りる)
+#define DEFERRED_MAX STORAGE_SUBTREE_MAX
+
+static const char *const boot_subtrees[] = STORAGE_BOOT_SUBTREES;
+
+static void deferred_work_handler(struct k_work *work);
+static K_WORK_DEFINE(deferred_work, deferred_work_handler);
+
+static void gc_work_handler(struct k_work *work);
+static K_WORK_DEFINE(gc_work, gc_work_handler);
+
+// 統計はワークキューで更新し、メインループから読むのでスピンロックで保護する
+static struct k_spinlock lock;
+static struct storage_stats stats;
+
+// 走査中に見つけた、起動時に読み込まなかったトップレベルのサブツリー
+static char deferred[DEFERRED_MAX][STORAGE_SUBTREE_NAME_LEN];
+static int deferred_count;
+static bool deferred_overflow;  // DEFERRED_MAX に入りきらなかった
+
+static uint32_t elapsed_us(uint32_t start)
+{
+    return k_cyc_to_us_floor32(k_cycle_get_32() - start);
+}
+
+// name の先頭 levels 階層を buf にコピーする
+static void copy_levels(char *buf, const char *name, int levels)
+{
+    int i = 0;
+
+    for (; name[i] && i < STORAGE_SUBTREE_NAME_LEN - 1; i++) {
+        if (name[i] == SETTINGS_NAME_SEPARATOR && --levels == 0) break;
+        buf[i] = name[i];
+    }
+    buf[i] = '\0';
+}
+
+static bool is_boot_subtree(const char *top)
+{
+    for (int i = 0; i < ARRAY_SIZE(boot_subtrees); i++) {
+        if (strcmp(top, boot_subtrees[i]) == 0) return true;
+    }
+    return false;
+}
+
+static uint32_t load_subtree(const char *subtree)
+{
+    uint32_t start = k_cycle_get_32();
+    int err = settings_load_subtree(subtree);
+    uint32_t us = elapsed_us(start);
+
+    if (err) {
+        printk("settings_load_subtree(\"%s\") failed (err %d)\n", subtree, err);
+    }
+    printk("Settings \"%s\" loaded in %u us\n", subtree, us);
+    return us;
+}
+
+void storage_load_boot(void)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(boot_subtrees); i++) {
+        total += load_subtree(boot_subtrees[i]);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.boot_load_us = total;
+    k_spin_unlock(&lock, key);
+}
+
+// 全レコードを走査してサブツリーごとの件数とサイズを数える (値は読まない)
+static int scan_cb(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    struct storage_stats *st = param;
+    char sub[STORAGE_SUBTREE_NAME_LEN];
+    char top[STORAGE_SUBTREE_NAME_LEN];
+    int i;
+
+    copy_levels(sub, name, 2);
+    for (i = 0; i < st->subtree_count; i++) {
+        if (strcmp(st->subtrees[i].name, sub) == 0) break;
+    }
+    if (i == st->subtree_count && i < STORAGE_SUBTREE_MAX) {
+        strcpy(st->subtrees[i].name, sub);
+        st->subtree_count++;
+    }
+    if (i < st->subtree_count) {
+        st->subtrees[i].records++;
+        st->subtrees[i].bytes += len;
+    }
+
+    copy_levels(top, name, 1);
+    if (!is_boot_subtree(top)) {
+        for (i = 0; i < deferred_count; i++) {
+            if (strcmp(deferred[i], top) == 0) break;
+        }
+        if (i == deferred_count) {
+            if (i < DEFERRED_MAX) {
+                strcpy(deferred[deferred_count++], top);
+            } else {
+                deferred_overflow = true;
+            }
+        }
+    }
+    return 0;
+}
+
+static void deferred_work_handler(struct k_work *work)
+{
+    static struct storage_stats scan;
+    uint32_t start = k_cycle_get_32();
+    uint32_t total = 0;
+
+    memset(&scan, 0, sizeof(scan));
+    deferred_count = 0;
+    deferred_overflow = false;
+    settings_load_subtree_direct(NULL, scan_cb, &scan);
+    scan.scan_us = elapsed_us(start);
+
+    if (deferred_overflow) {
+        // 読み込まないものが残らないよう、すべてを読み込む (起動時の分も読み直すが害はない)
+        printk("Settings: more than %d subtrees, loading all\n", DEFERRED_MAX);
+        start = k_cycle_get_32();
+        int err = settings_load();
+        if (err) {
+            printk("settings_load() failed (err %d)\n", err);
+        }
+        total = elapsed_us(start);
+    } else {
+        for (int i = 0; i < deferred_count; i++) {
+            total += load_subtree(deferred[i]);
+        }
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.deferred_load_us = total;
+    stats.scan_us = scan.scan_us;
+    stats.subtree_count = scan.subtree_count;
+    memcpy(stats.subtrees, scan.subtrees, sizeof(stats.subtrees));
+    k_spin_unlock(&lock, key);
+
+    storage_print_stats();
+}
+
+void storage_load_deferred(void)
+{
+    k_work_submit(&deferred_work);
+}
+
+// NVS はセクタが一杯になったときに書き込みの中で GC (次のセクタの消去と有効なレコードのコピー) をする。
+// ボンディング中や DFU 中にそれが起きないよう、アクティブなセクタの空きが少なければ
+// アイドル時に先にセクタを切り替えて GC を済ませておく
+static void gc_work_handler(struct k_work *work)
+{
+    void *storage;
+    struct nvs_fs *fs;
+
+#if defined(CONFIG_SETTINGS_NVS)
+    // アイドルになったので、溜めてある設定の書き込みを先に済ませる
+    storage_wb_flush("idle");
+#endif
+
+    if (settings_storage_get(&storage) || !storage) return;
+    fs = storage;
+
+    ssize_t sector_free = nvs_sector_max_data_size(fs);
+    if (sector_free < 0 || sector_free >= STORAGE_GC_THRESHOLD) return;
+
+    uint32_t start = k_cycle_get_32();
+    int err = nvs_sector_use_next(fs);
+    uint32_t us = elapsed_us(start);
+
+    if (err) {
+        printk("nvs_sector_use_next() failed (err %d)\n", err);
+        return;
+    }
+    printk("Storage compacted in %u us (%d bytes were left in sector)\n", us, (int)sector_free);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.gc_count++;
+    if (us > stats.gc_max_us) stats.gc_max_us = us;
+    k_spin_unlock(&lock, key);
+}
+
+void storage_idle(void)
+{
+    k_work_submit(&gc_work);
+}
+
+void storage_get_stats(struct storage_stats *st)
+{
+    void *storage;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *st = stats;
+    k_spin_unlock(&lock, key);
+
+    st->free_bytes = -ENOENT;
+    if (settings_storage_get(&storage) == 0 && storage) {
+        st->free_bytes = nvs_calc_free_space((struct nvs_fs *)storage);
+    }
+}
+
+void storage_print_stats(void)
+{
+    struct storage_stats st;
+
+    storage_get_stats(&st);
+    printk("settings load: boot %u us, deferred %u us, full scan %u us, free %d bytes\n",
+        st.boot_load_us, st.deferred_load_us, st.scan_us, st.free_bytes);
+    for (int i = 0; i < st.subtree_count; i++) {
+        printk("settings \"%s\": %u records, %u bytes\n",
+            st.subtrees[i].name, st.subtrees[i].records, st.subtrees[i].bytes);
+    }
+    if (st.gc_count) {
+        printk("storage compaction: %u times, max %u us\n", st.gc_count, st.gc_max_us);
+    }
+#if defined(CONFIG_SETTINGS_NVS)
+    storage_wb_print_stats();
+#endif
+}
+
+
+/* End of storage.c */
@@ -0,0 +1,53 @@
+/* This file is storage.h, staged settings load and idle-time storage maintenance */
+
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+// 起動時に同期で読み込むサブツリー。再接続に必要な ID とボンディング情報だけ。
+// CCC は接続時に読み込む (CONFIG_BT_SETTINGS_CCC_LAZY_LOADING)
+#define STORAGE_BOOT_SUBTREES { "bt" }
+
+// アクティブなセクタの空きがこれを下回ったら、アイドル時にコンパクションする (バイト)
+#define STORAGE_GC_THRESHOLD 1024
+
+// 統計を取るサブツリーの最大数 (先頭 2 階層ごと: "bt/keys" など)
+#define STORAGE_SUBTREE_MAX 12
+#define STORAGE_SUBTREE_NAME_LEN 16
+
+struct storage_subtree_stats {
+    char name[STORAGE_SUBTREE_NAME_LEN];
+    uint16_t records;
+    uint16_t bytes;
+};
+
+struct storage_stats {
+    uint32_t boot_load_us;      // 起動時の同期読み込みにかかった時間
+    uint32_t deferred_load_us;  // バックグラウンドでの読み込みにかかった時間
+    uint32_t scan_us;           // 全レコードの走査にかかった時間 (全部を読み込んだ場合の目安)
+    uint32_t gc_count;          // アイドル時のコンパクションの回数
+    uint32_t gc_max_us;         // 同最長時間
+    int32_t free_bytes;         // ストレージ全体の空き (負ならエラー)
+    uint8_t subtree_count;
+    struct storage_subtree_stats subtrees[STORAGE_SUBTREE_MAX];
+};
+
+// 起動時に bt_enable() の後で呼ぶ。STORAGE_BOOT_SUBTREES だけを読み込む
+void storage_load_boot(void);
+
+// 残りのサブツリーをシステムワークキューで読み込む。アドバタイズを開始した後に呼ぶ
+void storage_load_deferred(void);
+
+// アイドルになったときに呼ぶ。溜めてある設定の書き込みを済ませ (storage_wb.c)、
+// 必要ならシステムワークキューでコンパクションする
+void storage_idle(void);
+
+void storage_get_stats(struct storage_stats *stats);
+void storage_print_stats(void);
+
+#endif /* STORAGE_H_ */
+
+
+/* End of storage.h */
@@ -0,0 +1,238 @@
+/* This file is storage_wb.c, write-back cache between the settings backend and NVS */
+
+#include "includes.h"
+#include <string.h>
+#include <zephyr/fs/nvs.h>
+#include "storage_wb.h"
+
+// NVS の書き込み位置 (ate_wra) の上位 16 ビットがセクタ番号 (nvs_priv.h の ADDR_SECT_SHIFT)
+#define NVS_ADDR_SECT_SHIFT 16
+
+// リンカが本来の関数を __real_ の名前で残す
+ssize_t __real_nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len);
+int __real_nvs_delete(struct nvs_fs *fs, uint16_t id);
+ssize_t __real_nvs_read_hist(struct nvs_fs *fs, uint16_t id, void *data, size_t len, uint16_t cnt);
+
+// RAM に溜めたレコード。空きは fs == NULL で、溜めたものは前に詰めてある。
+// 配列の順が書き込まれた順になり、書き出しもこの順に行う (設定のバックエンドは値・名前の順に書く)
+static struct wb_entry {
+    struct nvs_fs *fs;
+    uint16_t id;
+    int16_t len;                // -1 なら削除
+    uint8_t data[STORAGE_WB_DATA_MAX];
+} entries[STORAGE_WB_ENTRIES];
+
+// 設定の保存は BT のスレッド・システムワークキュー・メインループのどこからでも呼ばれる
+static K_MUTEX_DEFINE(wb_mutex);
+static struct storage_wb_stats stats;
+
+static void flush_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+
+static struct wb_entry *find_entry(struct nvs_fs *fs, uint16_t id)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        if (entries[i].fs == fs && entries[i].id == id) return &entries[i];
+    }
+    return NULL;
+}
+
+// 溜めたレコードを一つ捨て、後ろを前に詰める
+static void remove_entry(struct wb_entry *e)
+{
+    size_t i = e - entries;
+
+    memmove(&entries[i], &entries[i + 1], (ARRAY_SIZE(entries) - i - 1) * sizeof(entries[0]));
+    entries[ARRAY_SIZE(entries) - 1].fs = NULL;
+    stats.pending--;
+}
+
+static struct wb_entry *find_free(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        if (!entries[i].fs) return &entries[i];
+    }
+    return NULL;
+}
+
+// フラッシュに書き、時間と消去を数える (wb_mutex 取得済みで呼ぶこと)
+static ssize_t write_flash(struct nvs_fs *fs, uint16_t id, const void *data, size_t len)
+{
+    uint32_t sector = fs->ate_wra >> NVS_ADDR_SECT_SHIFT;
+    uint32_t start = k_cycle_get_32();
+    ssize_t rc = len ? __real_nvs_write(fs, id, data, len) : __real_nvs_delete(fs, id);
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    if (us > stats.stall_max_us) stats.stall_max_us = us;
+    if ((fs->ate_wra >> NVS_ADDR_SECT_SHIFT) != sector) {
+        // 次のセクタに移った。NVS はその先のセクタを消去して GC している
+        stats.flash_erases++;
+    }
+    if (rc > 0) {
+        stats.flash_writes++;
+        stats.flash_bytes += rc;
+    } else if (rc == 0) {
+        // 書き込みなら同じ値だった。削除なら消した
+        if (len) stats.flash_unchanged++; else stats.flash_writes++;
+    }
+    return rc;
+}
+
+// 溜めたものを順に書く (wb_mutex 取得済みで呼ぶこと)。
+// 書けなかったら、そのレコードから後ろは順番を守って残し、STORAGE_WB_RETRY_MS 後にやり直す
+static int flush_locked(const char *reason)
+{
+    uint32_t start = k_cycle_get_32();
+    int count = 0;
+    int err = 0;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(entries); i++) {
+        struct wb_entry *e = &entries[i];
+
+        if (!e->fs) break;  // 溜めたものは前に詰めてある
+        ssize_t rc = write_flash(e->fs, e->id, e->data, e->len < 0 ? 0 : e->len);
+        if (rc < 0) {
+            err = (int)rc;
+            stats.flash_fails++;
+            printk("Storage flush: id %u failed (err %d), retry in %d ms\n", e->id, err, STORAGE_WB_RETRY_MS);
+            break;
+        }
+        count++;
+    }
+
+    // 書けたものを捨て、残りを前に詰める
+    for (int n = 0; n < count; n++) {
+        remove_entry(&entries[0]);
+    }
+    if (err) {
+        k_work_reschedule(&flush_work, K_MSEC(STORAGE_WB_RETRY_MS));
+    }
+    if (!count) return err;
+
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    stats.flushes++;
+    if (us > stats.flush_max_us) stats.flush_max_us = us;
+    printk("Storage flushed %d records in %u us (%s)\n", count, us, reason);
+    return err;
+}
+
+// 書き込みを溜める。溜められなければ、先に全部書いてから直接書く
+static ssize_t buffer_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len, bool del)
+{
+    ssize_t rc;
+
+    k_mutex_lock(&wb_mutex, K_FOREVER);
+    stats.writes++;
+
+    struct wb_entry *e = NULL;
+    if (len <= STORAGE_WB_DATA_MAX) {
+        e = find_entry(fs, id);
+        if (e) {
+            stats.coalesced++;
+        } else {
+            e = find_free();
+            if (!e) {
+                flush_locked("full");
+                // 書けずに空かなければ、このレコードは直接書く
+                e = find_free();
+            }
+            if (e) {
+                e->fs = fs;
+                e->id = id;
+                stats.pending++;
+                if (stats.pending == 1) {
+                    // 最初に溜めたものから STORAGE_WB_MAX_AGE_MS 以内に書く (すでに予定があればそのまま)
+                    k_work_schedule(&flush_work, K_MSEC(STORAGE_WB_MAX_AGE_MS));
+                }
+            }
+        }
+    }
+
+    if (e) {
+        e->len = del ? -1 : (int16_t)len;
+        if (!del) memcpy(e->data, data, len);
+        rc = del ? 0 : (ssize_t)len;
+    } else {
+        // 溜めてある古い値を残さないよう、順番を守って全部書いてから書く。
+        // 書けずに残った同じレコードの古い値は、後で上書きしないよう捨てる
+        flush_locked("large record");
+        struct wb_entry *old = find_entry(fs, id);
+        if (old) remove_entry(old);
+        stats.write_through++;
+        rc = write_flash(fs, id, data, del ? 0 : len);
+    }
+    k_mutex_unlock(&wb_mutex);
+    return rc;
+}
+
+ssize_t __wrap_nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len)
+{
+    // NVS と同じく長さ 0 の書き込みは削除
+    return buffer_write(fs, id, data, len, len == 0);
+}
+
+int __wrap_nvs_delete(struct nvs_fs *fs, uint16_t id)
+{
+    return buffer_write(fs, id, NULL, 0, true);
+}
+
+ssize_t __wrap_nvs_read_hist(struct nvs_fs *fs, uint16_t id, void *data, size_t len, uint16_t cnt)
+{
+    ssize_t rc;
+
+    k_mutex_lock(&wb_mutex, K_FOREVER);
+    struct wb_entry *e = find_entry(fs, id);
+    if (!e) {
+        rc = __real_nvs_read_hist(fs, id, data, len, cnt);
+    } else if (cnt > 0) {
+        // 溜めてあるものが最新なので、履歴はフラッシュの一つ新しい側から
+        rc = __real_nvs_read_hist(fs, id, data, len, cnt - 1);
+    } else if (e->len < 0) {
+        rc = -ENOENT;
+    } else {
+        memcpy(data, e->data, MIN(len, (size_t)e->len));
+        rc = e->len;
+    }
+    k_mutex_unlock(&wb_mutex);
+    return rc;
+}
+
+ssize_t __wrap_nvs_read(struct nvs_fs *fs, uint16_t id, void *data, size_t len)
+{
+    return __wrap_nvs_read_hist(fs, id, data, len, 0);
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+    storage_wb_flush("deferred");
+}
+
+int storage_wb_flush(const char *reason)
+{
+    k_mutex_lock(&wb_mutex, K_FOREVER);
+    int err = flush_locked(reason);
+    k_mutex_unlock(&wb_mutex);
+    return err;
+}
+
+void storage_wb_get_stats(struct storage_wb_stats *out)
+{
+    k_mutex_lock(&wb_mutex, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&wb_mutex);
+}
+
+void storage_wb_print_stats(void)
+{
+    struct storage_wb_stats st;
+
+    storage_wb_get_stats(&st);
+    printk("storage wb: %u writes, %u coalesced, %u through, %u flushes (max %u us), %u pending\n",
+        st.writes, st.coalesced, st.write_through, st.flushes, st.flush_max_us, st.pending);
+    printk("flash: %u writes (%u bytes), %u unchanged, %u erases, %u fails, stall max %u us\n",
+        st.flash_writes, st.flash_bytes, st.flash_unchanged, st.flash_erases, st.flash_fails, st.stall_max_us);
+}
+
+
+/* End of storage_wb.c */
@@ -0,0 +1,43 @@
+/* This file is storage_wb.h, write-back cache between the settings backend and NVS */
+
+#ifndef STORAGE_WB_H_
+#define STORAGE_WB_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+// 設定の NVS バックエンドの nvs_write/nvs_delete をリンカで横取りし (-Wl,--wrap)、RAM に溜める。
+// 同じレコードへの書き込み (CCC の書き換えなど) はまとめて一度だけフラッシュに書く。
+// nvs_read/nvs_read_hist も横取りし、まだ書いていない値を返す
+#define STORAGE_WB_ENTRIES 10           // RAM に溜めておけるレコードの数
+#define STORAGE_WB_DATA_MAX 96          // これより大きいレコードは溜めずにすぐ書く (bt/keys は 80 バイト程度)
+#define STORAGE_WB_MAX_AGE_MS 60000     // アイドルにならなくても、溜めてからこの時間で書く
+#define STORAGE_WB_RETRY_MS 5000        // 書けなかったレコードは RAM に残し、この時間の後に書き直す
+
+struct storage_wb_stats {
+    uint32_t writes;            // 設定からの書き込み・削除
+    uint32_t coalesced;         // RAM 上で上書きされ、フラッシュに書かずに済んだもの
+    uint32_t write_through;     // 大きすぎて溜めずに書いたもの
+    uint32_t flushes;           // RAM に溜めたものを書き出した回数
+    uint32_t flash_writes;      // 実際にフラッシュに書いたレコード
+    uint32_t flash_unchanged;   // 同じ値だったので NVS が書かなかったレコード
+    uint32_t flash_bytes;
+    uint32_t flash_erases;      // 書き込みの中で起きたセクタの消去 (NVS の GC を伴う)
+    uint32_t flash_fails;       // 書けなかったレコード (RAM に残して書き直す)
+    uint32_t stall_max_us;      // 1 回の書き込み (消去・GC を含む) の最長時間
+    uint32_t flush_max_us;      // 1 回の書き出しの最長時間
+    uint8_t pending;            // いま RAM にあるレコード
+};
+
+// RAM に溜めたものをすぐに書き出す (呼び出したスレッドで書く。ISR からは呼ばないこと)。
+// 電源を切る前 (System OFF・リセット) とボンディングの変更の前後には必ず呼ぶ。
+// 書けなかったものがあれば負のエラー (残りは STORAGE_WB_RETRY_MS 後に書き直す)
+int storage_wb_flush(const char *reason);
+
+void storage_wb_get_stats(struct storage_wb_stats *stats);
+void storage_wb_print_stats(void);
+
+#endif /* STORAGE_WB_H_ */
+
+
+/* End of storage_wb.h */
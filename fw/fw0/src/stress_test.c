@@ -0,0 +1,294 @@
+/* This file is stress_test.c, event-storm stress harness for the main loop */
+
+#include "includes.h"
+#include "events.h"
+#include "stress_test.h"
+#include "deadline.h"
+#include "gesture.h"
+#include "storage.h"
+#include "metrics.h"
+#include "led_buttons.h"
+#include "state_machine.h"
+#include "link_monitor.h"
+#include "tx_power.h"
+#include "gatt_cache.h"
+#include "pair_timing.h"
+#include "ctlr_bench.h"
+#include "press_time.h"
+#include "dev_pm.h"
+#if defined(CONFIG_USB_DEVICE_HID)
+#include "usb_transport.h"
+#endif
+#if defined(CONFIG_INIT_STACKS)
+#include "stack_usage.h"
+#endif
+#if defined(CONFIG_BT_CENTRAL)
+#include "hub.h"
+#endif
+
+#if USE_STRESS_TEST
+
+// キー入力がデバウンスを通過してメインループで処理されるまでに必要な時間
+#define STRESS_SETTLE_MS 60
+// チャタリング中のエッジ間隔の最大値
+#define STRESS_BOUNCE_GAP_MAX_US 4000
+// ペアリングボタンを押している時間
+#define STRESS_PAIRING_BTN_HOLD_MS 50
+
+// 再現性のある乱数 (xorshift32)。イベント源ごとに状態を持つので排他は不要
+static uint32_t rand_next(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// 平均 mean_ms の一様乱数で間隔を決める
+static uint32_t rand_interval_ms(uint32_t *state, uint32_t mean_ms)
+{
+    return 1 + rand_next(state) % (2 * mean_ms);
+}
+
+static volatile bool storm_running;
+
+// ----------------------------------------------------------------------------
+// キー: タイマー ISR から、チャタリングを伴うエッジを発生させる
+
+static void stress_key_timer_handler(struct k_timer *timer);
+K_TIMER_DEFINE(stress_key_timer, stress_key_timer_handler, NULL);
+
+static uint32_t key_rand_state;
+static int key_level;           // 最終的に落ち着くレベル
+static int key_bounces_left;    // 残りのチャタリング回数
+static uint32_t key_hold_ms;    // 直前に落ち着いてから経過させた時間
+static uint32_t key_bursts;
+static uint32_t stuck_key_incidents;
+static bool stuck_reported;
+
+static void check_stuck_key(void)
+{
+    // キューが空で、物理的なキーの状態とメインループの状態が食い違っている
+    if (event_queue_used() == 0 && event_key_state_diverged()) {
+        if (!stuck_reported) {
+            stuck_key_incidents++;
+            stuck_reported = true;
+        }
+    } else {
+        stuck_reported = false;
+    }
+}
+
+static void stress_key_timer_handler(struct k_timer *timer)
+{
+    if (key_bounces_left > 0) {
+        // チャタリング中: 目標レベルとその反対を交互に出す
+        key_bounces_left--;
+        stress_key_edge((key_bounces_left & 1) ? !key_level : key_level);
+        k_timer_start(&stress_key_timer,
+            K_USEC(1 + rand_next(&key_rand_state) % STRESS_BOUNCE_GAP_MAX_US), K_NO_WAIT);
+        return;
+    }
+
+    if (key_bounces_left == 0) {
+        // チャタリング終了、レベルを確定させてしばらく保持する
+        key_bounces_left = -1;
+        stress_key_edge(key_level);
+        key_hold_ms = rand_interval_ms(&key_rand_state, STRESS_KEY_BURST_INTERVAL_MS);
+        k_timer_start(&stress_key_timer, K_MSEC(key_hold_ms), K_NO_WAIT);
+        return;
+    }
+
+    // 保持期間が終わった
+    if (key_hold_ms >= STRESS_SETTLE_MS) {
+        check_stuck_key();
+    }
+
+    if (!storm_running) {
+        // 終了時はキーを離した状態にしておく
+        if (key_level) {
+            key_level = 0;
+            key_bounces_left = 0;
+            k_timer_start(&stress_key_timer, K_MSEC(1), K_NO_WAIT);
+        }
+        return;
+    }
+
+    key_bursts++;
+    key_level = !key_level;
+    key_bounces_left = (int)(rand_next(&key_rand_state) % (STRESS_MAX_BOUNCES + 1)) * 2;
+    k_timer_start(&stress_key_timer, K_USEC(1), K_NO_WAIT);
+}
+
+// ----------------------------------------------------------------------------
+// ペアリングボタン: タイマー ISR から押下/解放を発生させる
+
+static void stress_pairing_btn_timer_handler(struct k_timer *timer);
+K_TIMER_DEFINE(stress_pairing_btn_timer, stress_pairing_btn_timer_handler, NULL);
+
+static uint32_t pairing_btn_rand_state;
+static bool pairing_btn_down;
+static uint32_t pairing_btn_presses;
+
+static void stress_pairing_btn_timer_handler(struct k_timer *timer)
+{
+    if (pairing_btn_down) {
+        pairing_btn_down = false;
+        stress_pairing_button_edge(0);
+        if (storm_running) {
+            k_timer_start(&stress_pairing_btn_timer,
+                K_MSEC(rand_interval_ms(&pairing_btn_rand_state, STRESS_PAIRING_BTN_INTERVAL_MS)),
+                K_NO_WAIT);
+        }
+        return;
+    }
+
+    pairing_btn_presses++;
+    pairing_btn_down = true;
+    stress_pairing_button_edge(1);
+    k_timer_start(&stress_pairing_btn_timer, K_MSEC(STRESS_PAIRING_BTN_HOLD_MS), K_NO_WAIT);
+}
+
+// ----------------------------------------------------------------------------
+// BT コールバック: スレッドから、接続/切断やペアリング結果と同じイベントを投入する
+// (実際の接続テーブルやフラグには触れない)
+
+static uint32_t conn_rand_state;
+static uint32_t pairing_cb_rand_state;
+static uint32_t conn_callbacks;
+static uint32_t pairing_callbacks;
+
+static void fire_callback_burst(uint32_t *state, uint32_t *counter, uint8_t type)
+{
+    uint32_t n = 1 + rand_next(state) % STRESS_CALLBACK_BURST_MAX;
+    for (uint32_t i = 0; i < n; i++) {
+        // disconnected() は EVENT_DISCONNECTED (メインループが接続テーブルから判断し直す)、
+        // pairing_complete() / pairing_failed() / auth_cancel() は EVENT_PAIRING_END を投入する
+        post_event(type);
+        (*counter)++;
+    }
+}
+
+static void print_report(const char *title)
+{
+    struct event_queue_stats st;
+
+    get_event_queue_stats(&st);
+
+    printk("---- stress %s @%u ms ----\n", title, k_uptime_get_32());
+    printk("sources: key bursts %u, pairing btn %u, conn cb %u, pairing cb %u\n",
+        key_bursts, pairing_btn_presses, conn_callbacks, pairing_callbacks);
+    printk("queue: posted %u, dropped %u, high water %u/%u\n",
+        st.posted, st.dropped, st.high_water, st.capacity);
+    for (int i = 0; i < EVENT_TYPE_COUNT; i++) {
+        if (st.dropped_by_type[i]) {
+            printk("  dropped %s: %u\n", event_name(i), st.dropped_by_type[i]);
+        }
+    }
+    printk("key: lost transitions %u, stuck incidents %u\n",
+        st.key_lost_transitions, stuck_key_incidents);
+    printk("service latency: avg %u us, max %u us (%u events)\n",
+        st.latency_avg_us, st.latency_max_us, st.serviced);
+    deadline_print_stats();
+    sm_print_trace();
+    input_print_stats();
+    gesture_print_stats();
+    storage_print_stats();
+    metrics_print();
+    link_monitor_print_stats();
+    tx_power_print_stats();
+    gatt_cache_print_stats();
+    pair_timing_print_stats();
+    ctlr_bench_print_stats();
+    press_time_print_stats();
+    dev_pm_print_stats();
+#if defined(CONFIG_USB_DEVICE_HID)
+    usb_transport_print_stats();
+#endif
+#if defined(CONFIG_INIT_STACKS)
+    stack_usage_print_stats();
+#endif
+#if defined(CONFIG_BT_CENTRAL)
+    hub_print_stats();
+#endif
+}
+
+static void stress_thread_entry(void *p1, void *p2, void *p3)
+{
+    int64_t start = k_uptime_get();
+    int64_t next_conn = start;
+    int64_t next_pairing_cb = start;
+    int64_t next_report = start + STRESS_REPORT_INTERVAL_MS;
+
+    key_rand_state = STRESS_SEED;
+    pairing_btn_rand_state = STRESS_SEED ^ 0x9e3779b9U;
+    conn_rand_state = STRESS_SEED ^ 0x85ebca6bU;
+    pairing_cb_rand_state = STRESS_SEED ^ 0xc2b2ae35U;
+
+    printk("Stress test started (seed 0x%08x, %u ms)\n", STRESS_SEED, STRESS_DURATION_MS);
+    reset_event_queue_stats();
+    deadline_reset_stats();
+    storm_running = true;
+
+    key_bounces_left = -1;
+    if (STRESS_KEY_BURST_INTERVAL_MS) {
+        k_timer_start(&stress_key_timer, K_MSEC(1), K_NO_WAIT);
+    }
+    if (STRESS_PAIRING_BTN_INTERVAL_MS) {
+        k_timer_start(&stress_pairing_btn_timer,
+            K_MSEC(rand_interval_ms(&pairing_btn_rand_state, STRESS_PAIRING_BTN_INTERVAL_MS)),
+            K_NO_WAIT);
+    }
+
+    while (true) {
+        int64_t now = k_uptime_get();
+
+        if (now - start >= STRESS_DURATION_MS) break;
+
+        if (STRESS_CONN_INTERVAL_MS && now >= next_conn) {
+            fire_callback_burst(&conn_rand_state, &conn_callbacks, EVENT_DISCONNECTED);
+            next_conn = now + rand_interval_ms(&conn_rand_state, STRESS_CONN_INTERVAL_MS);
+        }
+        if (STRESS_PAIRING_CB_INTERVAL_MS && now >= next_pairing_cb) {
+            fire_callback_burst(&pairing_cb_rand_state, &pairing_callbacks, EVENT_PAIRING_END);
+            next_pairing_cb = now + rand_interval_ms(&pairing_cb_rand_state, STRESS_PAIRING_CB_INTERVAL_MS);
+        }
+        if (now >= next_report) {
+            print_report("progress");
+            next_report = now + STRESS_REPORT_INTERVAL_MS;
+        }
+
+        int64_t next = next_report;
+        if (STRESS_CONN_INTERVAL_MS && next_conn < next) next = next_conn;
+        if (STRESS_PAIRING_CB_INTERVAL_MS && next_pairing_cb < next) next = next_pairing_cb;
+        if (next > now) k_msleep((int32_t)(next - now));
+    }
+
+    // ストームを止め、キーが離された状態で落ち着くのを待つ
+    storm_running = false;
+    k_msleep(STRESS_SETTLE_MS + STRESS_KEY_BURST_INTERVAL_MS * 2 + STRESS_MAX_BOUNCES * 8);
+    check_stuck_key();
+
+    print_report("result");
+
+    // 落ち着いた後は、参照数と PM の状態が合っていなければならない (native_sim では異常終了する)
+    if (!dev_pm_check()) {
+        printk("Stress test FAILED: dev pm inconsistent\n");
+        k_panic();
+    }
+}
+
+K_THREAD_DEFINE(stress_thread, 1024, stress_thread_entry, NULL, NULL, NULL,
+    K_LOWEST_APPLICATION_THREAD_PRIO, 0, SYS_FOREVER_MS);
+
+void stress_test_start(void)
+{
+    k_thread_start(stress_thread);
+}
+
+#endif /* USE_STRESS_TEST */
+
+
+/* End of stress_test.c */
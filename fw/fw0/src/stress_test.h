@@ -0,0 +1,62 @@
+/* This file is stress_test.h, event-storm stress harness for the main loop */
+
+#ifndef STRESS_TEST_H_
+#define STRESS_TEST_H_
+
+// ストレステストを有効にするかどうか。シミュレーションターゲット (nrf52_bsim) で
+// west build -b nrf52_bsim -- -DEXTRA_CFLAGS=-DUSE_STRESS_TEST=1
+// のように有効にして使う。実機では 0 のままにすること
+#ifndef USE_STRESS_TEST
+#define USE_STRESS_TEST 0
+#endif
+
+// 以下、テストのパラメータ。いずれもビルド時に -D で上書きできる
+
+#ifndef STRESS_SEED
+#define STRESS_SEED 0x1234abcdU // 乱数のシード (同じ値なら同じイベント列になる)
+#endif
+
+#ifndef STRESS_DURATION_MS
+#define STRESS_DURATION_MS 60000 // ストームを発生させる時間
+#endif
+
+#ifndef STRESS_REPORT_INTERVAL_MS
+#define STRESS_REPORT_INTERVAL_MS 5000 // 途中経過を表示する間隔
+#endif
+
+// 各イベント源の平均発生間隔 (ms)。0 にするとその源は無効
+#ifndef STRESS_KEY_BURST_INTERVAL_MS
+#define STRESS_KEY_BURST_INTERVAL_MS 40   // キーのチャタリングを伴う押下/解放
+#endif
+#ifndef STRESS_PAIRING_BTN_INTERVAL_MS
+#define STRESS_PAIRING_BTN_INTERVAL_MS 700 // ペアリングボタン押下
+#endif
+#ifndef STRESS_CONN_INTERVAL_MS
+#define STRESS_CONN_INTERVAL_MS 300       // 接続/切断コールバック
+#endif
+#ifndef STRESS_PAIRING_CB_INTERVAL_MS
+#define STRESS_PAIRING_CB_INTERVAL_MS 500 // ペアリング完了/失敗/キャンセルコールバック
+#endif
+
+#ifndef STRESS_MAX_BOUNCES
+#define STRESS_MAX_BOUNCES 6 // 一回の押下/解放で発生させる最大チャタリング回数
+#endif
+
+#ifndef STRESS_CALLBACK_BURST_MAX
+#define STRESS_CALLBACK_BURST_MAX 4 // BT コールバックを一度に連続で発生させる最大数
+#endif
+
+#if USE_STRESS_TEST
+// ストレステストを開始する。メインループに入る直前に呼ぶ
+void stress_test_start(void);
+
+// led_buttons.c が提供するピン変化の模擬関数。
+// 入力イベントとして直接投入するので、gpio-keys のデバウンスを通らずチャタリングもそのまま届く
+void stress_key_edge(int level);
+void stress_pairing_button_edge(int level);
+#endif
+
+#endif /* STRESS_TEST_H_ */
+
+
+/* End of stress_test.h */
@@ -0,0 +1,261 @@
+/* This file is tx_power.c, RSSI driven per-connection TX power control */
+
+#include "includes.h"
+#include "hci_util.h"
+#include "tx_power.h"
+
+// 接続イベントごとの送信時間の推定値 (us)。1M PHY の空パケット 1 つ分
+#define TXP_EVENT_TX_US 80
+
+// 設定できる送信電力 (dBm) と、そのときの送信電流 (uA, DC/DC 使用時)。
+// 電流は nRF52832 のデータシートの値 (+3dBm は補間した概算値)
+static const int8_t levels[TXP_LEVEL_COUNT] = { -40, -20, -16, -12, -8, -4, 0, 3, 4 };
+static const uint16_t current_ua[TXP_LEVEL_COUNT] = {
+    2700, 3000, 3200, 3500, 3800, 4200, 5300, 7000, 7500
+};
+
+// 接続ごとの状態 (bt_conn_index() で引く)
+static struct txp_conn {
+    struct bt_conn *conn;
+    uint8_t level;              // levels[] の添字
+    uint8_t hold;               // 続けて送信電力に余裕があった回数
+    uint32_t interval_us;       // 接続間隔
+    int64_t since;              // 現在の送信電力になった時刻
+} tc[CONFIG_BT_MAX_CONN];
+
+// BT のコールバック、リンクモニタのワーク、メインループから呼ばれるのでミューテックスで保護する
+static K_MUTEX_DEFINE(txp_mutex);
+
+static atomic_t unsupported;    // コントローラが送信電力の設定に対応していない (どのスレッドからも読む)
+static int8_t adv_dbm = INT8_MIN;
+
+// 統計 (txp_mutex で保護)
+static uint32_t stat_time_ms[TXP_LEVEL_COUNT];
+static uint64_t stat_tx_us[TXP_LEVEL_COUNT];
+static uint32_t stat_steps_down;
+static uint32_t stat_steps_up;
+static uint32_t stat_steps_up_loss;
+static uint32_t stat_errors;    // 一時的な失敗 (次の評価でやり直す)
+
+static uint8_t level_index(int8_t dbm)
+{
+    for (uint8_t i = 0; i < TXP_LEVEL_COUNT; i++) {
+        if (levels[i] >= dbm) return i;
+    }
+    return TXP_LEVEL_COUNT - 1;
+}
+
+// 現在の送信電力で接続していた時間を集計する (txp_mutex 取得済みで呼ぶこと)
+static void account_level(struct txp_conn *t)
+{
+    int64_t now = k_uptime_get();
+    uint32_t ms = (uint32_t)(now - t->since);
+
+    stat_time_ms[t->level] += ms;
+    if (t->interval_us) {
+        stat_tx_us[t->level] += (uint64_t)ms * 1000 / t->interval_us * TXP_EVENT_TX_US;
+    }
+    t->since = now;
+}
+
+// 次に使う送信電力を決める (txp_mutex 取得済みで呼ぶこと)
+static uint8_t decide_level(struct txp_conn *t, int8_t rssi, bool rssi_valid, uint32_t missed, uint8_t fails)
+{
+    if (fails || missed >= TXP_MISSED_STEP_UP) {
+        // 届いていないので、RSSI に関係なくすぐ上げる
+        t->hold = 0;
+        if (t->level + 1 < TXP_LEVEL_COUNT) {
+            stat_steps_up_loss++;
+            return t->level + 1;
+        }
+        return t->level;
+    }
+    if (!rssi_valid) return t->level;
+
+    // 経路損失は対称とみなし、ホスト側の受信電力が目標 + 余裕になる送信電力を求める
+    int path_loss = TXP_PEER_TX_DBM - rssi;
+    uint8_t want = level_index(TXP_TARGET_RSSI + path_loss + TXP_MARGIN_DB);
+
+    if (want > t->level) {
+        t->hold = 0;
+        stat_steps_up++;
+        return want;
+    }
+    if (want < t->level) {
+        // 下げるのは余裕が続いたときに 1 段ずつ
+        if (++t->hold >= TXP_DOWN_HOLD) {
+            t->hold = 0;
+            stat_steps_down++;
+            return t->level - 1;
+        }
+        return t->level;
+    }
+    t->hold = 0;
+    return t->level;
+}
+
+// 設定の失敗を記録する。対応していないときだけ以後の設定をやめる
+// (バッファ不足や切断と重なった失敗では、次の評価でやり直す)
+static void set_failed(int err)
+{
+    if (err == -ENOTSUP) {
+        if (!atomic_set(&unsupported, 1)) {
+            printk("TX power control not supported by the controller, disabled\n");
+        }
+        return;
+    }
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    stat_errors++;
+    k_mutex_unlock(&txp_mutex);
+}
+
+void tx_power_adv_started(void)
+{
+    int8_t selected;
+
+    if (atomic_get(&unsupported)) return;
+
+    int err = write_adv_tx_power(TXP_ADV_DBM, &selected);
+    if (err) {
+        set_failed(err);
+        printk("Advertising TX power not set (err %d)\n", err);
+        return;
+    }
+    if (selected != adv_dbm) {
+        printk("Advertising TX power %d dBm\n", selected);
+        adv_dbm = selected;
+    }
+}
+
+void tx_power_connected(struct bt_conn *conn)
+{
+    struct txp_conn *t = &tc[bt_conn_index(conn)];
+
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    t->conn = bt_conn_ref(conn);
+    // 接続はアドバタイズの送信電力を引き継ぐ
+    t->level = level_index(adv_dbm != INT8_MIN ? adv_dbm : TXP_CONN_DEFAULT_DBM);
+    t->hold = 0;
+    t->interval_us = 0;
+    t->since = k_uptime_get();
+    k_mutex_unlock(&txp_mutex);
+}
+
+void tx_power_disconnected(struct bt_conn *conn)
+{
+    struct txp_conn *t = &tc[bt_conn_index(conn)];
+
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    if (t->conn == conn) {
+        account_level(t);
+        bt_conn_unref(t->conn);
+        t->conn = NULL;
+    }
+    k_mutex_unlock(&txp_mutex);
+}
+
+void tx_power_update(struct bt_conn *conn, int8_t rssi, bool rssi_valid, uint32_t missed,
+                     uint8_t fails, uint32_t interval_us)
+{
+    struct txp_conn *t = &tc[bt_conn_index(conn)];
+    uint8_t from, to;
+
+    if (atomic_get(&unsupported)) return;
+
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    if (t->conn != conn) {
+        k_mutex_unlock(&txp_mutex);
+        return;
+    }
+    if (interval_us != t->interval_us) {
+        account_level(t);
+        t->interval_us = interval_us;
+    }
+    from = t->level;
+    to = decide_level(t, rssi, rssi_valid, missed, fails);
+    k_mutex_unlock(&txp_mutex);
+
+    if (to == from) return;
+
+    // HCI コマンドの完了を待つので、ロックの外で設定する
+    int8_t selected;
+    int err = write_conn_tx_power(conn, levels[to], &selected);
+    if (err) {
+        set_failed(err);
+        printk("Connection TX power not set (err %d)\n", err);
+        return;
+    }
+
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    if (t->conn == conn) {
+        account_level(t);
+        t->level = level_index(selected);
+    }
+    k_mutex_unlock(&txp_mutex);
+
+    printk("TX power %d -> %d dBm (rssi %d, missed %u, fails %u)\n",
+        levels[from], selected, rssi, missed, fails);
+}
+
+void tx_power_get_stats(struct tx_power_stats *stats)
+{
+    uint64_t charge_nc = 0;
+    uint64_t default_nc = 0;
+    uint16_t default_ua = current_ua[level_index(TXP_CONN_DEFAULT_DBM)];
+
+    k_mutex_lock(&txp_mutex, K_FOREVER);
+    for (size_t i = 0; i < ARRAY_SIZE(tc); i++) {
+        if (tc[i].conn) {
+            account_level(&tc[i]);
+            stats->conn_dbm[i] = levels[tc[i].level];
+        } else {
+            stats->conn_dbm[i] = INT8_MIN;
+        }
+    }
+    for (int i = 0; i < TXP_LEVEL_COUNT; i++) {
+        stats->level_dbm[i] = levels[i];
+        stats->time_ms[i] = stat_time_ms[i];
+        // us * uA = pC
+        charge_nc += stat_tx_us[i] * current_ua[i] / 1000;
+        default_nc += stat_tx_us[i] * default_ua / 1000;
+    }
+    stats->adv_dbm = adv_dbm;
+    stats->steps_down = stat_steps_down;
+    stats->steps_up = stat_steps_up;
+    stats->steps_up_loss = stat_steps_up_loss;
+    stats->errors = stat_errors;
+    stats->unsupported = atomic_get(&unsupported);
+    k_mutex_unlock(&txp_mutex);
+
+    stats->charge_uc = (uint32_t)(charge_nc / 1000);
+    stats->charge_default_uc = (uint32_t)(default_nc / 1000);
+}
+
+void tx_power_print_stats(void)
+{
+    struct tx_power_stats st;
+
+    tx_power_get_stats(&st);
+    for (int i = 0; i < TXP_LEVEL_COUNT; i++) {
+        if (st.time_ms[i]) {
+            printk("tx power %d dBm: %u ms\n", st.level_dbm[i], st.time_ms[i]);
+        }
+    }
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        if (st.conn_dbm[i] != INT8_MIN) {
+            printk("tx power conn %d: %d dBm\n", i, st.conn_dbm[i]);
+        }
+    }
+    // 既定の送信電力のままだった場合と比べた節約分を 0.1% 単位で表示する
+    uint32_t saved = st.charge_default_uc ?
+        (uint32_t)((uint64_t)(st.charge_default_uc - MIN(st.charge_uc, st.charge_default_uc)) * 1000
+                   / st.charge_default_uc) : 0;
+    printk("tx power: adv %d dBm, steps down %u up %u (loss %u), %u errors, "
+           "conn TX charge %u uC vs %u uC at default (%u.%u%% saved)%s\n",
+        st.adv_dbm, st.steps_down, st.steps_up, st.steps_up_loss, st.errors,
+        st.charge_uc, st.charge_default_uc, saved / 10, saved % 10,
+        st.unsupported ? ", unsupported" : "");
+}
+
+
+/* End of tx_power.c */
@@ -0,0 +1,53 @@
+/* This file is tx_power.h, RSSI driven per-connection TX power control */
+
+#ifndef TX_POWER_H_
+#define TX_POWER_H_
+
+#include <zephyr/types.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+#define TXP_ADV_DBM 0               // アドバタイズの送信電力。まだ距離の分からないホストにも届くように下げない
+#define TXP_CONN_DEFAULT_DBM 0      // 接続直後の送信電力 (コントローラのデフォルトと同じ)
+#define TXP_PEER_TX_DBM 0           // ホストの送信電力の想定値 (経路損失の推定に使う)
+#define TXP_TARGET_RSSI (-70)       // ホスト側でこの受信電力 (dBm) を保つ
+#define TXP_MARGIN_DB 10            // フェージング等に備えて上乗せする余裕
+#define TXP_DOWN_HOLD 5             // 続けてこの回数だけ余裕があれば 1 段下げる
+#define TXP_MISSED_STEP_UP 2        // 評価間隔中の接続イベントの取りこぼしがこれ以上なら 1 段上げる
+
+// nRF52832 で設定できる送信電力
+#define TXP_LEVEL_COUNT 9
+
+struct tx_power_stats {
+    int8_t level_dbm[TXP_LEVEL_COUNT];
+    uint32_t time_ms[TXP_LEVEL_COUNT];  // その送信電力で接続していた合計時間 (全接続の合計)
+    int8_t conn_dbm[CONFIG_BT_MAX_CONN];// 接続ごとの現在の送信電力 (接続していなければ INT8_MIN)
+    int8_t adv_dbm;                     // アドバタイズの送信電力 (コントローラが選んだ値)
+    uint32_t steps_down;
+    uint32_t steps_up;                  // RSSI の低下による引き上げ
+    uint32_t steps_up_loss;             // 送信失敗・取りこぼしによる引き上げ
+    uint32_t errors;                    // 送信電力の設定の一時的な失敗 (次の評価でやり直す)
+    bool unsupported;                   // コントローラが送信電力の設定に対応していない
+    uint32_t charge_uc;                 // 接続イベントの送信に使った電荷の推定値 (uC)
+    uint32_t charge_default_uc;         // すべて TXP_CONN_DEFAULT_DBM だった場合の推定値 (uC)
+};
+
+// アドバタイズを開始したあとに呼ぶ
+void tx_power_adv_started(void);
+
+// 接続/切断時に BT のコールバックから呼ぶ
+void tx_power_connected(struct bt_conn *conn);
+void tx_power_disconnected(struct bt_conn *conn);
+
+// リンクの評価結果を受け取って送信電力を決める。リンクモニタのワークから呼ばれる。
+// missed は評価間隔中に取りこぼした接続イベント、fails は続けて送信に失敗した数
+void tx_power_update(struct bt_conn *conn, int8_t rssi, bool rssi_valid, uint32_t missed,
+                     uint8_t fails, uint32_t interval_us);
+
+void tx_power_get_stats(struct tx_power_stats *stats);
+void tx_power_print_stats(void);
+
+#endif /* TX_POWER_H_ */
+
+
+/* End of tx_power.h */
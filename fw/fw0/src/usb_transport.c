@@ -0,0 +1,237 @@
+/* This file is usb_transport.c, wired USB HID transport with VBUS based switching */
+
+#include "includes.h"
+#include <string.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+#include "events.h"
+#include "usb_transport.h"
+
+// 送信中に積んでおけるレポートの数。タップ (押下と解放) が続いても失わないだけの数
+#define USB_REPORT_QUEUE 4
+
+static const struct device *hid_dev;
+
+// USB のコールバック (USB ドライバのスレッド) とメインループから触るのでスピンロックで保護する
+static struct k_spinlock lock;
+static bool configured;         // ホストに認識されて送信できる
+static bool busy;               // 前のレポートがまだ IN トークンで送られていない
+static bool suspended;          // ホストがバスをサスペンドした (レポートは再開まで積んでおく)
+static bool wakeup_requested;   // サスペンド中にリモートウェイクアップを要求した
+static uint8_t queue[USB_REPORT_QUEUE][USB_REPORT_MAX_LEN]; // busy の間に送ろうとしたレポート
+static uint8_t queue_len[USB_REPORT_QUEUE];
+static uint8_t queue_head;
+static uint8_t queue_count;
+static uint32_t write_cycles;   // 送信中のレポートを書き込んだ時刻
+
+static struct usb_transport_stats stats;
+static uint64_t latency_sum_us;
+static uint32_t latency_count;
+
+// ロック取得済みで呼ぶ
+static int write_report(const uint8_t *report, size_t len)
+{
+    int err = hid_int_ep_write(hid_dev, report, len, NULL);
+    if (err) {
+        stats.errors++;
+        return err;
+    }
+    busy = true;
+    write_cycles = k_cycle_get_32();
+    stats.reports++;
+    return 0;
+}
+
+// 積んであるレポートを一つ書き込む (ロック取得済みで呼ぶ)
+static void write_queued(void)
+{
+    if (queue_count && !busy && !suspended) {
+        write_report(queue[queue_head], queue_len[queue_head]);
+        queue_head = (queue_head + 1) % USB_REPORT_QUEUE;
+        queue_count--;
+    }
+}
+
+// 送れないレポートを積む。積みきれなければ最後のレポートを最新の状態で上書きする (ロック取得済みで呼ぶ)
+static void enqueue(const uint8_t *report, size_t len)
+{
+    uint8_t slot;
+
+    if (queue_count < USB_REPORT_QUEUE) {
+        slot = (queue_head + queue_count++) % USB_REPORT_QUEUE;
+    } else {
+        slot = (queue_head + USB_REPORT_QUEUE - 1) % USB_REPORT_QUEUE;
+        stats.coalesced++;
+    }
+    memcpy(queue[slot], report, len);
+    queue_len[slot] = len;
+}
+
+// ホストが IN トークンでレポートを取りに来た (ポーリング間隔 1ms)
+static void int_in_ready(const struct device *dev)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - write_cycles);
+
+    latency_sum_us += us;
+    latency_count++;
+    if (us > stats.latency_max_us) stats.latency_max_us = us;
+
+    busy = false;
+    write_queued();
+    k_spin_unlock(&lock, key);
+}
+
+static const struct hid_ops ops = {
+    .int_in_ready = int_in_ready,
+};
+
+static void set_configured(bool on)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool changed = configured != on;
+    configured = on;
+    busy = false;
+    suspended = false;
+    wakeup_requested = false;
+    queue_count = 0;
+    if (changed && on) stats.attaches++;
+    k_spin_unlock(&lock, key);
+
+    if (changed) {
+        post_event(on ? EVENT_USB_ATTACHED : EVENT_USB_DETACHED);
+    }
+}
+
+static void set_suspended(bool on)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (on && !suspended) stats.suspends++;
+    suspended = on;
+    if (!on) {
+        // 再開したら、サスペンド中に積んだレポートを送る
+        wakeup_requested = false;
+        write_queued();
+    }
+    k_spin_unlock(&lock, key);
+}
+
+static void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+{
+    switch (status) {
+    case USB_DC_CONNECTED:
+        // VBUS を検出した。ホストに認識される (CONFIGURED) までは BLE のまま
+        printk("USB VBUS detected\n");
+        break;
+    case USB_DC_CONFIGURED:
+        set_configured(true);
+        break;
+    case USB_DC_DISCONNECTED:
+        // VBUS がなくなった
+        set_configured(false);
+        break;
+    case USB_DC_SUSPEND:
+        // ホストがスリープした。IN トークンが来ないので送信を止める
+        set_suspended(true);
+        break;
+    case USB_DC_RESUME:
+    case USB_DC_RESET:
+        set_suspended(false);
+        break;
+    default:
+        break;
+    }
+}
+
+int usb_transport_init(const uint8_t *report_map, size_t map_len)
+{
+    int err;
+
+    hid_dev = device_get_binding("HID_0");
+    if (!hid_dev) {
+        printk("USB HID device not found\n");
+        return -ENODEV;
+    }
+
+    usb_hid_register_device(hid_dev, report_map, map_len, &ops);
+#if defined(CONFIG_USB_HID_BOOT_PROTOCOL)
+    usb_hid_set_proto_code(hid_dev, HID_BOOT_IFACE_CODE_KEYBOARD);
+#endif
+    err = usb_hid_init(hid_dev);
+    if (err) {
+        printk("usb_hid_init() failed (err %d)\n", err);
+        return err;
+    }
+
+    err = usb_enable(status_cb);
+    if (err) {
+        printk("usb_enable() failed (err %d)\n", err);
+    }
+    return err;
+}
+
+bool usb_transport_ready(void)
+{
+    return configured;
+}
+
+int usb_transport_send(const uint8_t *report, size_t len)
+{
+    int err = 0;
+    bool wakeup = false;
+
+    if (len > USB_REPORT_MAX_LEN) return -EINVAL;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (!configured) {
+        err = -ENOTCONN;
+    } else if (suspended) {
+        // 再開するまで積んでおき、ホストを起こす
+        enqueue(report, len);
+        wakeup = !wakeup_requested;
+        wakeup_requested = true;
+    } else if (busy) {
+        // 送信中のレポートの後に送る
+        enqueue(report, len);
+    } else {
+        err = write_report(report, len);
+    }
+    k_spin_unlock(&lock, key);
+
+    if (wakeup) {
+#if defined(CONFIG_USB_DEVICE_REMOTE_WAKEUP)
+        // ホストがリモートウェイクアップを許可していなければ失敗し、ホストが起きるまで待つ
+        int werr = usb_wakeup_request();
+        if (werr) {
+            printk("usb_wakeup_request() failed (err %d)\n", werr);
+        } else {
+            key = k_spin_lock(&lock);
+            stats.wakeups++;
+            k_spin_unlock(&lock, key);
+        }
+#endif
+    }
+    return err;
+}
+
+void usb_transport_get_stats(struct usb_transport_stats *st)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *st = stats;
+    st->latency_avg_us = latency_count ? (uint32_t)(latency_sum_us / latency_count) : 0;
+    k_spin_unlock(&lock, key);
+}
+
+void usb_transport_print_stats(void)
+{
+    struct usb_transport_stats st;
+
+    usb_transport_get_stats(&st);
+    printk("usb: %s%s, attached %u, reports %u coalesced %u errors %u, latency avg %u us max %u us, "
+        "suspends %u wakeups %u\n",
+        configured ? "active" : "inactive", suspended ? " (suspended)" : "", st.attaches, st.reports,
+        st.coalesced, st.errors, st.latency_avg_us, st.latency_max_us, st.suspends, st.wakeups);
+}
+
+
+/* End of usb_transport.c */
@@ -0,0 +1,42 @@
+/* This file is usb_transport.h, wired USB HID transport with VBUS based switching */
+
+#ifndef USB_TRANSPORT_H_
+#define USB_TRANSPORT_H_
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// 送信できるレポートの最大長。インタラプト IN エンドポイントの 1 パケットに収まる長さ
+// (main.c の INPUT_REPORT_MAX_LEN はこれ以下であること)
+#define USB_REPORT_MAX_LEN CONFIG_HID_INTERRUPT_EP_MPS
+
+struct usb_transport_stats {
+    uint32_t attaches;          // USB のホストに認識された回数
+    uint32_t reports;           // 送信したレポート
+    uint32_t coalesced;         // 送信待ちがあふれたので、最新の状態にまとめたレポート
+    uint32_t errors;
+    uint32_t latency_avg_us;    // レポートの書き込みから IN トークンで送られるまで
+    uint32_t latency_max_us;
+    uint32_t suspends;          // ホストがバスをサスペンドした回数 (その間のレポートは再開後に送る)
+    uint32_t wakeups;           // サスペンド中のキー入力でリモートウェイクアップを要求した回数
+};
+
+// USB HID デバイスを登録して USB を有効にする。report_map は BLE の HIDS と同じもの。
+// 以後、VBUS の検出とホストの認識で EVENT_USB_ATTACHED / EVENT_USB_DETACHED が投入される
+int usb_transport_init(const uint8_t *report_map, size_t map_len);
+
+// 有線で送れる状態かどうか
+bool usb_transport_ready(void);
+
+// レポートを送信する。前のレポートの送信中やホストのサスペンド中なら、送信完了後/再開後に順に送る。
+// サスペンド中はリモートウェイクアップを要求する (CONFIG_USB_DEVICE_REMOTE_WAKEUP)。メインループから呼ぶこと
+int usb_transport_send(const uint8_t *report, size_t len);
+
+void usb_transport_get_stats(struct usb_transport_stats *stats);
+void usb_transport_print_stats(void);
+
+#endif /* USB_TRANSPORT_H_ */
+
+
+/* End of usb_transport.h */